@@ -4,6 +4,7 @@
 #include <ArduinoJson.h>
 
 #include <Wire.h>
+#include <sys/time.h>
 #include "SparkFun_AS7265X.h"  // SparkFun AS7265x spectral sensor library
 
 // ========== Configuration ==========
@@ -21,6 +22,11 @@ const int WS_PORT = 8765;                     // WebSocket server port
 const char* WS_PATH = "/";                    // WebSocket path (root path)
 const char* WS_PROTOCOL = "ws://";            // Protocol: ws:// (plain) or wss:// (secure)
 
+// SNTP server for UTC timestamps
+const char* NTP_SERVER = "pool.ntp.org";
+// The clock reads 1970 until SNTP sets it; anything before 2024 is unset
+const time_t CLOCK_VALID_AFTER = 1704067200;
+
 // Sampling interval
 unsigned long samplingInterval = 500;         // Default: 500ms (0.5 seconds)
 unsigned long lastSampleTime = 0;
@@ -28,8 +34,17 @@ unsigned long lastSampleTime = 0;
 AS7265X sensor;
 WebSocketsClient webSocket;
 
+// ========== Clock ==========
+// UTC in microseconds since the epoch, or 0 until SNTP has set the clock
+int64_t utcMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  if (tv.tv_sec < CLOCK_VALID_AFTER) return 0;
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 // ========== WebSocket Functions ==========
-void sendSpectralDataOverWebSocket(float data[18]) {
+void sendSpectralDataOverWebSocket(float data[18], int64_t timestampUs) {
   if (!webSocket.isConnected()) {
     return;  // Not connected, skip sending
   }
@@ -53,6 +68,11 @@ void sendSpectralDataOverWebSocket(float data[18]) {
   }
   
   doc["timestamp"] = millis();
+  // End of the measurement in UTC, once the clock is synced
+  if (timestampUs != 0) {
+    doc["timestamp_us"] = timestampUs;
+    doc["utc"] = true;
+  }
   
   // Serialize JSON to string
   String jsonString;
@@ -90,6 +110,7 @@ void handleWebSocketMessages(String message) {
       // Server requested immediate reading
       float ch[18];
       sensor.takeMeasurementsWithBulb();
+      int64_t measuredUs = utcMicros();
       ch[0] = sensor.getCalibratedA(); ch[1] = sensor.getCalibratedB();
       ch[2] = sensor.getCalibratedC(); ch[3] = sensor.getCalibratedD();
       ch[4] = sensor.getCalibratedE(); ch[5] = sensor.getCalibratedF();
@@ -99,7 +120,7 @@ void handleWebSocketMessages(String message) {
       ch[12] = sensor.getCalibratedT(); ch[13] = sensor.getCalibratedU();
       ch[14] = sensor.getCalibratedV(); ch[15] = sensor.getCalibratedW();
       ch[16] = sensor.getCalibratedK(); ch[17] = sensor.getCalibratedL();
-      sendSpectralDataOverWebSocket(ch);
+      sendSpectralDataOverWebSocket(ch, measuredUs);
     }
     else if (strcmp(action, "set_interval") == 0) {
       // Change sampling interval
@@ -180,6 +201,9 @@ void setup() {
   Serial.print("WiFi connected! IP address: ");
   Serial.println(WiFi.localIP());
 
+  // UTC for the timestamps; SNTP keeps syncing in the background
+  configTime(0, 0, NTP_SERVER);
+
   // Initialize WebSocket
   // Build WebSocket URL: ws://IP:PORT/PATH
   String wsUrl = String(WS_PROTOCOL) + String(WS_HOST) + ":" + String(WS_PORT) + String(WS_PATH);
@@ -220,6 +244,7 @@ void loop() {
     // Take measurements using the onboard bulb
     sensor.takeMeasurementsWithBulb();  
     // If you don't want to use the bulb, use: sensor.takeMeasurements();
+    int64_t measuredUs = utcMicros();
 
     float ch[18];
 
@@ -251,7 +276,7 @@ void loop() {
     Serial.println();
 
     // Send data through WebSocket
-    sendSpectralDataOverWebSocket(ch);
+    sendSpectralDataOverWebSocket(ch, measuredUs);
   }
   
   // Small delay to prevent watchdog issues
@@ -1,9 +1,17 @@
 #include "as7265x.h"
-#include "driver/i2c.h"
+#include "i2c_driver.h"
+#include "driver/gpio.h"
 #include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include <math.h>
+#include <stdbool.h>
 #include <string.h>
 
-#define I2C_MASTER_NUM I2C_NUM_0
 #define AS7265X_ADDR 0x49
 
 #define AS7265X_SLAVE_STATUS_REG  0x00
@@ -13,53 +21,186 @@
 #define AS7265X_TX_VALID 0x02
 #define AS7265X_RX_VALID 0x01
 
-esp_err_t as7265x_virtual_write(uint8_t reg, uint8_t value) {
-    uint8_t status;
+#define AS7265X_CONFIG_REG        0x04
+#define AS7265X_INTEGRATION_REG   0x05
+#define AS7265X_LED_CONFIG_REG    0x07
+#define AS7265X_DEV_SELECT_REG    0x4F
+#define AS7265X_RAW_BASE_REG      0x08
+#define AS7265X_CAL_BASE_REG      0x14
+
+// CONFIG register bits
+#define AS7265X_CONFIG_SRST       0x80
+#define AS7265X_CONFIG_INT        0x40
+#define AS7265X_CONFIG_GAIN_SHIFT 4
+#define AS7265X_CONFIG_BANK_SHIFT 2
+#define AS7265X_CONFIG_DATA_RDY   0x02
+
+// LED_CONFIG register bits, per device
+#define AS7265X_LED_IND           0x01  // indicator LED, wired to the master only
+#define AS7265X_LED_DRV           0x08  // bulb driver
+
+#define AS7265X_DEV_UNKNOWN 0xFF
+
+#define AS7265X_CYCLE_US 2800  // one integration cycle
+
+// Bounds on the virtual register handshake. The slave normally answers
+// within a few hundred microseconds; anything near the deadline means the
+// bus or the sensor is wedged.
+#define AS7265X_I2C_TIMEOUT_MS 20
+#define AS7265X_HANDSHAKE_TIMEOUT_US 50000
+#define AS7265X_POLL_SPINS 4  // polls issued back to back before sleeping
+
+static const char *TAG = "AS7265X";
+
+static uint32_t i2c_transactions = 0;
+static uint32_t handshake_timeouts = 0;
+static histogram_t i2c_latency;      // microseconds per I2C transaction
+static histogram_t virtual_latency;  // microseconds per virtual register access
+static histogram_t readout_latency;  // microseconds per full spectrum readout
+
+// Shadow of the CONFIG register with DATA_RDY always clear, so mode changes
+// and data-ready acknowledgement are single writes with no read-modify-write
+static uint8_t config_reg = 0;
+static uint8_t integration_cycles = 0;
+static as7265x_mode_t meas_mode = AS7265X_MODE_6CHAN_ONE_SHOT;
+
+// When the frame now being integrated was started
+static int64_t frame_start_us = 0;
+
+static int int_gpio = -1;
+static SemaphoreHandle_t data_ready_sem = NULL;
+static volatile int64_t int_edge_us = 0;   // when the ISR last saw INT fall
+
+// Continuous acquisition, sampler task only
+static int64_t stream_start_us = 0;
+static int64_t stream_last_end_us = 0;
+static as7265x_stream_stats_t stream_stats;
+
+// Bulb/dark interleaving, sampler task only
+static uint8_t interleave_bulbs = 0;
+static bool interleave_lit = false;     // bulb state of the frame integrating now
 
-    do {
-        i2c_master_write_read_device(I2C_MASTER_NUM, AS7265X_ADDR,
-            (uint8_t[]){ AS7265X_SLAVE_STATUS_REG }, 1,
-            &status, 1, 100);
-    } while (status & AS7265X_TX_VALID);
+// LED_CONFIG of each device, valid for the devices in led_known
+static uint8_t led_config[AS7265X_NUM_DEVICES];
+static uint8_t led_known = 0;
 
-    uint8_t buf[2] = { AS7265X_SLAVE_WRITE_REG, reg | 0x80 };
-    ESP_ERROR_CHECK(i2c_master_write_to_device(I2C_MASTER_NUM, AS7265X_ADDR, buf, 2, 100));
+// Device currently routed by DEV_SELECT, so repeated selects can be skipped
+static uint8_t selected_dev = AS7265X_DEV_UNKNOWN;
 
-    do {
-        i2c_master_write_read_device(I2C_MASTER_NUM, AS7265X_ADDR,
-            (uint8_t[]){ AS7265X_SLAVE_STATUS_REG }, 1,
-            &status, 1, 100);
-    } while (status & AS7265X_TX_VALID);
+// Set when the last status poll saw TX_VALID clear and nothing was written to
+// the write register since. Reading the read register does not set TX_VALID,
+// so back-to-back virtual reads can skip the leading poll.
+static bool tx_ready = false;
 
-    uint8_t data_buf[2] = { AS7265X_SLAVE_WRITE_REG, value };
-    return i2c_master_write_to_device(I2C_MASTER_NUM, AS7265X_ADDR, data_buf, 2, 100);
+static void invalidate_state(void) {
+    selected_dev = AS7265X_DEV_UNKNOWN;
+    tx_ready = false;
 }
 
-esp_err_t as7265x_virtual_read(uint8_t reg, uint8_t *value) {
+// Every I2C transaction goes through read_reg() or write_slave_reg()
+static esp_err_t read_reg(uint8_t reg, uint8_t *value) {
+    int64_t start_us = esp_timer_get_time();
+
+    i2c_transactions++;
+    esp_err_t ret = i2c_device_write_read(AS7265X_ADDR, &reg, 1,
+                                          value, 1, AS7265X_I2C_TIMEOUT_MS);
+    histogram_record(&i2c_latency, (uint32_t)(esp_timer_get_time() - start_us));
+    return ret;
+}
+
+static esp_err_t read_status(uint8_t *status) {
+    return read_reg(AS7265X_SLAVE_STATUS_REG, status);
+}
+
+static esp_err_t write_slave_reg(uint8_t value) {
+    uint8_t buf[2] = { AS7265X_SLAVE_WRITE_REG, value };
+    int64_t start_us = esp_timer_get_time();
+
+    i2c_transactions++;
+    tx_ready = false;
+    esp_err_t ret = i2c_device_write(AS7265X_ADDR, buf, 2, AS7265X_I2C_TIMEOUT_MS);
+    histogram_record(&i2c_latency, (uint32_t)(esp_timer_get_time() - start_us));
+    return ret;
+}
+
+// Polls the status register until (status & mask) == want or the deadline
+// passes. The first few polls go back to back, after that we give the rest
+// of the tick to other tasks between polls.
+static esp_err_t poll_status(uint8_t mask, uint8_t want, int64_t deadline_us, uint8_t *status) {
+    for (int polls = 0;; polls++) {
+        esp_err_t ret = read_status(status);
+        if (ret != ESP_OK) return ret;
+        if ((*status & mask) == want) return ESP_OK;
+        if (esp_timer_get_time() >= deadline_us) return ESP_ERR_TIMEOUT;
+        if (polls >= AS7265X_POLL_SPINS) vTaskDelay(1);
+    }
+}
+
+static esp_err_t wait_tx_ready(int64_t deadline_us) {
     uint8_t status;
 
-    do {
-        i2c_master_write_read_device(I2C_MASTER_NUM, AS7265X_ADDR,
-            (uint8_t[]){ AS7265X_SLAVE_STATUS_REG }, 1,
-            &status, 1, 100);
-    } while (status & AS7265X_TX_VALID);
+    if (tx_ready) return ESP_OK;
 
-    uint8_t buf[2] = { AS7265X_SLAVE_WRITE_REG, reg & 0x7F };
-    ESP_ERROR_CHECK(i2c_master_write_to_device(I2C_MASTER_NUM, AS7265X_ADDR, buf, 2, 100));
+    esp_err_t ret = poll_status(AS7265X_TX_VALID, 0, deadline_us, &status);
+    if (ret == ESP_OK) tx_ready = true;
+    return ret;
+}
 
-    do {
-        i2c_master_write_read_device(I2C_MASTER_NUM, AS7265X_ADDR,
-            (uint8_t[]){ AS7265X_SLAVE_STATUS_REG }, 1,
-            &status, 1, 100);
-    } while (!(status & AS7265X_RX_VALID));
+static esp_err_t wait_rx_valid(int64_t deadline_us) {
+    uint8_t status;
+
+    esp_err_t ret = poll_status(AS7265X_RX_VALID, AS7265X_RX_VALID, deadline_us, &status);
+
+    // The poll that shows RX_VALID also tells us whether the write side is free
+    if (ret == ESP_OK) tx_ready = !(status & AS7265X_TX_VALID);
+    return ret;
+}
+
+// Bookkeeping shared by every virtual access: latency, and on failure the
+// cached bus state is dropped and the bus is cleared so the next access
+// starts from a known state
+static esp_err_t finish_access(int64_t start_us, esp_err_t ret) {
+    histogram_record(&virtual_latency, (uint32_t)(esp_timer_get_time() - start_us));
+
+    if (ret != ESP_OK) {
+        if (ret == ESP_ERR_TIMEOUT) handshake_timeouts++;
+        ESP_LOGW(TAG, "Virtual register access failed: %s", esp_err_to_name(ret));
+        invalidate_state();
+        i2c_bus_recover();
+    }
+    return ret;
+}
+
+esp_err_t as7265x_virtual_write(uint8_t reg, uint8_t value) {
+    int64_t start_us = esp_timer_get_time();
+    int64_t deadline_us = start_us + AS7265X_HANDSHAKE_TIMEOUT_US;
+
+    esp_err_t ret = wait_tx_ready(deadline_us);
+    if (ret == ESP_OK) ret = write_slave_reg(reg | 0x80);
+    if (ret == ESP_OK) ret = wait_tx_ready(deadline_us);
+    if (ret == ESP_OK) ret = write_slave_reg(value);
 
-    return i2c_master_write_read_device(I2C_MASTER_NUM, AS7265X_ADDR,
-                                        (uint8_t[]){ AS7265X_SLAVE_READ_REG }, 1,
-                                        value, 1, 100);
+    return finish_access(start_us, ret);
+}
+
+esp_err_t as7265x_virtual_read(uint8_t reg, uint8_t *value) {
+    int64_t start_us = esp_timer_get_time();
+    int64_t deadline_us = start_us + AS7265X_HANDSHAKE_TIMEOUT_US;
+
+    esp_err_t ret = wait_tx_ready(deadline_us);
+    if (ret == ESP_OK) ret = write_slave_reg(reg & 0x7F);
+    if (ret == ESP_OK) ret = wait_rx_valid(deadline_us);
+    if (ret == ESP_OK) ret = read_reg(AS7265X_SLAVE_READ_REG, value);
+
+    return finish_access(start_us, ret);
 }
 
 esp_err_t as7265x_set_device(uint8_t dev) {
-    return as7265x_virtual_write(0x4F, dev); // 0=master, 1=slave1, 2=slave2
+    if (dev == selected_dev) return ESP_OK;
+
+    esp_err_t ret = as7265x_virtual_write(AS7265X_DEV_SELECT_REG, dev); // 0=master, 1=slave1, 2=slave2
+    if (ret == ESP_OK) selected_dev = dev;
+    return ret;
 }
 
 esp_err_t as7265x_read_calibrated_value(uint8_t reg, float *value) {
@@ -74,4 +215,535 @@ esp_err_t as7265x_read_calibrated_value(uint8_t reg, float *value) {
 
     memcpy(value, &tmp, sizeof(float)); // safely convert to float
     return ESP_OK;
-}
\ No newline at end of file
+}
+
+// Reads the channels of one device in chmask (bit n = channel n of the
+// device) and leaves the others as they are. Always inlined, so a constant
+// mask resolves which registers to read at compile time.
+static inline __attribute__((always_inline))
+esp_err_t read_device_channels(uint8_t dev, uint8_t chmask, float out[AS7265X_CHANNELS_PER_DEVICE]) {
+    esp_err_t ret = as7265x_set_device(dev);
+
+    // Calibrated channels are 4 consecutive bytes each starting at 0x14
+    for (int ch = 0; ch < AS7265X_CHANNELS_PER_DEVICE; ch++) {
+        if (!(chmask & (1u << ch))) continue;
+        if (ret != ESP_OK && selected_dev != dev) {
+            out[ch] = 0.0f;
+            continue;
+        }
+        esp_err_t err = as7265x_read_calibrated_value(AS7265X_CAL_BASE_REG + ch * 4, &out[ch]);
+        if (err != ESP_OK) {
+            out[ch] = 0.0f; // fallback
+            if (ret == ESP_OK) ret = err;
+            // A failed read leaves the device selection unknown
+            as7265x_set_device(dev);
+        }
+    }
+    return ret;
+}
+
+static inline __attribute__((always_inline))
+esp_err_t read_raw_device_channels(uint8_t dev, uint8_t chmask, uint16_t out[AS7265X_CHANNELS_PER_DEVICE]) {
+    esp_err_t ret = as7265x_set_device(dev);
+
+    // Raw channels are 2 consecutive bytes each starting at 0x08
+    for (int ch = 0; ch < AS7265X_CHANNELS_PER_DEVICE; ch++) {
+        if (!(chmask & (1u << ch))) continue;
+        if (ret != ESP_OK && selected_dev != dev) {
+            out[ch] = 0;
+            continue;
+        }
+        esp_err_t err = as7265x_read_raw_value(AS7265X_RAW_BASE_REG + ch * 2, &out[ch]);
+        if (err != ESP_OK) {
+            out[ch] = 0;
+            if (ret == ESP_OK) ret = err;
+            as7265x_set_device(dev);
+        }
+    }
+    return ret;
+}
+
+esp_err_t as7265x_read_device(uint8_t dev, float out[AS7265X_CHANNELS_PER_DEVICE]) {
+    return read_device_channels(dev, AS7265X_DEVICE_ALL, out);
+}
+
+esp_err_t as7265x_read_raw_value(uint8_t reg, uint16_t *value) {
+    uint8_t hi, lo;
+
+    esp_err_t ret = as7265x_virtual_read(reg, &hi);
+    if (ret == ESP_OK) ret = as7265x_virtual_read(reg + 1, &lo);
+    if (ret != ESP_OK) return ret;
+
+    *value = ((uint16_t)hi << 8) | lo;
+    return ESP_OK;
+}
+
+esp_err_t as7265x_read_raw_device(uint8_t dev, uint16_t out[AS7265X_CHANNELS_PER_DEVICE]) {
+    return read_raw_device_channels(dev, AS7265X_DEVICE_ALL, out);
+}
+
+void as7265x_plan_init(as7265x_read_plan_t *plan, uint32_t mask) {
+    mask &= AS7265X_ALL_CHANNELS;
+    if (mask == 0) mask = AS7265X_ALL_CHANNELS;
+
+    plan->mask = mask;
+    plan->num_devices = 0;
+    for (uint8_t dev = 0; dev < AS7265X_NUM_DEVICES; dev++) {
+        uint8_t chmask = AS7265X_DEVICE_CHANNELS(mask, dev);
+        if (chmask == 0) continue;  // never selected
+        plan->devices[plan->num_devices].dev = dev;
+        plan->devices[plan->num_devices].chmask = chmask;
+        plan->num_devices++;
+    }
+}
+
+// A read with the mask known at compile time: devices without a channel in
+// it and the branches for unread channels are dropped by the compiler
+static inline __attribute__((always_inline))
+esp_err_t read_masked(uint32_t mask, float out[AS7265X_NUM_CHANNELS]) {
+    esp_err_t ret = ESP_OK;
+
+    for (uint8_t dev = 0; dev < AS7265X_NUM_DEVICES; dev++) {
+        uint8_t chmask = AS7265X_DEVICE_CHANNELS(mask, dev);
+        if (chmask == 0) continue;
+        esp_err_t err = read_device_channels(dev, chmask, &out[dev * AS7265X_CHANNELS_PER_DEVICE]);
+        if (err != ESP_OK && ret == ESP_OK) ret = err;
+    }
+    return ret;
+}
+
+static inline __attribute__((always_inline))
+esp_err_t read_raw_masked(uint32_t mask, uint16_t out[AS7265X_NUM_CHANNELS]) {
+    esp_err_t ret = ESP_OK;
+
+    for (uint8_t dev = 0; dev < AS7265X_NUM_DEVICES; dev++) {
+        uint8_t chmask = AS7265X_DEVICE_CHANNELS(mask, dev);
+        if (chmask == 0) continue;
+        esp_err_t err = read_raw_device_channels(dev, chmask, &out[dev * AS7265X_CHANNELS_PER_DEVICE]);
+        if (err != ESP_OK && ret == ESP_OK) ret = err;
+    }
+    return ret;
+}
+
+// Any other mask walks the devices listed in the plan
+static esp_err_t read_planned(const as7265x_read_plan_t *plan, float out[AS7265X_NUM_CHANNELS]) {
+    esp_err_t ret = ESP_OK;
+
+    for (int i = 0; i < plan->num_devices; i++) {
+        uint8_t dev = plan->devices[i].dev;
+        esp_err_t err = read_device_channels(dev, plan->devices[i].chmask,
+                                             &out[dev * AS7265X_CHANNELS_PER_DEVICE]);
+        if (err != ESP_OK && ret == ESP_OK) ret = err;
+    }
+    return ret;
+}
+
+static esp_err_t read_raw_planned(const as7265x_read_plan_t *plan, uint16_t out[AS7265X_NUM_CHANNELS]) {
+    esp_err_t ret = ESP_OK;
+
+    for (int i = 0; i < plan->num_devices; i++) {
+        uint8_t dev = plan->devices[i].dev;
+        esp_err_t err = read_raw_device_channels(dev, plan->devices[i].chmask,
+                                                 &out[dev * AS7265X_CHANNELS_PER_DEVICE]);
+        if (err != ESP_OK && ret == ESP_OK) ret = err;
+    }
+    return ret;
+}
+
+esp_err_t as7265x_read_plan(const as7265x_read_plan_t *plan, float out[AS7265X_NUM_CHANNELS]) {
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t ret;
+
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        if (!(plan->mask & (1u << c))) out[c] = NAN;
+    }
+
+    if (plan->mask == AS7265X_ALL_CHANNELS) {
+        ret = read_masked(AS7265X_ALL_CHANNELS, out);
+#if CONFIG_AS7265X_PLAN_FAST_PREVIEW
+    } else if (plan->mask == AS7265X_PREVIEW_CHANNELS) {
+        ret = read_masked(AS7265X_PREVIEW_CHANNELS, out);
+#endif
+#if CONFIG_AS7265X_PLAN_FAST_MASK
+    } else if (plan->mask == CONFIG_AS7265X_PLAN_FAST_MASK) {
+        ret = read_masked(CONFIG_AS7265X_PLAN_FAST_MASK & AS7265X_ALL_CHANNELS, out);
+#endif
+    } else {
+        ret = read_planned(plan, out);
+    }
+
+    histogram_record(&readout_latency, (uint32_t)(esp_timer_get_time() - start_us));
+    return ret;
+}
+
+esp_err_t as7265x_read_raw_plan(const as7265x_read_plan_t *plan, uint16_t out[AS7265X_NUM_CHANNELS]) {
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t ret;
+
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        if (!(plan->mask & (1u << c))) out[c] = 0;
+    }
+
+    if (plan->mask == AS7265X_ALL_CHANNELS) {
+        ret = read_raw_masked(AS7265X_ALL_CHANNELS, out);
+#if CONFIG_AS7265X_PLAN_FAST_PREVIEW
+    } else if (plan->mask == AS7265X_PREVIEW_CHANNELS) {
+        ret = read_raw_masked(AS7265X_PREVIEW_CHANNELS, out);
+#endif
+#if CONFIG_AS7265X_PLAN_FAST_MASK
+    } else if (plan->mask == CONFIG_AS7265X_PLAN_FAST_MASK) {
+        ret = read_raw_masked(CONFIG_AS7265X_PLAN_FAST_MASK & AS7265X_ALL_CHANNELS, out);
+#endif
+    } else {
+        ret = read_raw_planned(plan, out);
+    }
+
+    histogram_record(&readout_latency, (uint32_t)(esp_timer_get_time() - start_us));
+    return ret;
+}
+
+esp_err_t as7265x_read_raw_spectrum(uint16_t out[AS7265X_NUM_CHANNELS]) {
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t ret = read_raw_masked(AS7265X_ALL_CHANNELS, out);
+
+    histogram_record(&readout_latency, (uint32_t)(esp_timer_get_time() - start_us));
+    return ret;
+}
+
+esp_err_t as7265x_read_spectrum(float out[AS7265X_NUM_CHANNELS]) {
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t ret = read_masked(AS7265X_ALL_CHANNELS, out);
+
+    histogram_record(&readout_latency, (uint32_t)(esp_timer_get_time() - start_us));
+    return ret;
+}
+
+uint32_t as7265x_get_i2c_transactions(void) {
+    return i2c_transactions;
+}
+
+uint32_t as7265x_get_timeout_count(void) {
+    return handshake_timeouts;
+}
+
+void as7265x_get_i2c_histogram(histogram_t *out) {
+    *out = i2c_latency;
+}
+
+void as7265x_get_latency_histogram(histogram_t *out) {
+    *out = virtual_latency;
+}
+
+void as7265x_get_readout_histogram(histogram_t *out) {
+    *out = readout_latency;
+}
+
+static esp_err_t write_config(uint8_t value) {
+    esp_err_t ret = as7265x_virtual_write(AS7265X_CONFIG_REG, value);
+    if (ret == ESP_OK) config_reg = value & ~AS7265X_CONFIG_DATA_RDY;
+    return ret;
+}
+
+esp_err_t as7265x_set_gain(as7265x_gain_t gain) {
+    uint8_t value = (config_reg & ~(0x03 << AS7265X_CONFIG_GAIN_SHIFT)) |
+                    ((gain & 0x03) << AS7265X_CONFIG_GAIN_SHIFT);
+    return write_config(value);
+}
+
+esp_err_t as7265x_set_integration_cycles(uint8_t cycles) {
+    esp_err_t ret = as7265x_virtual_write(AS7265X_INTEGRATION_REG, cycles);
+    if (ret == ESP_OK) integration_cycles = cycles;
+    return ret;
+}
+
+esp_err_t as7265x_set_mode(as7265x_mode_t mode) {
+    uint8_t value = (config_reg & ~(0x03 << AS7265X_CONFIG_BANK_SHIFT)) |
+                    ((mode & 0x03) << AS7265X_CONFIG_BANK_SHIFT);
+    esp_err_t ret = write_config(value);
+    if (ret == ESP_OK) {
+        meas_mode = mode;
+        frame_start_us = esp_timer_get_time();
+    }
+    return ret;
+}
+
+// Read-modify-write of one device's LED_CONFIG. The register is read once
+// and cached, so switching a bulb later is a single write.
+static esp_err_t update_led_config(uint8_t dev, uint8_t bit, bool on) {
+    uint8_t value;
+
+    esp_err_t ret = as7265x_set_device(dev);
+    if (ret == ESP_OK && !(led_known & (1u << dev))) {
+        ret = as7265x_virtual_read(AS7265X_LED_CONFIG_REG, &led_config[dev]);
+        if (ret == ESP_OK) led_known |= 1u << dev;
+    }
+    if (ret != ESP_OK) return ret;
+
+    value = on ? (led_config[dev] | bit) : (led_config[dev] & ~bit);
+    if (value == led_config[dev]) return ESP_OK;
+
+    ret = as7265x_virtual_write(AS7265X_LED_CONFIG_REG, value);
+    if (ret == ESP_OK) led_config[dev] = value;
+    else led_known &= ~(1u << dev);
+    return ret;
+}
+
+esp_err_t as7265x_set_bulb(uint8_t dev, bool on) {
+    if (dev >= AS7265X_NUM_DEVICES) return ESP_ERR_INVALID_ARG;
+    return update_led_config(dev, AS7265X_LED_DRV, on);
+}
+
+esp_err_t as7265x_set_bulbs(uint8_t bulbs, bool on) {
+    esp_err_t ret = ESP_OK;
+
+    for (uint8_t dev = 0; dev < AS7265X_NUM_DEVICES; dev++) {
+        if (!(bulbs & (1u << dev))) continue;
+        esp_err_t err = update_led_config(dev, AS7265X_LED_DRV, on);
+        if (ret == ESP_OK) ret = err;
+    }
+    return ret;
+}
+
+esp_err_t as7265x_set_indicator(bool on) {
+    return update_led_config(0, AS7265X_LED_IND, on);
+}
+
+esp_err_t as7265x_leds_off(void) {
+    esp_err_t ret = as7265x_set_indicator(false);
+    esp_err_t err = as7265x_set_bulbs(AS7265X_ALL_BULBS, false);
+
+    return ret != ESP_OK ? ret : err;
+}
+
+as7265x_mode_t as7265x_get_mode(void) {
+    return meas_mode;
+}
+
+as7265x_gain_t as7265x_get_gain(void) {
+    return (config_reg >> AS7265X_CONFIG_GAIN_SHIFT) & 0x03;
+}
+
+uint8_t as7265x_get_integration_cycles(void) {
+    return integration_cycles;
+}
+
+uint32_t as7265x_frame_time_us(void) {
+    uint32_t t = (uint32_t)integration_cycles * AS7265X_CYCLE_US;
+
+    // The 6-channel modes integrate both photodiode banks back to back
+    if (meas_mode == AS7265X_MODE_6CHAN_CONTINUOUS || meas_mode == AS7265X_MODE_6CHAN_ONE_SHOT) {
+        t *= 2;
+    }
+    return t;
+}
+
+esp_err_t as7265x_start_one_shot(void) {
+    // Writing the one-shot bank mode starts a new integration and clears DATA_RDY
+    if (int_gpio >= 0) xSemaphoreTake(data_ready_sem, 0);
+    return as7265x_set_mode(AS7265X_MODE_6CHAN_ONE_SHOT);
+}
+
+static void IRAM_ATTR data_ready_isr(void *arg) {
+    BaseType_t woken = pdFALSE;
+
+    int_edge_us = esp_timer_get_time();
+    xSemaphoreGiveFromISR(data_ready_sem, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+static esp_err_t poll_data_ready(int64_t deadline_us) {
+    uint8_t value;
+
+    // Nothing can be ready before the frame time has elapsed
+    int64_t wait_us = frame_start_us + as7265x_frame_time_us() - esp_timer_get_time();
+    if (wait_us > 0) {
+        vTaskDelay(pdMS_TO_TICKS(wait_us / 1000));
+    }
+
+    while (1) {
+        esp_err_t ret = as7265x_virtual_read(AS7265X_CONFIG_REG, &value);
+        if (ret != ESP_OK) return ret;
+        if (value & AS7265X_CONFIG_DATA_RDY) return ESP_OK;
+        if (esp_timer_get_time() >= deadline_us) return ESP_ERR_TIMEOUT;
+        vTaskDelay(1);
+    }
+}
+
+// Waits for DATA_RDY without acknowledging it
+static esp_err_t wait_ready(uint32_t timeout_ms) {
+    int64_t deadline_us = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    esp_err_t ret;
+
+    if (int_gpio >= 0) {
+        ret = xSemaphoreTake(data_ready_sem, pdMS_TO_TICKS(timeout_ms) + 1) == pdTRUE
+              ? ESP_OK : ESP_ERR_TIMEOUT;
+    } else {
+        ret = poll_data_ready(deadline_us);
+    }
+    if (ret != ESP_OK) return ret;
+
+    // In continuous mode the next frame is already integrating
+    frame_start_us = esp_timer_get_time();
+    return ESP_OK;
+}
+
+esp_err_t as7265x_wait_data_ready(uint32_t timeout_ms) {
+    esp_err_t ret = wait_ready(timeout_ms);
+    if (ret != ESP_OK) return ret;
+
+    // Acknowledge so the next frame raises DATA_RDY (and INT) again
+    return write_config(config_reg);
+}
+
+esp_err_t as7265x_stream_start(void) {
+    esp_err_t ret = as7265x_set_mode(AS7265X_MODE_6CHAN_CONTINUOUS);
+    if (ret != ESP_OK) return ret;
+
+    memset(&stream_stats, 0, sizeof(stream_stats));
+    stream_stats.frame_time_us = as7265x_frame_time_us();
+    stream_start_us = frame_start_us;
+    stream_last_end_us = 0;
+    return ESP_OK;
+}
+
+esp_err_t as7265x_stream_stop(void) {
+    return as7265x_set_mode(AS7265X_MODE_6CHAN_ONE_SHOT);
+}
+
+// With switch_bulbs the interleaved bulbs are toggled before the frame is
+// acknowledged, as early in the next integration as we can get
+static esp_err_t stream_next(uint32_t timeout_ms, as7265x_frame_info_t *info, bool switch_bulbs) {
+    uint32_t frame_us = stream_stats.frame_time_us;
+    esp_err_t err = ESP_OK;
+
+    esp_err_t ret = wait_ready(timeout_ms);
+    if (ret != ESP_OK) return ret;
+
+    // The INT edge is the end of integration; polling sees it up to one
+    // poll later
+    info->end_us = int_gpio >= 0 ? int_edge_us : frame_start_us;
+    info->start_us = info->end_us - frame_us;
+    info->skipped = 0;
+    info->switch_us = 0;
+
+    if (switch_bulbs) {
+        interleave_lit = !interleave_lit;
+        err = as7265x_set_bulbs(interleave_bulbs, interleave_lit);
+        info->switch_us = (uint32_t)(esp_timer_get_time() - info->end_us);
+    }
+    ret = write_config(config_reg);
+    if (ret != ESP_OK) return ret;
+
+    // Frames follow each other without a gap, so a longer interval means
+    // frames ended while we were still reading the previous one
+    if (stream_last_end_us != 0 && frame_us > 0) {
+        int64_t gap = info->end_us - stream_last_end_us;
+        int64_t frames = (gap + frame_us / 2) / frame_us;
+        if (frames > 1) info->skipped = frames - 1;
+    }
+    stream_last_end_us = info->end_us;
+
+    info->index = stream_stats.frames + stream_stats.skipped + info->skipped;
+    stream_stats.frames++;
+    stream_stats.skipped += info->skipped;
+    return err;
+}
+
+esp_err_t as7265x_stream_wait(uint32_t timeout_ms, as7265x_frame_info_t *info) {
+    return stream_next(timeout_ms, info, false);
+}
+
+bool as7265x_stream_frame_read(const as7265x_frame_info_t *info) {
+    int64_t now = esp_timer_get_time();
+    int64_t elapsed = now - stream_start_us;
+    bool intact = now <= info->end_us + stream_stats.frame_time_us;
+
+    // The next frame overwrote the result registers while we read them
+    if (!intact) stream_stats.overruns++;
+
+    if (elapsed > 0) {
+        stream_stats.fps_milli = (uint32_t)((uint64_t)stream_stats.frames * 1000000000ull / elapsed);
+    }
+    if (stream_stats.frame_time_us > 0) {
+        stream_stats.max_fps_milli = 1000000000u / stream_stats.frame_time_us;
+    }
+    return intact;
+}
+
+esp_err_t as7265x_interleave_start(uint8_t bulbs) {
+    interleave_bulbs = bulbs & AS7265X_ALL_BULBS;
+    interleave_lit = true;
+
+    // The first frame integrates entirely under the bulbs
+    esp_err_t ret = as7265x_set_bulbs(interleave_bulbs, true);
+    if (ret == ESP_OK) ret = as7265x_stream_start();
+    return ret;
+}
+
+esp_err_t as7265x_interleave_next(uint32_t timeout_ms, bool last, as7265x_frame_info_t *info, bool *lit) {
+    *lit = interleave_lit;
+    return stream_next(timeout_ms, info, !last);
+}
+
+esp_err_t as7265x_interleave_stop(void) {
+    esp_err_t ret = as7265x_stream_stop();
+    esp_err_t err = as7265x_set_bulbs(interleave_bulbs, false);
+    return ret != ESP_OK ? ret : err;
+}
+
+void as7265x_stream_get_stats(as7265x_stream_stats_t *out) {
+    *out = stream_stats;
+}
+
+static esp_err_t enable_interrupt(int gpio) {
+    gpio_config_t io = {
+        .pin_bit_mask = 1ULL << gpio,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_NEGEDGE, // INT is active low
+    };
+
+    data_ready_sem = xSemaphoreCreateBinary();
+    if (!data_ready_sem) return ESP_ERR_NO_MEM;
+
+    esp_err_t ret = gpio_config(&io);
+    if (ret != ESP_OK) return ret;
+
+    ret = gpio_install_isr_service(0);
+    if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) return ret; // already installed is fine
+
+    ret = gpio_isr_handler_add(gpio, data_ready_isr, NULL);
+    if (ret == ESP_OK) int_gpio = gpio;
+    return ret;
+}
+
+esp_err_t as7265x_init(const as7265x_config_t *cfg) {
+    esp_err_t ret;
+    uint8_t value = ((cfg->gain & 0x03) << AS7265X_CONFIG_GAIN_SHIFT) |
+                    ((cfg->mode & 0x03) << AS7265X_CONFIG_BANK_SHIFT);
+
+    invalidate_state();
+    led_known = 0;
+
+    if (cfg->int_gpio >= 0 && int_gpio < 0) {
+        ret = enable_interrupt(cfg->int_gpio);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "INT pin %d unavailable (%s), polling DATA_RDY", cfg->int_gpio, esp_err_to_name(ret));
+        }
+    }
+    if (int_gpio >= 0) value |= AS7265X_CONFIG_INT;
+
+    ret = as7265x_set_integration_cycles(cfg->integration_cycles);
+    if (ret != ESP_OK) return ret;
+
+    ret = write_config(value);
+    if (ret != ESP_OK) return ret;
+
+    meas_mode = cfg->mode;
+    frame_start_us = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "Configured gain=%d cycles=%d mode=%d frame=%lu us", cfg->gain,
+             cfg->integration_cycles, cfg->mode, (unsigned long)as7265x_frame_time_us());
+    return ESP_OK;
+}
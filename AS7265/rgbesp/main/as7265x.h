@@ -1,10 +1,160 @@
 #pragma once
 
 #include "esp_err.h"
+#include "histogram.h"
+#include <stdbool.h>
 #include <stdint.h>
 
+#define AS7265X_NUM_DEVICES 3
+#define AS7265X_CHANNELS_PER_DEVICE 6
+#define AS7265X_NUM_CHANNELS (AS7265X_NUM_DEVICES * AS7265X_CHANNELS_PER_DEVICE)
 
+// Channel masks: bit n = channel n, device by device as in the spectrum
+#define AS7265X_ALL_CHANNELS ((1u << AS7265X_NUM_CHANNELS) - 1)
+#define AS7265X_DEVICE_ALL ((1u << AS7265X_CHANNELS_PER_DEVICE) - 1)
+#define AS7265X_DEVICE_CHANNELS(mask, dev) \
+    (((mask) >> ((dev) * AS7265X_CHANNELS_PER_DEVICE)) & AS7265X_DEVICE_ALL)
+// Channels 0, 14 and 17, all the dashboard's colour preview uses
+#define AS7265X_PREVIEW_CHANNELS ((1u << 0) | (1u << 14) | (1u << 17))
+
+typedef enum {
+    AS7265X_GAIN_1X = 0,
+    AS7265X_GAIN_3_7X = 1,
+    AS7265X_GAIN_16X = 2,
+    AS7265X_GAIN_64X = 3,
+} as7265x_gain_t;
+
+// BANK field of the CONFIG register
+typedef enum {
+    AS7265X_MODE_4CHAN = 0,               // continuous, bank 0 channels only
+    AS7265X_MODE_4CHAN_2 = 1,             // continuous, bank 1 channels only
+    AS7265X_MODE_6CHAN_CONTINUOUS = 2,    // continuous, all 6 channels
+    AS7265X_MODE_6CHAN_ONE_SHOT = 3,      // single measurement, all 6 channels
+} as7265x_mode_t;
+
+typedef struct {
+    as7265x_gain_t gain;
+    uint8_t integration_cycles;   // 2.8 ms per cycle
+    as7265x_mode_t mode;
+    int int_gpio;                 // GPIO wired to INT, or -1 to poll DATA_RDY
+} as7265x_config_t;
+
+// Virtual register access. Each call is bounded in time: a handshake that
+// does not complete returns ESP_ERR_TIMEOUT and the I2C bus is recovered.
 esp_err_t as7265x_virtual_write(uint8_t reg, uint8_t value);
 esp_err_t as7265x_virtual_read(uint8_t reg, uint8_t *value);
 esp_err_t as7265x_set_device(uint8_t dev);
 esp_err_t as7265x_read_calibrated_value(uint8_t reg, float *value);
+
+// Reads the 6 calibrated channels of one device (0=master, 1=slave1, 2=slave2).
+// Failed channels are set to 0.0f and the first error is returned.
+esp_err_t as7265x_read_device(uint8_t dev, float out[AS7265X_CHANNELS_PER_DEVICE]);
+// Reads all 18 channels, device by device
+esp_err_t as7265x_read_spectrum(float out[AS7265X_NUM_CHANNELS]);
+
+// Raw 16-bit ADC counts: two virtual reads per channel instead of four.
+// Same failure handling as the calibrated reads, with 0 for failed channels.
+esp_err_t as7265x_read_raw_value(uint8_t reg, uint16_t *value);
+esp_err_t as7265x_read_raw_device(uint8_t dev, uint16_t out[AS7265X_CHANNELS_PER_DEVICE]);
+esp_err_t as7265x_read_raw_spectrum(uint16_t out[AS7265X_NUM_CHANNELS]);
+
+// Which channels to read, resolved once into the devices to select and the
+// channels of each, so devices with nothing to read are never selected
+typedef struct {
+    uint32_t mask;
+    uint8_t num_devices;
+    struct {
+        uint8_t dev;
+        uint8_t chmask;     // channels of this device
+    } devices[AS7265X_NUM_DEVICES];
+} as7265x_read_plan_t;
+
+// An empty mask reads every channel
+void as7265x_plan_init(as7265x_read_plan_t *plan, uint32_t mask);
+// Reads the channels in the plan. Channels outside it are set to NAN (raw:
+// 0); failed ones as in as7265x_read_device(). The full spectrum and the
+// masks chosen in Kconfig take read paths specialized at compile time.
+esp_err_t as7265x_read_plan(const as7265x_read_plan_t *plan, float out[AS7265X_NUM_CHANNELS]);
+esp_err_t as7265x_read_raw_plan(const as7265x_read_plan_t *plan, uint16_t out[AS7265X_NUM_CHANNELS]);
+
+// Running count of I2C transactions issued by the driver
+uint32_t as7265x_get_i2c_transactions(void);
+uint32_t as7265x_get_timeout_count(void);
+// Time per I2C transaction, in microseconds
+void as7265x_get_i2c_histogram(histogram_t *out);
+// Per-call latency of virtual register accesses, in microseconds
+void as7265x_get_latency_histogram(histogram_t *out);
+// Time per spectrum or read plan read, in microseconds
+void as7265x_get_readout_histogram(histogram_t *out);
+
+esp_err_t as7265x_init(const as7265x_config_t *cfg);
+// Bulb of one device (0=white on master, 1=IR on slave1, 2=UV on slave2)
+esp_err_t as7265x_set_bulb(uint8_t dev, bool on);
+// The bulbs of the devices in the mask (bit n = device n); the first error
+// is returned. LED_CONFIG is cached, so after the first call each bulb
+// switch is one register write.
+#define AS7265X_ALL_BULBS ((1u << AS7265X_NUM_DEVICES) - 1)
+esp_err_t as7265x_set_bulbs(uint8_t bulbs, bool on);
+// Blue indicator LED on the master, on after power-up
+esp_err_t as7265x_set_indicator(bool on);
+// Indicator and all bulbs off; the first error is returned
+esp_err_t as7265x_leds_off(void);
+esp_err_t as7265x_set_gain(as7265x_gain_t gain);
+esp_err_t as7265x_set_integration_cycles(uint8_t cycles);
+esp_err_t as7265x_set_mode(as7265x_mode_t mode);
+as7265x_mode_t as7265x_get_mode(void);
+as7265x_gain_t as7265x_get_gain(void);
+uint8_t as7265x_get_integration_cycles(void);
+// Time from the start of an integration until DATA_RDY for the current settings
+uint32_t as7265x_frame_time_us(void);
+
+// Pipelined continuous acquisition: the sensor integrates frame N+1 while
+// frame N is read. Each frame is tagged with its integration window.
+typedef struct {
+    int64_t start_us;       // integration window, esp_timer time
+    int64_t end_us;         // INT edge, or when polling saw DATA_RDY
+    uint32_t index;         // frames the sensor finished since the stream started
+    uint32_t skipped;       // frames lost just before this one
+    uint32_t switch_us;     // interleaving: end_us until the bulbs were switched
+                            // for the next frame, which integrated that long
+                            // under the old state
+} as7265x_frame_info_t;
+
+typedef struct {
+    uint32_t frames;        // delivered since the stream started
+    uint32_t skipped;       // finished while the previous frame was still being read
+    uint32_t overruns;      // reads that ended after the next frame was ready
+    uint32_t frame_time_us;
+    uint32_t fps_milli;     // achieved, frames per 1000 s
+    uint32_t max_fps_milli; // what the integration time allows
+} as7265x_stream_stats_t;
+
+// Switches to continuous 6-channel mode and resets the stream statistics
+esp_err_t as7265x_stream_start(void);
+esp_err_t as7265x_stream_stop(void);
+// Waits for the next frame and acknowledges it; read it before the one after
+// is ready, then call as7265x_stream_frame_read()
+esp_err_t as7265x_stream_wait(uint32_t timeout_ms, as7265x_frame_info_t *info);
+// Returns false if the next frame was ready before the read finished, so the
+// values may mix two frames
+bool as7265x_stream_frame_read(const as7265x_frame_info_t *info);
+// Word-sized fields, safe to poll from another task
+void as7265x_stream_get_stats(as7265x_stream_stats_t *out);
+
+// Bulb/dark interleaving for ambient correction: a continuous stream whose
+// frames alternate between the bulbs on and off, starting lit. Each frame
+// is read while the next one integrates, so the pair costs two frame times
+// instead of two one-shot measurements with their readouts.
+esp_err_t as7265x_interleave_start(uint8_t bulbs);
+// Waits for the next frame like as7265x_stream_wait() and switches the
+// bulbs for the one after it unless last is set. lit is the bulb state the
+// returned frame integrated under.
+esp_err_t as7265x_interleave_next(uint32_t timeout_ms, bool last, as7265x_frame_info_t *info, bool *lit);
+// Back to one-shot mode with the interleaved bulbs off
+esp_err_t as7265x_interleave_stop(void);
+
+// Starts a one-shot 6-channel measurement
+esp_err_t as7265x_start_one_shot(void);
+// Blocks until the current frame is ready (INT pin or DATA_RDY polling),
+// then acknowledges it. Returns ESP_ERR_TIMEOUT if the sensor never finished.
+esp_err_t as7265x_wait_data_ready(uint32_t timeout_ms);
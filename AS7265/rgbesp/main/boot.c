@@ -0,0 +1,54 @@
+#include "boot.h"
+#include "esp_app_desc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *const phase_names[BOOT_PHASE_COUNT] = {
+    [BOOT_NVS] = "nvs",
+    [BOOT_WIFI_START] = "wifi_start",
+    [BOOT_SENSOR] = "sensor",
+    [BOOT_WARMUP] = "warmup",
+    [BOOT_FIRST_SAMPLE] = "first_sample",
+    [BOOT_WIFI_IP] = "ip",
+    [BOOT_WS_CONNECTED] = "ws",
+};
+
+// 64-bit values: a word-sized read could tear
+static portMUX_TYPE phase_lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t phase_us[BOOT_PHASE_COUNT];
+
+void boot_mark(boot_phase_t phase)
+{
+    int64_t now = esp_timer_get_time();
+
+    if (phase >= BOOT_PHASE_COUNT) return;
+    portENTER_CRITICAL(&phase_lock);
+    if (phase_us[phase] == 0) phase_us[phase] = now;
+    portEXIT_CRITICAL(&phase_lock);
+}
+
+int64_t boot_phase_us(boot_phase_t phase)
+{
+    int64_t us;
+
+    if (phase >= BOOT_PHASE_COUNT) return 0;
+    portENTER_CRITICAL(&phase_lock);
+    us = phase_us[phase];
+    portEXIT_CRITICAL(&phase_lock);
+    return us;
+}
+
+void boot_write_json(json_writer_t *w)
+{
+    json_key(w, "boot");
+    json_begin_object(w);
+    json_key(w, "version");
+    json_string(w, esp_app_get_description()->version);
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+        int64_t us = boot_phase_us(i);
+        if (us == 0) continue;
+        json_key(w, phase_names[i]);
+        json_number(w, (double)(us / 1000));
+    }
+    json_end_object(w);
+}
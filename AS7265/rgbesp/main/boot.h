@@ -0,0 +1,26 @@
+#pragma once
+
+#include "json_writer.h"
+#include <stdint.h>
+
+// Boot milestones, timestamped with esp_timer (us since boot) the first time
+// they are reached. Reported once in the first status message after boot.
+typedef enum {
+    BOOT_NVS = 0,           // NVS and the offline log are ready
+    BOOT_WIFI_START,        // WiFi driver started, association under way
+    BOOT_SENSOR,            // I2C bus and sensor configured
+    BOOT_WARMUP,            // warm-up integration done
+    BOOT_FIRST_SAMPLE,      // first spectrum handed to the sender
+    BOOT_WIFI_IP,           // got an IP
+    BOOT_WS_CONNECTED,      // relay connection up
+    BOOT_PHASE_COUNT,
+} boot_phase_t;
+
+// Safe from any task; only the first call per phase counts
+void boot_mark(boot_phase_t phase);
+// 0 if the phase has not been reached
+int64_t boot_phase_us(boot_phase_t phase);
+
+// Writes a "boot" member: firmware version and, for every phase reached so
+// far, whole ms since boot
+void boot_write_json(json_writer_t *w);
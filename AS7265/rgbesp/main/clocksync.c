@@ -0,0 +1,140 @@
+#include "clocksync.h"
+#include "esp_log.h"
+#include "esp_netif_sntp.h"
+#include "esp_sntp.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include <sys/time.h>
+
+// Syncs closer together than this leave the drift alone: over a short span
+// the network delay dominates the measurement
+#define CLOCKSYNC_MIN_DRIFT_SPAN_US (60 * 1000000LL)
+// A larger error is a step of the time source, not drift
+#define CLOCKSYNC_MAX_STEP_US 1000000
+// Crystal tolerance with room to spare; anything beyond is a bad sample
+#define CLOCKSYNC_MAX_DRIFT_PPB 500000
+// A new drift measurement moves the estimate by 1/2^n of the difference
+#define CLOCKSYNC_DRIFT_SHIFT 2
+// The system clock reads 1970 until it is set; anything before 2024 is unset
+#define CLOCKSYNC_SYSTEM_VALID_US (1704067200LL * 1000000)
+
+static const char *TAG = "CLOCK";
+
+// Written by the SNTP callback on the lwIP task, read from any task
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static int64_t sync_timer_us;       // esp_timer time of the last sync
+static int64_t sync_wall_us;        // UTC at that time
+static int32_t drift_ppb = 0;
+static bool drift_known = false;
+static int32_t offset_us = 0;
+static uint32_t syncs = 0;
+
+// UTC at timer_us from the last sync; called with the lock held
+static int64_t estimate(int64_t timer_us)
+{
+    int64_t dt = timer_us - sync_timer_us;
+
+    return sync_wall_us + dt + dt * drift_ppb / 1000000000;
+}
+
+static int32_t clamp32(int64_t v, int32_t limit)
+{
+    return v > limit ? limit : v < -limit ? -limit : (int32_t)v;
+}
+
+// The error of our estimate at a sync is what the drift accumulated since
+// the previous one, on top of the drift already accounted for
+static void on_sync(struct timeval *tv)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t wall = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+    int64_t err = 0;
+    bool step = false;
+
+    portENTER_CRITICAL(&lock);
+    if (syncs > 0) {
+        int64_t span = now - sync_timer_us;
+
+        err = wall - estimate(now);
+        step = err > CLOCKSYNC_MAX_STEP_US || err < -CLOCKSYNC_MAX_STEP_US;
+        if (!step && span >= CLOCKSYNC_MIN_DRIFT_SPAN_US) {
+            int64_t measured = drift_ppb + err * 1000000000 / span;
+
+            if (drift_known) measured = drift_ppb + ((measured - drift_ppb) >> CLOCKSYNC_DRIFT_SHIFT);
+            drift_ppb = clamp32(measured, CLOCKSYNC_MAX_DRIFT_PPB);
+            drift_known = true;
+        }
+    }
+    offset_us = clamp32(err, INT32_MAX);
+    sync_timer_us = now;
+    sync_wall_us = wall;
+    syncs++;
+    portEXIT_CRITICAL(&lock);
+
+    if (step) {
+        ESP_LOGW(TAG, "Time stepped by %lld ms", (long long)(err / 1000));
+    } else {
+        ESP_LOGI(TAG, "SNTP sync %lu: offset %ld us, drift %ld ppb", (unsigned long)syncs,
+                 (long)offset_us, (long)drift_ppb);
+    }
+}
+
+void clocksync_start(void)
+{
+    static bool started = false;
+
+    if (started) return;
+    started = true;
+
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_CLOCK_SNTP_SERVER);
+    config.sync_cb = on_sync;
+    // Steps rather than slews the system clock, so the time passed to the
+    // callback is the one just received
+    config.smooth_sync = false;
+    esp_sntp_set_sync_interval((uint32_t)CONFIG_CLOCK_SNTP_INTERVAL_S * 1000);
+    if (esp_netif_sntp_init(&config) != ESP_OK) {
+        ESP_LOGE(TAG, "SNTP did not start");
+        started = false;
+        return;
+    }
+    ESP_LOGI(TAG, "SNTP with %s every %d s", CONFIG_CLOCK_SNTP_SERVER, CONFIG_CLOCK_SNTP_INTERVAL_S);
+}
+
+bool clocksync_synced(void)
+{
+    return syncs > 0;
+}
+
+int64_t clocksync_wall_us(int64_t timer_us)
+{
+    int64_t wall = 0;
+
+    portENTER_CRITICAL(&lock);
+    if (syncs > 0) wall = estimate(timer_us);
+    portEXIT_CRITICAL(&lock);
+    return wall;
+}
+
+int64_t clocksync_system_wall_us(void)
+{
+    struct timeval tv;
+    int64_t us;
+
+    gettimeofday(&tv, NULL);
+    us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    return us >= CLOCKSYNC_SYSTEM_VALID_US ? us : 0;
+}
+
+void clocksync_get_stats(clocksync_stats_t *out)
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&lock);
+    out->synced = syncs > 0;
+    out->syncs = syncs;
+    out->offset_us = offset_us;
+    out->drift_ppb = drift_ppb;
+    out->since_sync_s = syncs > 0 ? (uint32_t)((now - sync_timer_us) / 1000000) : 0;
+    portEXIT_CRITICAL(&lock);
+}
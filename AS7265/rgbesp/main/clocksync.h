@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Wall-clock time for spectra. SNTP syncs pair an esp_timer time with UTC;
+// between syncs UTC is extrapolated from the last pair, corrected for the
+// drift of esp_timer measured across earlier syncs. Spectra keep their
+// esp_timer timestamp and carry the UTC one alongside, so batched, delayed
+// and replayed spectra keep their acquisition time.
+
+typedef struct {
+    bool synced;
+    uint32_t syncs;
+    int32_t offset_us;      // at the last sync: SNTP time minus our estimate
+    int32_t drift_ppb;      // esp_timer rate error; positive when it runs slow
+    uint32_t since_sync_s;
+} clocksync_stats_t;
+
+// Starts SNTP with CONFIG_CLOCK_SNTP_SERVER. Needs esp_netif, i.e. after
+// wifi_init_sta().
+void clocksync_start(void);
+bool clocksync_synced(void);
+// UTC in us since the epoch at an esp_timer time; 0 before the first sync
+int64_t clocksync_wall_us(int64_t timer_us);
+// The system clock (gettimeofday) in us once SNTP has set it, else 0. It
+// survives deep sleep, so a sync on an earlier wake counts.
+int64_t clocksync_system_wall_us(void);
+void clocksync_get_stats(clocksync_stats_t *out);
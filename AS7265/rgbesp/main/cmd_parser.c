@@ -0,0 +1,286 @@
+#include "cmd_parser.h"
+#include "esp_log.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest number we accept; anything longer is not a command argument
+#define CMD_NUMBER_MAX 32
+#define CMD_SEED_TRIES 256
+
+static const char *TAG = "CMD";
+
+typedef struct {
+    const char *p;
+    const char *end;
+} cursor_t;
+
+static void skip_ws(cursor_t *c)
+{
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r')) c->p++;
+}
+
+static bool expect(cursor_t *c, char ch)
+{
+    skip_ws(c);
+    if (c->p >= c->end || *c->p != ch) return false;
+    c->p++;
+    return true;
+}
+
+// Leaves the span between the quotes; escapes are only stepped over
+static bool scan_string(cursor_t *c, const char **s, size_t *len)
+{
+    if (!expect(c, '"')) return false;
+
+    const char *start = c->p;
+    while (c->p < c->end && *c->p != '"') {
+        if ((unsigned char)*c->p < 0x20) return false;
+        if (*c->p == '\\') c->p++;
+        c->p++;
+    }
+    if (c->p >= c->end) return false;
+
+    *s = start;
+    *len = c->p - start;
+    c->p++;
+    return true;
+}
+
+static bool scan_number(cursor_t *c, double *out)
+{
+    char buf[CMD_NUMBER_MAX];
+    size_t n = 0;
+    char *endp;
+
+    while (c->p + n < c->end && c->p[n] && strchr("+-0123456789.eE", c->p[n])) {
+        if (++n >= sizeof(buf)) return false;
+    }
+    if (n == 0) return false;
+
+    memcpy(buf, c->p, n);
+    buf[n] = '\0';
+    *out = strtod(buf, &endp);
+    if (endp != buf + n || !isfinite(*out)) return false;
+    c->p += n;
+    return true;
+}
+
+static bool scan_literal(cursor_t *c, const char *lit)
+{
+    size_t n = strlen(lit);
+
+    if ((size_t)(c->end - c->p) < n || memcmp(c->p, lit, n) != 0) return false;
+    c->p += n;
+    return true;
+}
+
+// Steps over a nested object or array, minding brackets inside strings
+static bool skip_container(cursor_t *c)
+{
+    int depth = 0;
+
+    do {
+        const char *s;
+        size_t len;
+
+        skip_ws(c);
+        if (c->p >= c->end) return false;
+        switch (*c->p) {
+            case '"':
+                if (!scan_string(c, &s, &len)) return false;
+                continue;
+            case '{':
+            case '[':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                depth--;
+                break;
+        }
+        c->p++;
+    } while (depth > 0);
+    return true;
+}
+
+static bool scan_value(cursor_t *c, cmd_field_t *f)
+{
+    skip_ws(c);
+    if (c->p >= c->end) return false;
+
+    switch (*c->p) {
+        case '"':
+            f->type = CMD_VALUE_STRING;
+            return scan_string(c, &f->str, &f->str_len);
+        case '{':
+        case '[':
+            f->type = CMD_VALUE_OTHER;
+            return skip_container(c);
+        case 't':
+            f->type = CMD_VALUE_BOOL;
+            f->number = 1;
+            return scan_literal(c, "true");
+        case 'f':
+            f->type = CMD_VALUE_BOOL;
+            f->number = 0;
+            return scan_literal(c, "false");
+        case 'n':
+            f->type = CMD_VALUE_NULL;
+            return scan_literal(c, "null");
+        default:
+            f->type = CMD_VALUE_NUMBER;
+            return scan_number(c, &f->number);
+    }
+}
+
+esp_err_t cmd_parse(const char *data, size_t len, cmd_message_t *out)
+{
+    cursor_t c = { data, data + len };
+    cmd_field_t scratch;
+
+    out->count = 0;
+    if (!data || !expect(&c, '{')) return ESP_ERR_INVALID_ARG;
+
+    skip_ws(&c);
+    if (c.p < c.end && *c.p == '}') {
+        c.p++;
+    } else {
+        do {
+            cmd_field_t *f = out->count < CMD_MAX_FIELDS ? &out->fields[out->count] : &scratch;
+
+            memset(f, 0, sizeof(*f));
+            if (!scan_string(&c, &f->key, &f->key_len) || !expect(&c, ':') || !scan_value(&c, f)) {
+                return ESP_ERR_INVALID_ARG;
+            }
+            if (f != &scratch) out->count++;
+        } while (expect(&c, ','));
+
+        if (!expect(&c, '}')) return ESP_ERR_INVALID_ARG;
+    }
+
+    skip_ws(&c);
+    return c.p == c.end ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+const cmd_field_t *cmd_find(const cmd_message_t *msg, const char *key)
+{
+    size_t n = strlen(key);
+
+    for (size_t i = 0; i < msg->count; i++) {
+        const cmd_field_t *f = &msg->fields[i];
+        if (f->key_len == n && memcmp(f->key, key, n) == 0) return f;
+    }
+    return NULL;
+}
+
+bool cmd_string_is(const cmd_field_t *field, const char *s)
+{
+    size_t n = strlen(s);
+
+    return field && field->type == CMD_VALUE_STRING &&
+           field->str_len == n && memcmp(field->str, s, n) == 0;
+}
+
+bool cmd_get_number(const cmd_message_t *msg, const char *key, double *out)
+{
+    const cmd_field_t *f = cmd_find(msg, key);
+
+    if (!f || f->type != CMD_VALUE_NUMBER) return false;
+    *out = f->number;
+    return true;
+}
+
+// FNV-1a of the name, independent of the seed
+static uint32_t hash_name(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Spreads the seed over every bit of the name hash (the murmur3 finalizer)
+// and keeps the top bits, which the multiplies mix best
+static uint32_t hash_slot(uint32_t h, uint32_t seed, uint8_t bits)
+{
+    h ^= seed * 0x9E3779B1u;
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h >> (32 - bits);
+}
+
+static bool try_seed(cmd_table_t *table, uint32_t seed, uint8_t bits)
+{
+    memset(table->slots, 0, sizeof(table->slots));
+    for (size_t i = 0; i < table->count; i++) {
+        const char *name = table->entries[i].action;
+        uint32_t slot = hash_slot(hash_name(name, strlen(name)), seed, bits);
+
+        if (table->slots[slot]) return false;
+        table->slots[slot] = i + 1;
+    }
+    return true;
+}
+
+esp_err_t cmd_table_init(cmd_table_t *table, const cmd_entry_t *entries, size_t count)
+{
+    uint8_t bits = 1;
+
+    table->entries = entries;
+    table->count = count;
+    table->seed = 0;
+    // At least twice as many slots as entries, so a seed turns up quickly
+    while ((1u << bits) < 2 * count) bits++;
+    for (; (1u << bits) <= CMD_TABLE_SLOTS; bits++) {
+        for (uint32_t seed = 0; seed < CMD_SEED_TRIES; seed++) {
+            if (try_seed(table, seed, bits)) {
+                table->seed = seed;
+                table->bits = bits;
+                return ESP_OK;
+            }
+        }
+    }
+    memset(table->slots, 0, sizeof(table->slots));
+    table->bits = 0;
+    return ESP_ERR_INVALID_SIZE;
+}
+
+const cmd_entry_t *cmd_table_find(const cmd_table_t *table, const char *name, size_t len)
+{
+    const cmd_entry_t *e;
+    uint8_t idx;
+
+    if (table->bits == 0) {
+        for (size_t i = 0; i < table->count; i++) {
+            e = &table->entries[i];
+            if (strlen(e->action) == len && strncmp(e->action, name, len) == 0) return e;
+        }
+        return NULL;
+    }
+    idx = table->slots[hash_slot(hash_name(name, len), table->seed, table->bits)];
+    if (idx == 0) return NULL;
+    e = &table->entries[idx - 1];
+    return strlen(e->action) == len && memcmp(e->action, name, len) == 0 ? e : NULL;
+}
+
+bool cmd_table_self_test(const cmd_table_t *table)
+{
+    for (size_t i = 0; i < table->count; i++) {
+        const cmd_entry_t *e = &table->entries[i];
+
+        if (cmd_table_find(table, e->action, strlen(e->action)) != e) {
+            ESP_LOGE(TAG, "Action %s does not resolve", e->action);
+            return false;
+        }
+    }
+    ESP_LOGI(TAG, "%u actions, %s", (unsigned)table->count,
+             table->bits ? "perfect hash" : "linear search");
+    return true;
+}
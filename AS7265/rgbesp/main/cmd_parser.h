@@ -0,0 +1,69 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// In-place parser for the flat JSON objects the relay sends as commands.
+// Fields point into the caller's buffer, which need not be NUL-terminated
+// and must outlive the parsed message. Nothing is allocated or copied.
+
+#define CMD_MAX_FIELDS 12
+// Largest dispatch table; the one in use is sized from the entry count
+#define CMD_TABLE_SLOTS 64
+
+typedef enum {
+    CMD_VALUE_STRING = 0,
+    CMD_VALUE_NUMBER,
+    CMD_VALUE_BOOL,
+    CMD_VALUE_NULL,
+    CMD_VALUE_OTHER,            // nested object or array, skipped
+} cmd_value_type_t;
+
+typedef struct {
+    const char *key;            // raw, between the quotes
+    size_t key_len;
+    cmd_value_type_t type;
+    const char *str;            // raw string value; escapes are not decoded
+    size_t str_len;
+    double number;              // CMD_VALUE_NUMBER, or 1/0 for CMD_VALUE_BOOL
+} cmd_field_t;
+
+typedef struct {
+    cmd_field_t fields[CMD_MAX_FIELDS];
+    size_t count;               // members past CMD_MAX_FIELDS are checked, not kept
+} cmd_message_t;
+
+// Parses one top-level JSON object. Returns ESP_ERR_INVALID_ARG if the
+// input is not a well-formed object.
+esp_err_t cmd_parse(const char *data, size_t len, cmd_message_t *out);
+
+const cmd_field_t *cmd_find(const cmd_message_t *msg, const char *key);
+bool cmd_string_is(const cmd_field_t *field, const char *s);
+// false if the member is missing or not a number
+bool cmd_get_number(const cmd_message_t *msg, const char *key, double *out);
+
+typedef void (*cmd_handler_t)(const cmd_message_t *msg);
+
+typedef struct {
+    const char *action;
+    cmd_handler_t handler;
+} cmd_entry_t;
+
+// Action lookup through a perfect hash chosen at init: one hash and one
+// compare per command, however many actions there are
+typedef struct {
+    const cmd_entry_t *entries;
+    size_t count;
+    uint32_t seed;
+    uint8_t bits;                       // table of 1 << bits slots; 0 scans entries
+    uint8_t slots[CMD_TABLE_SLOTS];     // index + 1 into entries, 0 if empty
+} cmd_table_t;
+
+// entries must stay valid. Returns ESP_ERR_INVALID_SIZE if no seed maps
+// them without collisions; the table then still works, by linear search.
+esp_err_t cmd_table_init(cmd_table_t *table, const cmd_entry_t *entries, size_t count);
+const cmd_entry_t *cmd_table_find(const cmd_table_t *table, const char *name, size_t len);
+// Checks that every entry resolves to itself; logs the first that does not
+bool cmd_table_self_test(const cmd_table_t *table);
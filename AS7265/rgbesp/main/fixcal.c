@@ -0,0 +1,149 @@
+#include "fixcal.h"
+#include "sdkconfig.h"
+#include <string.h>
+
+#define FIXCAL_MAX_SCALE (1u << (32 - FIXCAL_SCALE_SHIFT))
+
+void fixcal_learn(fixcal_t *cal, const uint16_t raw[AS7265X_NUM_CHANNELS],
+                  const float calibrated[AS7265X_NUM_CHANNELS])
+{
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        // A dark channel says nothing about its scale
+        if (raw[c] == 0 || !(calibrated[c] > 0.0f)) continue;
+
+        float ratio = calibrated[c] / raw[c];
+        cal->scale[c] = ratio >= FIXCAL_MAX_SCALE ? UINT32_MAX
+                      : (uint32_t)(ratio * (1 << FIXCAL_SCALE_SHIFT) + 0.5f);
+    }
+}
+
+uint32_t fixcal_apply(const fixcal_t *cal, int c, uint32_t counts_q8)
+{
+    // 32x32 multiply into 64 bits: mul and mulhu on RV32, no library call
+    uint64_t v = ((uint64_t)counts_q8 * cal->scale[c]) >> (FIXCAL_SCALE_SHIFT + 8 - FIXCAL_MEAN_SHIFT);
+
+    return v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+}
+
+#if CONFIG_FIXCAL_BENCHMARK
+#include "esp_cpu.h"
+#include "esp_log.h"
+#include <math.h>
+
+#define BENCH_FRAMES 10
+#define BENCH_RUNS 200
+// Sums of more frames would overflow the Q8 mean
+#define BENCH_MAX_FRAMES 256
+
+static const char *TAG = "FIXCAL";
+
+typedef struct {
+    uint32_t sum[AS7265X_NUM_CHANNELS];
+    uint32_t n;
+} bench_acc_t;
+
+static void acc_reset(bench_acc_t *acc)
+{
+    memset(acc, 0, sizeof(*acc));
+}
+
+static bool acc_add(bench_acc_t *acc, const uint16_t raw[AS7265X_NUM_CHANNELS])
+{
+    if (acc->n >= BENCH_MAX_FRAMES) return false;
+
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        acc->sum[c] += raw[c];
+    }
+    acc->n++;
+    return true;
+}
+
+static void acc_mean(const fixcal_t *cal, const bench_acc_t *acc, uint32_t out[AS7265X_NUM_CHANNELS])
+{
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        // Q8 keeps the fraction of the mean; at most 256 * 65535 << 8 fits
+        uint32_t mean = acc->n ? (acc->sum[c] << 8) / acc->n : 0;
+
+        out[c] = fixcal_apply(cal, c, mean);
+    }
+}
+
+// What the float path gets from the sensor: 32-bit words reinterpreted as
+// calibrated floats
+static uint32_t bench_words[BENCH_FRAMES][AS7265X_NUM_CHANNELS];
+static uint16_t bench_raw[BENCH_FRAMES][AS7265X_NUM_CHANNELS];
+
+static __attribute__((noinline)) void mean_float(float out[AS7265X_NUM_CHANNELS])
+{
+    float sum[AS7265X_NUM_CHANNELS] = {0};
+
+    for (int f = 0; f < BENCH_FRAMES; f++) {
+        for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+            float v;
+            memcpy(&v, &bench_words[f][c], sizeof(v));
+            sum[c] += v;
+        }
+    }
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        out[c] = sum[c] / 10.0f;
+    }
+}
+
+static __attribute__((noinline)) void mean_fixed(const fixcal_t *cal, float out[AS7265X_NUM_CHANNELS])
+{
+    bench_acc_t acc;
+    uint32_t mean[AS7265X_NUM_CHANNELS];
+
+    acc_reset(&acc);
+    for (int f = 0; f < BENCH_FRAMES; f++) {
+        acc_add(&acc, bench_raw[f]);
+    }
+    acc_mean(cal, &acc, mean);
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        out[c] = fixcal_to_float(mean[c]);
+    }
+}
+
+void fixcal_benchmark(void)
+{
+    float cal_frame[AS7265X_NUM_CHANNELS];
+    float a[AS7265X_NUM_CHANNELS], b[AS7265X_NUM_CHANNELS];
+    fixcal_t cal = { 0 };
+    uint32_t start, float_cycles, fixed_cycles;
+    float worst = 0.0f;
+
+    // Counts spread over the ADC range, scales like the sensor's
+    for (int f = 0; f < BENCH_FRAMES; f++) {
+        for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+            float scale = 0.002f + c * 0.0137f;
+            float v;
+
+            bench_raw[f][c] = 40 + c * 3571 + f * 13;
+            v = bench_raw[f][c] * scale;
+            memcpy(&bench_words[f][c], &v, sizeof(v));
+            if (f == 0) cal_frame[c] = v;
+        }
+    }
+    fixcal_learn(&cal, bench_raw[0], cal_frame);
+
+    start = esp_cpu_get_cycle_count();
+    for (int i = 0; i < BENCH_RUNS; i++) mean_float(a);
+    float_cycles = (esp_cpu_get_cycle_count() - start) / BENCH_RUNS;
+
+    start = esp_cpu_get_cycle_count();
+    for (int i = 0; i < BENCH_RUNS; i++) mean_fixed(&cal, b);
+    fixed_cycles = (esp_cpu_get_cycle_count() - start) / BENCH_RUNS;
+
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        float err = fabsf(b[c] - a[c]) / a[c];
+        if (err > worst) worst = err;
+    }
+
+    ESP_LOGI(TAG, "%d-frame spectrum: float %lu cycles, fixed point %lu cycles, max difference %.4f%%",
+             BENCH_FRAMES, (unsigned long)float_cycles, (unsigned long)fixed_cycles, worst * 100.0f);
+}
+#else
+void fixcal_benchmark(void)
+{
+}
+#endif
@@ -0,0 +1,197 @@
+#include "frame.h"
+#include <math.h>
+#include <string.h>
+
+#define SAMPLE_OFFSET_SIZE 4
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+static uint8_t *put_u64(uint8_t *p, uint64_t v)
+{
+    p = put_u32(p, (uint32_t)v);
+    return put_u32(p, (uint32_t)(v >> 32));
+}
+
+static uint8_t *put_f32(uint8_t *p, float v)
+{
+    uint32_t bits;
+
+    memcpy(&bits, &v, sizeof(bits));
+    return put_u32(p, bits);
+}
+
+static size_t channel_size(frame_encoding_t enc)
+{
+    return enc == FRAME_ENC_I16 || enc == FRAME_ENC_U16 ? 2 : 4;
+}
+
+// Every sample of a frame is encoded with the first one's channel mask
+static uint32_t frame_mask(const spectrum_t *first)
+{
+    return first->channel_mask ? first->channel_mask & FRAME_ALL_CHANNELS : FRAME_ALL_CHANNELS;
+}
+
+// One scale for the whole frame, chosen so the largest magnitude maps to
+// the int16 limit
+static float i16_scale(const spectrum_t *samples, size_t count, uint32_t mask)
+{
+    float peak = 0.0f;
+
+    for (size_t i = 0; i < count; i++) {
+        for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+            if (!(mask & (1u << c))) continue;
+            float v = fabsf(samples[i].ch[c]);
+            if (isfinite(v) && v > peak) peak = v;
+        }
+    }
+    return peak > 0.0f ? peak / INT16_MAX : 1.0f;
+}
+
+int64_t frame_sample_us(const spectrum_t *s)
+{
+    return s->wall_us != 0 ? s->wall_us : s->timestamp_us;
+}
+
+static uint8_t *put_header(uint8_t *p, const spectrum_t *first, size_t count,
+                           frame_encoding_t enc, uint8_t flags, float scale, uint16_t device_id)
+{
+    if (first->kind == SPECTRUM_KIND_STREAM) flags |= FRAME_FLAG_STREAM;
+    if (first->flags & SPECTRUM_FLAG_RAW) flags |= FRAME_FLAG_RAW;
+    if (first->flags & SPECTRUM_FLAG_REFLECTANCE) flags |= FRAME_FLAG_REFLECTANCE;
+    if (first->wall_us != 0) flags |= FRAME_FLAG_UTC;
+
+    *p++ = FRAME_VERSION;
+    *p++ = FRAME_TYPE_SPECTRUM;
+    *p++ = enc;
+    *p++ = flags;
+    p = put_u16(p, device_id);
+    p = put_u16(p, (uint16_t)count);
+    p = put_u32(p, first->seq);
+    p = put_u32(p, frame_mask(first));
+    p = put_u64(p, (uint64_t)frame_sample_us(first));
+    p = put_f32(p, scale);
+    *p++ = first->gain;
+    *p++ = first->integration_cycles;
+    return put_u16(p, 0);
+}
+
+size_t frame_encode(uint8_t *buf, size_t cap, const spectrum_t *samples, size_t count,
+                    frame_encoding_t enc, uint8_t flags, uint16_t device_id)
+{
+    const spectrum_t *first = &samples[0];
+    uint32_t mask = count > 0 ? frame_mask(first) : 0;
+    size_t len = FRAME_HEADER_SIZE + count * (SAMPLE_OFFSET_SIZE + __builtin_popcount(mask) * channel_size(enc));
+    uint8_t *p = buf;
+
+    if (enc == FRAME_ENC_DELTA || count == 0 || count > UINT16_MAX || len > cap) return 0;
+
+    float scale = enc == FRAME_ENC_I16 ? i16_scale(samples, count, mask) : 1.0f;
+
+    p = put_header(p, first, count, enc, flags, scale, device_id);
+
+    for (size_t i = 0; i < count; i++) {
+        p = put_u32(p, (uint32_t)(frame_sample_us(&samples[i]) - frame_sample_us(first)));
+
+        for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+            if (!(mask & (1u << c))) continue;
+            if (enc == FRAME_ENC_I16) {
+                float v = isfinite(samples[i].ch[c]) ? samples[i].ch[c] / scale : 0.0f;
+                p = put_u16(p, (uint16_t)(int16_t)lroundf(v));
+            } else if (enc == FRAME_ENC_U16) {
+                // Averaged counts lose their fraction
+                float v = samples[i].ch[c];
+                p = put_u16(p, !(v > 0.0f) ? 0 : v >= UINT16_MAX ? UINT16_MAX : (uint16_t)lroundf(v));
+            } else {
+                p = put_f32(p, samples[i].ch[c]);
+            }
+        }
+    }
+    return p - buf;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+// Maps small magnitudes of either sign to small unsigned values
+static uint32_t zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t quantize(float v, float step)
+{
+    float q = isfinite(v) ? v / step : 0.0f;
+
+    if (q >= (float)INT32_MAX) return INT32_MAX;
+    if (q <= (float)INT32_MIN) return INT32_MIN;
+    return lroundf(q);
+}
+
+size_t frame_encode_delta(uint8_t *buf, size_t cap, const spectrum_t *samples, size_t count,
+                          float step, uint16_t device_id, frame_delta_state_t *state)
+{
+    const spectrum_t *first = &samples[0];
+    uint8_t *p = buf;
+    uint32_t mask;
+    bool keyframe;
+    int64_t prev_us;
+
+    if (count == 0 || count > UINT16_MAX || FRAME_MAX_SIZE(count) > cap) return 0;
+    if (!(step > 0.0f) || !isfinite(step)) return 0;
+
+    // A channel added to the mask has no previous value to continue from
+    mask = frame_mask(first);
+    keyframe = !state->valid || first->seq != state->next_seq || step != state->step ||
+               mask != state->mask ||
+               first->timestamp_us - state->keyframe_us >= FRAME_KEYFRAME_INTERVAL_US;
+    if (keyframe) {
+        memset(state->prev, 0, sizeof(state->prev));
+        state->step = step;
+        state->mask = mask;
+        state->keyframe_us = first->timestamp_us;
+    }
+
+    p = put_header(p, first, count, FRAME_ENC_DELTA, keyframe ? FRAME_FLAG_KEYFRAME : 0,
+                   step, device_id);
+
+    prev_us = frame_sample_us(first);
+    for (size_t i = 0; i < count; i++) {
+        int64_t t = frame_sample_us(&samples[i]);
+
+        p = put_varint(p, (uint32_t)(t - prev_us));
+        prev_us = t;
+
+        for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+            if (!(mask & (1u << c))) continue;
+            int32_t q = quantize(samples[i].ch[c], step);
+            // Wrapping difference; the decoder wraps the same way
+            p = put_varint(p, zigzag((int32_t)((uint32_t)q - (uint32_t)state->prev[c])));
+            state->prev[c] = q;
+        }
+    }
+
+    state->valid = true;
+    state->next_seq = samples[count - 1].seq + 1;
+    return p - buf;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "spectrum.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary spectrum frame, all fields little-endian:
+//
+//   0  u8   version (FRAME_VERSION)
+//   1  u8   type (FRAME_TYPE_*)
+//   2  u8   encoding (frame_encoding_t)
+//   3  u8   flags (FRAME_FLAG_*)
+//   4  u16  device id
+//   6  u16  sample count
+//   8  u32  sequence number of the first sample
+//  12  u32  channel mask (bit n = channel n present), the same for every
+//           sample in the frame
+//  16  u64  timestamp of the first sample, us: UTC since the epoch with
+//           FRAME_FLAG_UTC, else device uptime
+//  24  f32  scale (value = stored * scale for scaled encodings)
+//  28  u8   gain
+//  29  u8   integration cycles
+//  30  u16  reserved, 0
+//  32  samples: u32 time offset from the header timestamp in us, then one
+//      value per channel in the mask, lowest channel first
+//
+// FRAME_ENC_DELTA packs samples differently. The scale is the quantization
+// step and every value is round(v / step) as an integer. Each sample is a
+// varint time offset from the previous sample (the first sample's is 0),
+// then per channel a zig-zag varint of the difference from the same
+// channel in the previous sample. For the first sample of a keyframe the
+// previous values are 0. Otherwise they come from the last sample of the
+// previous frame, which must have seq - 1.
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 32
+
+#define FRAME_TYPE_SPECTRUM 1
+
+#define FRAME_FLAG_STREAM 0x01   // samples come from the debug stream
+#define FRAME_FLAG_KEYFRAME 0x02 // delta encoding: decodable without earlier frames
+#define FRAME_FLAG_REPLAY 0x04   // logged while offline, sent after reconnecting
+#define FRAME_FLAG_RAW 0x08      // values are raw ADC counts, set from SPECTRUM_FLAG_RAW
+#define FRAME_FLAG_REFLECTANCE 0x10  // values are reflectance, set from SPECTRUM_FLAG_REFLECTANCE
+#define FRAME_FLAG_UTC 0x20      // timestamps are the samples' wall_us; every sample must have one
+
+typedef enum {
+    FRAME_ENC_F32 = 0,   // float32 per channel
+    FRAME_ENC_I16 = 1,   // int16 per channel, times the header scale
+    FRAME_ENC_DELTA = 2, // quantized deltas, see above
+    FRAME_ENC_U16 = 3,   // uint16 per channel, times the header scale (1.0 for raw counts)
+} frame_encoding_t;
+
+#define FRAME_ALL_CHANNELS AS7265X_ALL_CHANNELS
+
+// Largest encoded sample: a delta sample with every varint at its 5-byte limit
+#define FRAME_MAX_SAMPLE_SIZE (5 + AS7265X_NUM_CHANNELS * 5)
+// Upper bound on the encoded size of a frame holding count samples
+#define FRAME_MAX_SIZE(count) (FRAME_HEADER_SIZE + (count) * FRAME_MAX_SAMPLE_SIZE)
+
+// Forces a keyframe at least this often, so receivers that join mid-stream
+// or lost a frame resynchronize
+#define FRAME_KEYFRAME_INTERVAL_US 2000000
+
+// Encoder side of the delta chain. Zero-initialize it, and zero it again
+// whenever the receiver may have lost track (new connection, format change).
+typedef struct {
+    bool valid;
+    uint32_t next_seq;
+    float step;
+    uint32_t mask;
+    int64_t keyframe_us;
+    int32_t prev[AS7265X_NUM_CHANNELS];
+} frame_delta_state_t;
+
+// The time a frame carries for a spectrum: wall_us if it has one, else
+// timestamp_us. Spectra in one frame must all have wall_us or all lack it.
+int64_t frame_sample_us(const spectrum_t *s);
+
+// Encodes count spectra into buf with the given extra FRAME_FLAG_* bits.
+// Only the channels in the first spectrum's channel_mask are written (all
+// of them if it is 0), so spectra in one frame must share the mask.
+// Returns the frame length, or 0 if buf is too small.
+size_t frame_encode(uint8_t *buf, size_t cap, const spectrum_t *samples, size_t count,
+                    frame_encoding_t enc, uint8_t flags, uint16_t device_id);
+
+// Delta-encodes count spectra with the given quantization step, continuing
+// the chain in state. Starts a keyframe if the chain is broken, the step or
+// channel mask changed or the keyframe interval elapsed. Sample times must
+// not go backwards within a frame. Returns the frame length, or 0 if buf is
+// too small.
+size_t frame_encode_delta(uint8_t *buf, size_t cap, const spectrum_t *samples, size_t count,
+                          float step, uint16_t device_id, frame_delta_state_t *state);
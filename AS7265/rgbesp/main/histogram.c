@@ -0,0 +1,49 @@
+#include "histogram.h"
+#include <string.h>
+
+static int bucket_index(uint32_t value)
+{
+    int idx = value ? 31 - __builtin_clz(value) : 0;
+
+    return idx < HISTOGRAM_BUCKETS ? idx : HISTOGRAM_BUCKETS - 1;
+}
+
+void histogram_record(histogram_t *h, uint32_t value)
+{
+    h->buckets[bucket_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+}
+
+void histogram_reset(histogram_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void histogram_diff(histogram_t *out, const histogram_t *now, const histogram_t *prev)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        out->buckets[i] = now->buckets[i] - prev->buckets[i];
+    }
+    out->count = now->count - prev->count;
+    out->sum = now->sum - prev->sum;
+    out->max = now->max;
+}
+
+uint32_t histogram_percentile(const histogram_t *h, uint32_t pct)
+{
+    if (h->count == 0) return 0;
+
+    uint64_t target = ((uint64_t)h->count * pct + 99) / 100;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            uint32_t upper = (2u << i) - 1;
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
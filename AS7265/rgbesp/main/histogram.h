@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+// Log2-bucketed histogram: bucket 0 holds values 0..1, bucket i holds
+// [2^i, 2^(i+1)), the last bucket collects everything above.
+#define HISTOGRAM_BUCKETS 20
+
+typedef struct {
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+} histogram_t;
+
+void histogram_record(histogram_t *h, uint32_t value);
+void histogram_reset(histogram_t *h);
+// What was recorded between two snapshots of the same histogram. max cannot
+// be split, so out keeps the later snapshot's all-time max.
+void histogram_diff(histogram_t *out, const histogram_t *now, const histogram_t *prev);
+// Upper bound of the bucket containing the given percentile (0-100)
+uint32_t histogram_percentile(const histogram_t *h, uint32_t pct);
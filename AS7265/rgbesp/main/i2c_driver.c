@@ -1,24 +1,124 @@
 #include "i2c_driver.h"
-#include "driver/i2c.h"
+#include "driver/i2c_master.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
 
 #define I2C_MASTER_SCL_IO  6
 #define I2C_MASTER_SDA_IO  5
-#define I2C_MASTER_NUM     I2C_NUM_0
-#define I2C_MASTER_FREQ_HZ 400000
-#define I2C_MASTER_TX_BUF_DISABLE 0
-#define I2C_MASTER_RX_BUF_DISABLE 0
+#define I2C_MASTER_NUM     0
+#define I2C_GLITCH_IGNORE_CNT 7
+
+#define I2C_MAX_DEVICES 4
+
+static const char *TAG = "I2C";
+
+typedef struct {
+    uint8_t addr;
+    i2c_master_dev_handle_t handle;
+} i2c_device_t;
+
+static i2c_master_bus_handle_t bus = NULL;
+static i2c_device_t devices[I2C_MAX_DEVICES];
+static int device_count = 0;
+static uint32_t clock_hz = CONFIG_I2C_BUS_CLOCK_HZ;
+static uint32_t recoveries = 0;
 
 // I2C master setup for esp32
 
-void i2c_master_init() {
-    i2c_config_t conf = {
-        .mode = I2C_MODE_MASTER,
+static void warn_fast_mode_plus(void) {
+    if (clock_hz > 400000) {
+        ESP_LOGW(TAG, "%lu Hz is Fast-mode Plus; the AS7265x is only specified to 400 kHz",
+                 (unsigned long)clock_hz);
+    }
+}
+
+esp_err_t i2c_master_init(void) {
+    i2c_master_bus_config_t conf = {
+        .i2c_port = I2C_MASTER_NUM,
         .sda_io_num = I2C_MASTER_SDA_IO,
         .scl_io_num = I2C_MASTER_SCL_IO,
-        .sda_pullup_en = GPIO_PULLUP_ENABLE,
-        .scl_pullup_en = GPIO_PULLUP_ENABLE,
-        .master.clk_speed = I2C_MASTER_FREQ_HZ
+        .clk_source = I2C_CLK_SRC_DEFAULT,
+        .glitch_ignore_cnt = I2C_GLITCH_IGNORE_CNT,
+        .trans_queue_depth = 0,   // synchronous, see i2c_driver.h
+        .flags.enable_internal_pullup = true,
     };
-    i2c_param_config(I2C_MASTER_NUM, &conf);
-    i2c_driver_install(I2C_MASTER_NUM, conf.mode, I2C_MASTER_RX_BUF_DISABLE, I2C_MASTER_TX_BUF_DISABLE, 0);
-}
\ No newline at end of file
+
+    warn_fast_mode_plus();
+    return i2c_new_master_bus(&conf, &bus);
+}
+
+// Device handles are created on first use at the current bus clock
+static esp_err_t get_device(uint8_t addr, i2c_master_dev_handle_t *out) {
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i].addr == addr) {
+            *out = devices[i].handle;
+            return ESP_OK;
+        }
+    }
+    if (!bus) return ESP_ERR_INVALID_STATE;
+    if (device_count == I2C_MAX_DEVICES) return ESP_ERR_NO_MEM;
+
+    i2c_device_config_t dev_cfg = {
+        .dev_addr_length = I2C_ADDR_BIT_LEN_7,
+        .device_address = addr,
+        .scl_speed_hz = clock_hz,
+    };
+    esp_err_t ret = i2c_master_bus_add_device(bus, &dev_cfg, out);
+    if (ret != ESP_OK) return ret;
+
+    devices[device_count].addr = addr;
+    devices[device_count].handle = *out;
+    device_count++;
+    return ESP_OK;
+}
+
+esp_err_t i2c_device_write(uint8_t addr, const uint8_t *buf, size_t len, int timeout_ms) {
+    i2c_master_dev_handle_t dev;
+    esp_err_t ret = get_device(addr, &dev);
+
+    if (ret != ESP_OK) return ret;
+    return i2c_master_transmit(dev, buf, len, timeout_ms);
+}
+
+esp_err_t i2c_device_write_read(uint8_t addr, const uint8_t *wbuf, size_t wlen,
+                                uint8_t *rbuf, size_t rlen, int timeout_ms) {
+    i2c_master_dev_handle_t dev;
+    esp_err_t ret = get_device(addr, &dev);
+
+    if (ret != ESP_OK) return ret;
+    return i2c_master_transmit_receive(dev, wbuf, wlen, rbuf, rlen, timeout_ms);
+}
+
+// The SCL rate is a per-device setting in the i2c_master driver, so a clock
+// change drops the device handles and lets them be re-added at the new rate
+esp_err_t i2c_bus_set_clock(uint32_t hz) {
+    if (hz < I2C_BUS_MIN_CLOCK_HZ || hz > I2C_BUS_MAX_CLOCK_HZ) return ESP_ERR_INVALID_ARG;
+    if (hz == clock_hz) return ESP_OK;
+
+    for (int i = 0; i < device_count; i++) {
+        i2c_master_bus_rm_device(devices[i].handle);
+    }
+    device_count = 0;
+    clock_hz = hz;
+    warn_fast_mode_plus();
+    return ESP_OK;
+}
+
+uint32_t i2c_bus_get_clock(void) {
+    return clock_hz;
+}
+
+// The controller can clock a stuck slave off the bus by itself (up to 9 SCL
+// pulses until SDA is released, then STOP)
+esp_err_t i2c_bus_recover(void) {
+    if (!bus) return ESP_ERR_INVALID_STATE;
+
+    recoveries++;
+    esp_err_t ret = i2c_master_bus_reset(bus);
+    ESP_LOGW(TAG, "Bus recovery #%lu: %s", (unsigned long)recoveries, esp_err_to_name(ret));
+    return ret;
+}
+
+uint32_t i2c_bus_recovery_count(void) {
+    return recoveries;
+}
@@ -1,5 +1,26 @@
 #pragma once
 
-#include "driver/i2c.h"
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
 
-void i2c_master_init(void);
\ No newline at end of file
+// Transactions are synchronous. The AS7265x virtual register interface makes
+// every byte depend on a status poll, so there is nothing to queue ahead.
+esp_err_t i2c_master_init(void);
+esp_err_t i2c_device_write(uint8_t addr, const uint8_t *buf, size_t len, int timeout_ms);
+esp_err_t i2c_device_write_read(uint8_t addr, const uint8_t *wbuf, size_t wlen,
+                                uint8_t *rbuf, size_t rlen, int timeout_ms);
+
+#define I2C_BUS_MIN_CLOCK_HZ 10000
+#define I2C_BUS_MAX_CLOCK_HZ 1000000
+
+// Bus clock in Hz, CONFIG_I2C_BUS_CLOCK_HZ until changed. Device handles are
+// dropped and re-added at the new rate, so only the task that owns the bus
+// may change it, between transactions: the sampler task once it runs, see
+// sampler_set_bus_clock().
+esp_err_t i2c_bus_set_clock(uint32_t hz);
+uint32_t i2c_bus_get_clock(void);
+
+// Clocks a stuck slave off the bus
+esp_err_t i2c_bus_recover(void);
+uint32_t i2c_bus_recovery_count(void);
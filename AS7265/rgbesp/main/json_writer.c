@@ -0,0 +1,371 @@
+#include "json_writer.h"
+#include "sdkconfig.h"
+#include <limits.h>
+#include <math.h>
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void json_writer_init(json_writer_t *w, char *buf, size_t cap)
+{
+    w->buf = buf;
+    w->cap = cap;
+    w->len = 0;
+    w->overflow = cap == 0;
+    w->depth = 0;
+    w->has_items = 0;
+    w->after_key = false;
+}
+
+static void put(json_writer_t *w, const char *s, size_t n)
+{
+    // Keep one byte for the terminator added by json_writer_finish()
+    if (w->overflow || w->len + n >= w->cap) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+}
+
+static void put_char(json_writer_t *w, char c)
+{
+    put(w, &c, 1);
+}
+
+// Separator before a value in an array, or before a key in an object
+static void begin_item(json_writer_t *w)
+{
+    uint8_t bit = 1u << w->depth;
+
+    if (w->has_items & bit) put_char(w, ',');
+    w->has_items |= bit;
+}
+
+// Values directly after a key must not get a separator of their own
+static void begin_value(json_writer_t *w)
+{
+    if (w->depth > 0 && !w->after_key) begin_item(w);
+    w->after_key = false;
+}
+
+static void begin_container(json_writer_t *w, char open)
+{
+    begin_value(w);
+    put_char(w, open);
+    if (w->depth + 1 >= JSON_WRITER_MAX_DEPTH) {
+        w->overflow = true;
+        return;
+    }
+    w->depth++;
+    w->has_items &= ~(1u << w->depth);
+}
+
+static void end_container(json_writer_t *w, char close)
+{
+    if (w->depth > 0) w->depth--;
+    put_char(w, close);
+}
+
+void json_begin_object(json_writer_t *w)
+{
+    begin_container(w, '{');
+}
+
+void json_end_object(json_writer_t *w)
+{
+    end_container(w, '}');
+}
+
+void json_begin_array(json_writer_t *w)
+{
+    begin_container(w, '[');
+}
+
+void json_end_array(json_writer_t *w)
+{
+    end_container(w, ']');
+}
+
+// Same escaping as cJSON's print_string_ptr(): quote, backslash and the
+// short escapes, other control characters as \u00XX, everything else raw
+static void put_escaped(json_writer_t *w, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run = s;
+
+    put_char(w, '"');
+    for (; s && *s; s++) {
+        unsigned char c = *s;
+        char esc[6] = { '\\', 0 };
+        size_t n = 2;
+
+        if (c >= 32 && c != '"' && c != '\\') continue;
+
+        put(w, run, s - run);
+        run = s + 1;
+
+        switch (c) {
+            case '"':  esc[1] = '"'; break;
+            case '\\': esc[1] = '\\'; break;
+            case '\b': esc[1] = 'b'; break;
+            case '\f': esc[1] = 'f'; break;
+            case '\n': esc[1] = 'n'; break;
+            case '\r': esc[1] = 'r'; break;
+            case '\t': esc[1] = 't'; break;
+            default:
+                esc[1] = 'u';
+                esc[2] = '0';
+                esc[3] = '0';
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 0xF];
+                n = 6;
+                break;
+        }
+        put(w, esc, n);
+    }
+    if (s) put(w, run, s - run);
+    put_char(w, '"');
+}
+
+void json_key(json_writer_t *w, const char *key)
+{
+    begin_item(w);
+    put_escaped(w, key);
+    put_char(w, ':');
+    w->after_key = true;
+}
+
+void json_string(json_writer_t *w, const char *s)
+{
+    begin_value(w);
+    put_escaped(w, s);
+}
+
+static size_t format_int(char *out, int v)
+{
+    char tmp[12];
+    size_t n = 0, len = 0;
+    // Negate as unsigned so INT_MIN does not overflow
+    unsigned u = v < 0 ? 0u - (unsigned)v : (unsigned)v;
+
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+
+    if (v < 0) out[len++] = '-';
+    while (n) out[len++] = tmp[--n];
+    return len;
+}
+
+// cJSON's compare_double()
+static bool same_double(double a, double b)
+{
+    double max = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
+    return fabs(a - b) <= max * DBL_EPSILON;
+}
+
+// Mirrors cJSON's print_number(). Whole numbers in int range, which covers
+// raw counts and zeroed channels, take an integer path. Everything else gets
+// the same %1.15g / %1.17g round-trip choice as cJSON, checked with strtod
+// instead of sscanf.
+static size_t format_number(char *out, size_t cap, double d)
+{
+    int i;
+
+    if (isnan(d) || isinf(d)) {
+        memcpy(out, "null", 4);
+        return 4;
+    }
+
+    // cJSON compares against the saturated valueint
+    if (d >= INT_MAX) i = INT_MAX;
+    else if (d <= (double)INT_MIN) i = INT_MIN;
+    else i = (int)d;
+
+    if (d == (double)i) return format_int(out, i);
+
+    int n = snprintf(out, cap, "%1.15g", d);
+    if (!same_double(strtod(out, NULL), d)) {
+        n = snprintf(out, cap, "%1.17g", d);
+    }
+    return n > 0 && (size_t)n < cap ? (size_t)n : 0;
+}
+
+void json_number(json_writer_t *w, double v)
+{
+    char num[26];
+    size_t n;
+
+    begin_value(w);
+    n = format_number(num, sizeof(num), v);
+    if (n == 0) w->overflow = true;
+    put(w, num, n);
+}
+
+void json_bool(json_writer_t *w, bool v)
+{
+    begin_value(w);
+    if (v) put(w, "true", 4);
+    else put(w, "false", 5);
+}
+
+const char *json_writer_finish(json_writer_t *w)
+{
+    if (w->overflow || w->depth != 0) return NULL;
+    w->buf[w->len] = '\0';
+    return w->buf;
+}
+
+#if CONFIG_JSON_WRITER_SELF_TEST
+#include "cJSON.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+static const char *TAG = "JSON";
+
+// Representative sensor values plus the cases where cJSON's number printing
+// branches: integer boundaries, values that need 17 digits, non-finite
+static const double test_numbers[] = {
+    0.0, -0.0, 1.0, -1.0, 0.5, 0.1f, 1.0 / 3.0, 123.456f, 2.5e-3f, 1e-7f,
+    65535.0, 3.4e38f, 1.17549435e-38f, 1e15, 1e16, 123456789012345678.0,
+    2147483647.0, 2147483648.0, -2147483648.0, -2147483649.0, 0.1, 1e300,
+    NAN, INFINITY,
+};
+
+static const char *test_strings[] = {
+    "", "ESP connected", "quote \" backslash \\ slash /",
+    "\b\f\n\r\t \x01\x1f", "caf\xc3\xa9",
+};
+
+#define SELF_TEST_RANDOM 2000
+#define SELF_TEST_ALLOC_RUNS 100
+
+static volatile TaskHandle_t alloc_watch_task = NULL;
+static volatile uint32_t alloc_count = 0;
+
+// CONFIG_HEAP_USE_HOOKS: called for every successful allocation
+void esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps)
+{
+    if (alloc_watch_task && alloc_watch_task == xTaskGetCurrentTaskHandle()) alloc_count++;
+}
+
+static bool matches_cjson(json_writer_t *w, cJSON *root)
+{
+    const char *ours = json_writer_finish(w);
+    char *theirs = cJSON_PrintUnformatted(root);
+    bool same = ours && theirs && strcmp(ours, theirs) == 0;
+
+    if (!same) {
+        ESP_LOGE(TAG, "Mismatch:\n  cJSON:  %s\n  writer: %s",
+                 theirs ? theirs : "(null)", ours ? ours : "(overflow)");
+    }
+    free(theirs);
+    cJSON_Delete(root);
+    return same;
+}
+
+static bool check_number(char *buf, size_t cap, double v)
+{
+    json_writer_t w;
+    cJSON *root = cJSON_CreateArray();
+
+    cJSON_AddItemToArray(root, cJSON_CreateNumber(v));
+    json_writer_init(&w, buf, cap);
+    json_begin_array(&w);
+    json_number(&w, v);
+    json_end_array(&w);
+    return matches_cjson(&w, root);
+}
+
+static void write_sensor(json_writer_t *w, const float *ch, int n)
+{
+    json_begin_object(w);
+    json_key(w, "type");
+    json_string(w, "sensor");
+    json_key(w, "readings");
+    json_begin_array(w);
+    for (int i = 0; i < n; i++) json_number(w, ch[i]);
+    json_end_array(w);
+    json_end_object(w);
+}
+
+bool json_writer_self_test(void)
+{
+    static char buf[512];
+    float ch[18];
+    uint32_t x = 0x12345678;
+    json_writer_t w;
+
+    for (size_t i = 0; i < sizeof(test_numbers) / sizeof(test_numbers[0]); i++) {
+        if (!check_number(buf, sizeof(buf), test_numbers[i])) return false;
+    }
+
+    // Random finite floats over the whole exponent range
+    for (int i = 0; i < SELF_TEST_RANDOM; i++) {
+        float f;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        memcpy(&f, &x, sizeof(f));
+        if (isfinite(f) && !check_number(buf, sizeof(buf), f)) return false;
+    }
+
+    for (size_t i = 0; i < sizeof(test_strings) / sizeof(test_strings[0]); i++) {
+        cJSON *root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "type", "status");
+        cJSON_AddStringToObject(root, "message", test_strings[i]);
+
+        json_writer_init(&w, buf, sizeof(buf));
+        json_begin_object(&w);
+        json_key(&w, "type");
+        json_string(&w, "status");
+        json_key(&w, "message");
+        json_string(&w, test_strings[i]);
+        json_end_object(&w);
+        if (!matches_cjson(&w, root)) return false;
+    }
+
+    for (int i = 0; i < 18; i++) ch[i] = test_numbers[i];
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "type", "sensor");
+    cJSON *arr = cJSON_CreateArray();
+    for (int i = 0; i < 18; i++) cJSON_AddItemToArray(arr, cJSON_CreateNumber(ch[i]));
+    cJSON_AddItemToObject(root, "readings", arr);
+    json_writer_init(&w, buf, sizeof(buf));
+    write_sensor(&w, ch, 18);
+    if (!matches_cjson(&w, root)) return false;
+
+    // Steady state must not touch the heap. The first run above already paid
+    // for any one-off per-task state in the C library's float formatting.
+    size_t free_before = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    alloc_count = 0;
+    alloc_watch_task = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < SELF_TEST_ALLOC_RUNS; i++) {
+        json_writer_init(&w, buf, sizeof(buf));
+        write_sensor(&w, ch, 18);
+        json_writer_finish(&w);
+    }
+    alloc_watch_task = NULL;
+    size_t free_after = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+
+    if (alloc_count != 0 || free_after != free_before) {
+        ESP_LOGE(TAG, "%lu allocations in %d sensor messages (free heap %u -> %u)",
+                 (unsigned long)alloc_count, SELF_TEST_ALLOC_RUNS,
+                 (unsigned)free_before, (unsigned)free_after);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Self test passed, no allocations in %d sensor messages", SELF_TEST_ALLOC_RUNS);
+    return true;
+}
+#else
+bool json_writer_self_test(void)
+{
+    return true;
+}
+#endif
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JSON_WRITER_MAX_DEPTH 8
+
+// Streaming JSON writer for the fixed-shape messages we send. Writes into a
+// caller-owned buffer and never allocates. The output is byte-identical to
+// cJSON_PrintUnformatted() for the same document.
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t len;
+    bool overflow;              // set once anything did not fit; len stops growing
+    uint8_t depth;
+    uint8_t has_items;          // bit n: container at depth n already holds a value
+    bool after_key;             // the next value completes an object member
+} json_writer_t;
+
+void json_writer_init(json_writer_t *w, char *buf, size_t cap);
+
+void json_begin_object(json_writer_t *w);
+void json_end_object(json_writer_t *w);
+void json_begin_array(json_writer_t *w);
+void json_end_array(json_writer_t *w);
+
+// Object member name; the next value written belongs to it
+void json_key(json_writer_t *w, const char *key);
+void json_string(json_writer_t *w, const char *s);
+void json_number(json_writer_t *w, double v);
+void json_bool(json_writer_t *w, bool v);
+
+// NUL-terminated output, or NULL if the buffer was too small
+const char *json_writer_finish(json_writer_t *w);
+
+// Compares the writer against cJSON for a spread of numbers and strings.
+// Returns false and logs the first mismatch.
+bool json_writer_self_test(void);
@@ -0,0 +1,221 @@
+#include "lowpower.h"
+#include "i2c_driver.h"
+#include "spectrum.h"
+#include "speclog.h"
+#include "wifi.h"
+#include "websocket.h"
+#include "clocksync.h"
+#include "json_writer.h"
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rtc_time.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <string.h>
+
+// The options below only exist with the mode enabled
+#if CONFIG_LOWPOWER_MODE
+
+#define LOWPOWER_MAGIC 0x52574C50   // "PLWR"
+#define LOWPOWER_MIN_SLEEP_US 10000
+#define LOWPOWER_POLL_MS 50
+#define LOWPOWER_REPORT_JSON_SIZE 320
+
+// Give up on a frame if DATA_RDY takes this much longer than the frame time
+#define DATA_READY_SLACK_MS 200
+
+typedef struct {
+    uint32_t magic;
+    uint32_t next_seq;
+    uint32_t count;
+    spectrum_t buf[CONFIG_LOWPOWER_UPLOAD_EVERY];
+
+    // Energy accounting since power-on
+    int64_t first_wake_us;      // RTC time of the first wake
+    uint32_t sample_wakes;      // wakes that only took a sample
+    uint32_t upload_wakes;
+    uint64_t sample_awake_us;   // time awake in each kind of wake, as seen by esp_timer
+    uint64_t upload_awake_us;
+    uint32_t samples;
+} lowpower_state_t;
+
+static const char *TAG = "LOWPOWER";
+
+// Survives deep sleep, lost on power-on and reset
+static RTC_DATA_ATTR lowpower_state_t rtc;
+
+// The RTC counter keeps counting through deep sleep, where esp_timer restarts
+// at every wake. Unlike the system clock, SNTP never steps it: UTC only goes
+// into wall_us.
+static int64_t rtc_now_us(void)
+{
+    return (int64_t)esp_rtc_get_time_us();
+}
+
+static bool take_sample(spectrum_t *s)
+{
+    uint32_t timeout_ms = as7265x_frame_time_us() / 1000 * 2 + DATA_READY_SLACK_MS;
+
+    memset(s, 0, sizeof(*s));
+    s->kind = SPECTRUM_KIND_STREAM;
+    if (as7265x_start_one_shot() != ESP_OK || as7265x_wait_data_ready(timeout_ms) != ESP_OK) {
+        return false;
+    }
+    s->timestamp_us = rtc_now_us();
+    s->wall_us = clocksync_system_wall_us();
+    s->seq = rtc.next_seq++;
+    s->gain = as7265x_get_gain();
+    s->integration_cycles = as7265x_get_integration_cycles();
+
+    // Only the boot channel set: fewer reads, less time awake
+    as7265x_read_plan_t plan;
+    as7265x_plan_init(&plan, CONFIG_AS7265X_CHANNEL_MASK);
+    s->channel_mask = plan.mask;
+    return as7265x_read_plan(&plan, s->ch) == ESP_OK;
+}
+
+// Charge in microcoulombs (uA * s) over everything since power-on, plus the
+// time it covers. Boot before app_main is not visible to esp_timer, so each
+// wake is charged CONFIG_LOWPOWER_WAKE_OVERHEAD_MS at the active current.
+static double estimate_charge_uc(double *elapsed_s)
+{
+    uint32_t wakes = rtc.sample_wakes + rtc.upload_wakes;
+    double overhead_s = wakes * CONFIG_LOWPOWER_WAKE_OVERHEAD_MS / 1000.0;
+    double sample_s = rtc.sample_awake_us / 1e6 + overhead_s;
+    double upload_s = rtc.upload_awake_us / 1e6;
+    double sleep_s;
+
+    *elapsed_s = (rtc_now_us() - rtc.first_wake_us) / 1e6;
+    sleep_s = *elapsed_s - sample_s - upload_s;
+    if (sleep_s < 0) sleep_s = 0;
+
+    return sample_s * CONFIG_LOWPOWER_ACTIVE_MA * 1000.0 +
+           upload_s * CONFIG_LOWPOWER_WIFI_MA * 1000.0 +
+           sleep_s * CONFIG_LOWPOWER_SLEEP_UA;
+}
+
+static bool send_report(void)
+{
+    char buf[LOWPOWER_REPORT_JSON_SIZE];
+    double elapsed_s;
+    double charge_uc = estimate_charge_uc(&elapsed_s);
+    double energy_uj = charge_uc * CONFIG_LOWPOWER_SUPPLY_MV / 1000.0;
+    json_writer_t w;
+
+    json_writer_init(&w, buf, sizeof(buf));
+    json_begin_object(&w);
+    json_key(&w, "type");
+    json_string(&w, "status");
+    json_key(&w, "message");
+    json_string(&w, "Low-power upload");
+    json_key(&w, "lowpower");
+    json_begin_object(&w);
+    json_key(&w, "samples");
+    json_number(&w, rtc.samples);
+    json_key(&w, "uploads");
+    json_number(&w, rtc.upload_wakes);
+    json_key(&w, "sample_wake_ms");
+    json_number(&w, rtc.sample_wakes ? (double)(rtc.sample_awake_us / rtc.sample_wakes / 1000) : 0);
+    json_key(&w, "upload_wake_ms");
+    json_number(&w, rtc.upload_wakes ? (double)(rtc.upload_awake_us / rtc.upload_wakes / 1000) : 0);
+    json_key(&w, "energy_uj_per_sample");
+    json_number(&w, rtc.samples ? (double)(uint32_t)(energy_uj / rtc.samples) : 0);
+    json_key(&w, "avg_current_ua");
+    json_number(&w, elapsed_s > 0 ? (double)(uint32_t)(charge_uc / elapsed_s) : 0);
+    json_end_object(&w);
+    json_end_object(&w);
+
+    const char *json = json_writer_finish(&w);
+    if (!json) return true;     // nothing worth retrying
+
+    ESP_LOGI(TAG, "%s", json);
+    return websocket_send_json(json, w.len);
+}
+
+// Hands the batch to the offline log and stays up until the relay has taken
+// all of it, or CONFIG_LOWPOWER_UPLOAD_TIMEOUT_S passes. Whatever is left
+// stays in flash for the next upload.
+static void upload(void)
+{
+    int64_t deadline_us = esp_timer_get_time() + (int64_t)CONFIG_LOWPOWER_UPLOAD_TIMEOUT_S * 1000000;
+    bool reported = false;
+
+    for (uint32_t i = 0; i < rtc.count; i++) {
+        if (speclog_append(&rtc.buf[i]) != ESP_OK) {
+            ESP_LOGW(TAG, "Spectrum %lu not logged", (unsigned long)rtc.buf[i].seq);
+        }
+    }
+    rtc.count = 0;
+
+    wifi_init_sta();
+    // Sets the system clock, and with it wall_us of the next samples, to UTC
+    clocksync_start();
+    websocket_start();
+
+    while (esp_timer_get_time() < deadline_us) {
+        if (websocket_is_connected()) {
+            if (!reported) reported = send_report();
+            if (reported && speclog_pending() == 0) break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(LOWPOWER_POLL_MS));
+    }
+    if (speclog_pending() > 0) {
+        ESP_LOGW(TAG, "%lu spectra left for the next upload", (unsigned long)speclog_pending());
+    }
+
+    websocket_stop();
+    esp_wifi_stop();
+}
+
+void lowpower_run(const as7265x_config_t *sensor_cfg)
+{
+    spectrum_t s;
+    bool uploading;
+
+    if (rtc.magic != LOWPOWER_MAGIC || esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER) {
+        memset(&rtc, 0, sizeof(rtc));
+        rtc.magic = LOWPOWER_MAGIC;
+        rtc.first_wake_us = rtc_now_us();
+    }
+
+    if (i2c_master_init() == ESP_OK && as7265x_init(sensor_cfg) == ESP_OK) {
+        as7265x_leds_off();
+        if (take_sample(&s)) {
+            rtc.buf[rtc.count++] = s;
+            rtc.samples++;
+        } else {
+            ESP_LOGW(TAG, "Measurement failed");
+        }
+    } else {
+        ESP_LOGE(TAG, "Sensor unavailable");
+    }
+
+    uploading = rtc.count >= CONFIG_LOWPOWER_UPLOAD_EVERY;
+    if (uploading) upload();
+
+    int64_t awake_us = esp_timer_get_time();
+    if (uploading) {
+        rtc.upload_wakes++;
+        rtc.upload_awake_us += awake_us;
+    } else {
+        rtc.sample_wakes++;
+        rtc.sample_awake_us += awake_us;
+    }
+
+    // Keep the cadence: the time awake comes off the sleep
+    int64_t sleep_us = (int64_t)CONFIG_LOWPOWER_INTERVAL_S * 1000000 - awake_us -
+                       CONFIG_LOWPOWER_WAKE_OVERHEAD_MS * 1000;
+    if (sleep_us < LOWPOWER_MIN_SLEEP_US) sleep_us = LOWPOWER_MIN_SLEEP_US;
+
+    ESP_LOGI(TAG, "%lu/%d buffered, awake %lld ms, sleeping %lld ms",
+             (unsigned long)rtc.count, CONFIG_LOWPOWER_UPLOAD_EVERY,
+             (long long)(awake_us / 1000), (long long)(sleep_us / 1000));
+    esp_sleep_enable_timer_wakeup(sleep_us);
+    esp_deep_sleep_start();
+}
+
+#endif // CONFIG_LOWPOWER_MODE
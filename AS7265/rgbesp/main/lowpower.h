@@ -0,0 +1,14 @@
+#pragma once
+
+#include "as7265x.h"
+
+// Duty-cycled acquisition (CONFIG_LOWPOWER_MODE): every wake from deep sleep
+// takes one spectrum with the sensor's LEDs off and keeps it in RTC memory.
+// Every CONFIG_LOWPOWER_UPLOAD_EVERY samples the batch moves to the offline
+// log and WiFi comes up to replay it, then the device sleeps again.
+//
+// Wake times are accumulated across sleeps and turned into an estimated
+// energy per sample from the currents configured in Kconfig.
+
+// Runs one wake cycle and enters deep sleep; does not return
+void lowpower_run(const as7265x_config_t *sensor_cfg);
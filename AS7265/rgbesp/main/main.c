@@ -3,10 +3,22 @@
 #include "as7265x.h"
 #include "esp_log.h"
 #include "wifi.h"
+#include "clocksync.h"
 #include "websocket.h"
+#include "sampler.h"
+#include "speclog.h"
+#include "telemetry.h"
+#include "boot.h"
+#include "lowpower.h"
 #include "nvs_flash.h"
+#include "sdkconfig.h"
 
 
+// Boot order: storage first, then the network is started in the
+// background (association and DHCP run on the WiFi tasks) while the sensor
+// is brought up and warmed up here. Spectra taken before the link is up are
+// kept by the sender in the offline log; the websocket connects as soon as
+// there is an IP.
 void app_main(void) {
     ESP_LOGI("MAIN", "Starting...");
 
@@ -16,12 +28,45 @@ void app_main(void) {
         nvs_flash_init();
     }
 
+    // Before the websocket: spectra logged on earlier runs are replayed once connected
+    speclog_init();
+    boot_mark(BOOT_NVS);
+
+    as7265x_config_t sensor_cfg = {
+        .gain = CONFIG_AS7265X_GAIN,
+        .integration_cycles = CONFIG_AS7265X_INTEGRATION_CYCLES,
+        .mode = AS7265X_MODE_6CHAN_ONE_SHOT,
+        .int_gpio = CONFIG_AS7265X_INT_GPIO,
+    };
+
+#if CONFIG_LOWPOWER_MODE
+    // Samples and goes back to deep sleep; WiFi only comes up to upload
+    lowpower_run(&sensor_cfg);
+#endif
+
     wifi_init_sta();
+    boot_mark(BOOT_WIFI_START);
+    // Syncs once there is an IP; spectra before that carry no UTC time
+    clocksync_start();
+    // The sender exists from here on, so nothing sampled before the link is lost
     websocket_start();
 
-    i2c_master_init();
+    ESP_ERROR_CHECK(i2c_master_init());
     ESP_LOGI("AS7265X", "I2C initialized");
 
+    if (as7265x_init(&sensor_cfg) != ESP_OK) {
+        ESP_LOGE("AS7265X", "Sensor configuration failed");
+    } else {
+        boot_mark(BOOT_SENSOR);
+    }
+
+    // From here on the sampler task owns the I2C bus; it starts with the warm-up
+    sampler_start();
+    telemetry_start();
+
+    ESP_LOGI("MAIN", "Sensor ready %lld ms after boot",
+             (long long)(boot_phase_us(BOOT_SENSOR) / 1000));
+
     // while (1) {
     //     float ch[18]; // 6 channels per device × 3 devices
     //     int idx = 0;
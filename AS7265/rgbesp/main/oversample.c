@@ -0,0 +1,137 @@
+#include "oversample.h"
+#include <string.h>
+
+#define OVERSAMPLE_MAX_TRIM_PCT 40
+#define OVERSAMPLE_MIN_FRAMES 3
+#define OVERSAMPLE_MAX_TARGET_BP 1000
+
+// Channels darker than this many counts do not hold up the noise target;
+// their relative noise is large however many frames are taken
+#define OVERSAMPLE_NOISE_FLOOR 16
+
+void oversample_config_clamp(oversample_config_t *cfg)
+{
+    if (cfg->n < 1) cfg->n = 1;
+    if (cfg->n > OVERSAMPLE_MAX_N) cfg->n = OVERSAMPLE_MAX_N;
+    if (cfg->method > OVERSAMPLE_TRIMMED) cfg->method = OVERSAMPLE_MEAN;
+    if (cfg->trim_pct > OVERSAMPLE_MAX_TRIM_PCT) cfg->trim_pct = OVERSAMPLE_MAX_TRIM_PCT;
+    if (cfg->noise_target_bp > OVERSAMPLE_MAX_TARGET_BP) cfg->noise_target_bp = OVERSAMPLE_MAX_TARGET_BP;
+}
+
+void oversample_reset(oversample_t *os)
+{
+    os->frames = 0;
+    memset(os->n, 0, sizeof(os->n));
+    memset(os->sum, 0, sizeof(os->sum));
+    memset(os->sum_sq, 0, sizeof(os->sum_sq));
+}
+
+bool oversample_add(oversample_t *os, const uint16_t raw[AS7265X_NUM_CHANNELS])
+{
+    if (os->frames >= OVERSAMPLE_MAX_N) return false;
+
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        uint16_t x = raw[c];
+
+        if (x == OVERSAMPLE_SATURATED) continue;
+        os->samples[os->n[c]++][c] = x;
+        os->sum[c] += x;
+        os->sum_sq[c] += (uint32_t)x * x;
+    }
+    os->frames++;
+    return true;
+}
+
+// n(n-1) times the sample variance; exact, the sums are integers
+static uint64_t scaled_variance(const oversample_t *os, int c)
+{
+    uint64_t n = os->n[c];
+    uint64_t s1 = os->sum[c];
+
+    return n * os->sum_sq[c] - s1 * s1;
+}
+
+bool oversample_converged(const oversample_t *os, const oversample_config_t *cfg)
+{
+    uint64_t target = cfg->noise_target_bp;
+
+    if (target == 0 || os->frames < OVERSAMPLE_MIN_FRAMES) return false;
+
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        uint64_t n = os->n[c];
+
+        if (n < OVERSAMPLE_MIN_FRAMES || os->sum[c] < n * OVERSAMPLE_NOISE_FLOOR) continue;
+
+        // Standard error below target * mean, squared and with the
+        // divisions multiplied out: var / n <= (bp / 1e4)^2 * mean^2
+        uint64_t var = scaled_variance(os, c) / (n * (n - 1));
+        uint64_t mean = os->sum[c] / n;
+        if (var * 100000000ull > target * target * mean * mean * n) return false;
+    }
+    return true;
+}
+
+uint32_t oversample_isqrt64(uint64_t v)
+{
+    uint64_t r = 0, bit = 1ull << 62;
+
+    while (bit > v) bit >>= 2;
+    while (bit) {
+        if (v >= r + bit) {
+            v -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t)r;
+}
+
+static void sort_u16(uint16_t *v, int n)
+{
+    for (int i = 1; i < n; i++) {
+        uint16_t x = v[i];
+        int j = i;
+        for (; j > 0 && v[j - 1] > x; j--) v[j] = v[j - 1];
+        v[j] = x;
+    }
+}
+
+void oversample_result(oversample_t *os, const oversample_config_t *cfg,
+                       uint32_t value[AS7265X_NUM_CHANNELS], uint32_t std[AS7265X_NUM_CHANNELS])
+{
+    uint16_t col[OVERSAMPLE_MAX_N];
+
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        int n = os->n[c];
+
+        if (n == 0) {
+            value[c] = (uint32_t)OVERSAMPLE_SATURATED << OVERSAMPLE_SHIFT;
+            std[c] = 0;
+            continue;
+        }
+
+        std[c] = n < 2 ? 0 : oversample_isqrt64((scaled_variance(os, c) << (2 * OVERSAMPLE_SHIFT)) /
+                                      ((uint64_t)n * (n - 1)));
+
+        if (cfg->method == OVERSAMPLE_MEAN) {
+            value[c] = (os->sum[c] << OVERSAMPLE_SHIFT) / n;
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) col[i] = os->samples[i][c];
+        sort_u16(col, n);
+
+        if (cfg->method == OVERSAMPLE_MEDIAN) {
+            value[c] = n & 1 ? (uint32_t)col[n / 2] << OVERSAMPLE_SHIFT
+                             : ((uint32_t)col[n / 2 - 1] + col[n / 2]) << (OVERSAMPLE_SHIFT - 1);
+        } else {
+            int k = n * cfg->trim_pct / 100;
+            uint32_t sum = 0;
+
+            for (int i = k; i < n - k; i++) sum += col[i];
+            value[c] = (sum << OVERSAMPLE_SHIFT) / (n - 2 * k);
+        }
+    }
+}
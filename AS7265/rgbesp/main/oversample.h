@@ -0,0 +1,58 @@
+#pragma once
+
+#include "as7265x.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Oversampling of on-demand measurements in raw counts. Frames that failed
+// to read are not added; saturated channels are left out of that frame.
+// Running sums give the mean and variance exactly in integers, and the
+// kept samples stay around for the median and trimmed mean.
+//
+// Results are Q24.8 counts; the caller applies the calibration.
+
+#define OVERSAMPLE_MAX_N 64
+#define OVERSAMPLE_SHIFT 8
+
+// A full-scale count means the ADC clipped
+#define OVERSAMPLE_SATURATED UINT16_MAX
+
+typedef enum {
+    OVERSAMPLE_MEAN = 0,
+    OVERSAMPLE_MEDIAN = 1,
+    OVERSAMPLE_TRIMMED = 2,     // mean without trim_pct of the samples at each end
+} oversample_method_t;
+
+typedef struct {
+    uint8_t n;                  // frames to take, 1..OVERSAMPLE_MAX_N
+    oversample_method_t method;
+    uint8_t trim_pct;           // 0..40
+    uint16_t noise_target_bp;   // stop once the standard error is below this share
+                                // of the mean, in 0.01 %; 0 always takes n frames
+} oversample_config_t;
+
+typedef struct {
+    uint8_t frames;                         // frames added
+    uint8_t n[AS7265X_NUM_CHANNELS];        // samples kept per channel
+    uint32_t sum[AS7265X_NUM_CHANNELS];
+    uint64_t sum_sq[AS7265X_NUM_CHANNELS];
+    uint16_t samples[OVERSAMPLE_MAX_N][AS7265X_NUM_CHANNELS];  // channel c's i-th sample at [i][c]
+} oversample_t;
+
+// Clamps every field to its range
+void oversample_config_clamp(oversample_config_t *cfg);
+
+void oversample_reset(oversample_t *os);
+// Returns false once OVERSAMPLE_MAX_N frames have been added
+bool oversample_add(oversample_t *os, const uint16_t raw[AS7265X_NUM_CHANNELS]);
+// True once every channel bright enough to judge meets the noise target,
+// with at least 3 frames in. Always false without a target.
+bool oversample_converged(const oversample_t *os, const oversample_config_t *cfg);
+// Estimate and sample standard deviation per channel, Q24.8 counts. A
+// channel with no samples left (saturated in every frame) reads full scale.
+// Sorts the kept samples for the median and trimmed mean.
+void oversample_result(oversample_t *os, const oversample_config_t *cfg,
+                       uint32_t value[AS7265X_NUM_CHANNELS], uint32_t std[AS7265X_NUM_CHANNELS]);
+// Integer square root, rounded down; combines standard deviations without
+// the soft-float sqrtf
+uint32_t oversample_isqrt64(uint64_t v);
@@ -0,0 +1,904 @@
+#include "sampler.h"
+#include "spectrum_ring.h"
+#include "as7265x.h"
+#include "fixcal.h"
+#include "oversample.h"
+#include "unitcal.h"
+#include "clocksync.h"
+#include "i2c_driver.h"
+#include "boot.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SAMPLER_CMD_READ       BIT0
+#define SAMPLER_CMD_STREAM_ON  BIT1
+#define SAMPLER_CMD_STREAM_OFF BIT2
+#define SAMPLER_CMD_TICK       BIT3
+#define SAMPLER_CMD_INTERVAL   BIT4
+#define SAMPLER_CMD_READOUT    BIT5
+#define SAMPLER_CMD_CHANNELS   BIT6
+#define SAMPLER_CMD_BULBS      BIT7
+#define SAMPLER_CMD_CALIBRATE  BIT8
+#define SAMPLER_CMD_CLOCK      BIT9
+
+#define SAMPLER_MIN_INTERVAL_US 10000
+#define SAMPLER_MAX_INTERVAL_US 60000000
+
+// Log tick jitter and stream rate every this many frames
+#define JITTER_LOG_FRAMES 100
+
+#if CONFIG_AS7265X_SCAN_AMBIENT
+#define SCAN_AMBIENT true
+#else
+#define SCAN_AMBIENT false
+#endif
+
+#if CONFIG_OVERSAMPLE_MEDIAN
+#define OVERSAMPLE_METHOD OVERSAMPLE_MEDIAN
+#elif CONFIG_OVERSAMPLE_TRIMMED
+#define OVERSAMPLE_METHOD OVERSAMPLE_TRIMMED
+#else
+#define OVERSAMPLE_METHOD OVERSAMPLE_MEAN
+#endif
+
+// Raw readout: the scales go out again after this many raw frames, so the
+// consumer follows the sensor's temperature compensation
+#define SCALE_REFRESH_FRAMES 600
+
+// Give up on a frame if DATA_RDY takes this much longer than the frame time
+#define DATA_READY_SLACK_MS 200
+
+#if CONFIG_WS_TX_DROP_NEWEST
+#define RING_POLICY SPECTRUM_RING_DROP_NEWEST
+#elif CONFIG_WS_TX_CONFLATE
+#define RING_POLICY SPECTRUM_RING_CONFLATE
+#else
+#define RING_POLICY SPECTRUM_RING_DROP_OLDEST
+#endif
+
+static const char *TAG = "SAMPLER";
+
+static TaskHandle_t sampler_task_handle = NULL;
+static TaskHandle_t consumer_task = NULL;
+static spectrum_ring_t ring;
+static uint32_t next_seq = 0;
+
+// Status messages for the consumer. Sending them here would block the
+// sampler on the network. When every slot is taken the oldest goes.
+#define SAMPLER_STATUS_SLOTS 4
+
+static portMUX_TYPE status_lock = portMUX_INITIALIZER_UNLOCKED;
+static char status_msgs[SAMPLER_STATUS_SLOTS][SAMPLER_STATUS_MAX];
+static unsigned status_head = 0;
+static unsigned status_count = 0;
+
+// Timed streaming: a periodic esp_timer starts every integration, so samples
+// are evenly spaced instead of paced by the frame time. 0 = free-running.
+static volatile uint32_t interval_us = 0;
+static esp_timer_handle_t tick_timer = NULL;
+static volatile uint32_t tick_count = 0;     // written by the esp_timer task
+static uint32_t last_tick = 0;
+static uint32_t tick_interval_us = 0;        // interval the timer runs at
+static int64_t tick_base_us = 0;
+static histogram_t tick_jitter;              // us from ideal tick to integration start
+static uint32_t missed_ticks = 0;
+static uint32_t timed_frames = 0;
+
+// Sensor calibration as fixed-point scales, refreshed by every measurement
+static fixcal_t cal;
+// Scales of 1.0, for means in raw counts
+static fixcal_t unity;
+
+// On-demand measurements; the config is set from the websocket task
+static portMUX_TYPE oversample_lock = portMUX_INITIALIZER_UNLOCKED;
+static oversample_config_t oversample_cfg = {
+    .n = CONFIG_OVERSAMPLE_N,
+    .method = OVERSAMPLE_METHOD,
+    .trim_pct = CONFIG_OVERSAMPLE_TRIM_PCT,
+    .noise_target_bp = CONFIG_OVERSAMPLE_NOISE_TARGET_BP,
+};
+static oversample_t os;     // sampler task only
+static oversample_t os_dark;
+
+// Ambient correction of on-demand measurements, and the bulbs lit outside
+// of them; set from the websocket task
+static volatile bool ambient_scan = SCAN_AMBIENT;
+static volatile uint8_t scan_bulbs = CONFIG_AS7265X_SCAN_BULBS & AS7265X_ALL_BULBS;
+static volatile uint8_t manual_bulbs = 0;
+
+// Per-unit calibration and the references for the next one, sampler task
+// only. The reference to take is set from the websocket task.
+static unitcal_t unitcal;
+static volatile sampler_reference_t pending_reference = SAMPLER_REFERENCE_DARK;
+static uint32_t ref_q8[2][AS7265X_NUM_CHANNELS];   // dark, white
+static uint8_t ref_taken = 0;           // bit per reference
+static uint8_t ref_gain, ref_cycles;
+static bool unitcal_warned = false;
+
+// Raw readout: spectra carry ADC counts and the consumer calibrates them
+// with the scales published alongside
+static volatile bool raw_readout = false;
+static bool raw_active = false;         // sampler task: mode in effect
+static uint32_t raw_frames = 0;         // since the scales were last published
+
+// Channels to read; the plan is rebuilt by the sampler task when it changes
+static volatile uint32_t channel_mask = CONFIG_AS7265X_CHANNEL_MASK;
+static as7265x_read_plan_t plan;
+
+// I2C clock to switch to; applied by the sampler task, which owns the bus
+static volatile uint32_t bus_clock_hz = CONFIG_I2C_BUS_CLOCK_HZ;
+
+static uint32_t data_ready_timeout_ms(void)
+{
+    return as7265x_frame_time_us() / 1000 * 2 + DATA_READY_SLACK_MS;
+}
+
+static void publish(spectrum_t *s)
+{
+    s->seq = next_seq++;
+    s->wall_us = clocksync_wall_us(s->timestamp_us);
+    s->gain = as7265x_get_gain();
+    s->integration_cycles = as7265x_get_integration_cycles();
+    if (!spectrum_ring_push(&ring, s)) {
+        ESP_LOGW(TAG, "Ring full, dropped spectrum %lu", (unsigned long)s->seq);
+        return;
+    }
+    boot_mark(BOOT_FIRST_SAMPLE);
+    if (consumer_task) xTaskNotifyGive(consumer_task);
+}
+
+static void post_status(const char *fmt, ...)
+{
+    char msg[SAMPLER_STATUS_MAX];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+
+    portENTER_CRITICAL(&status_lock);
+    if (status_count == SAMPLER_STATUS_SLOTS) {
+        status_head = (status_head + 1) % SAMPLER_STATUS_SLOTS;
+        status_count--;
+    }
+    memcpy(status_msgs[(status_head + status_count) % SAMPLER_STATUS_SLOTS], msg, sizeof(msg));
+    status_count++;
+    portEXIT_CRITICAL(&status_lock);
+    if (consumer_task) xTaskNotifyGive(consumer_task);
+}
+
+// The scales as a calibration record ahead of the spectra they apply to. It
+// takes no sequence number, so the stream has no gap.
+static void publish_scales(void)
+{
+    spectrum_t s = {
+        .kind = SPECTRUM_KIND_CALIBRATION,
+        .timestamp_us = esp_timer_get_time(),
+        .seq = next_seq,
+        .gain = as7265x_get_gain(),
+        .integration_cycles = as7265x_get_integration_cycles(),
+        .channel_mask = AS7265X_ALL_CHANNELS,
+    };
+
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        s.ch[c] = cal.scale[c] * (1.0f / (1 << FIXCAL_SCALE_SHIFT));
+    }
+    if (spectrum_ring_push(&ring, &s) && consumer_task) xTaskNotifyGive(consumer_task);
+}
+
+// Reads the frame that just became ready in the current readout mode
+static esp_err_t read_frame(spectrum_t *s)
+{
+    uint16_t raw[AS7265X_NUM_CHANNELS];
+
+    s->channel_mask = plan.mask;
+    if (!raw_active) return as7265x_read_plan(&plan, s->ch);
+
+    esp_err_t ret = as7265x_read_raw_plan(&plan, raw);
+    if (ret == ESP_OK && raw_frames++ % SCALE_REFRESH_FRAMES == 0) {
+        float ch[AS7265X_NUM_CHANNELS];
+
+        // Same frame read calibrated; on failure the next frame tries again.
+        // Channels outside the plan keep their last scales.
+        if (as7265x_read_plan(&plan, ch) == ESP_OK) {
+            fixcal_learn(&cal, raw, ch);
+            publish_scales();
+        } else {
+            raw_frames = 0;
+        }
+    }
+    s->flags |= SPECTRUM_FLAG_RAW;
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        s->ch[c] = plan.mask & (1u << c) ? raw[c] : NAN;
+    }
+    return ret;
+}
+
+// Runs once before any command: the first integration after configuration
+// is thrown away, the next one is published as the boot spectrum. It goes
+// out with the stream, or into the offline log if the link is not up yet.
+static void warm_up(void)
+{
+    spectrum_t s = { .kind = SPECTRUM_KIND_STREAM };
+
+    if (as7265x_start_one_shot() != ESP_OK ||
+        as7265x_wait_data_ready(data_ready_timeout_ms()) != ESP_OK) {
+        ESP_LOGW(TAG, "Warm-up integration did not complete");
+        return;
+    }
+    boot_mark(BOOT_WARMUP);
+
+    if (as7265x_start_one_shot() != ESP_OK ||
+        as7265x_wait_data_ready(data_ready_timeout_ms()) != ESP_OK) {
+        return;
+    }
+    s.timestamp_us = esp_timer_get_time();
+    read_frame(&s);
+    publish(&s);
+}
+
+static void apply_bulbs(void)
+{
+    uint8_t on = manual_bulbs;
+
+    as7265x_set_bulbs(on, true);
+    as7265x_set_bulbs(~on & AS7265X_ALL_BULBS, false);
+}
+
+// Learns the scales from the same frame read calibrated, once per
+// measurement; they follow the sensor's temperature compensation
+static void learn_scales(const uint16_t raw[AS7265X_NUM_CHANNELS], bool *learned)
+{
+    float ch[AS7265X_NUM_CHANNELS];
+
+    if (*learned || as7265x_read_plan(&plan, ch) != ESP_OK) return;
+    fixcal_learn(&cal, raw, ch);
+    *learned = true;
+    if (raw_active) publish_scales();
+}
+
+// The only float conversion, as the spectrum leaves the sampler; value and
+// std also receive the Q24.8 counts
+// Counts to the units spectra are published in
+static const fixcal_t *active_scales(void)
+{
+    return raw_active ? &unity : &cal;
+}
+
+static void fill_stats(spectrum_t *s, oversample_t *o, const oversample_config_t *cfg,
+                       uint32_t value[AS7265X_NUM_CHANNELS], uint32_t std[AS7265X_NUM_CHANNELS])
+{
+    const fixcal_t *scales = active_scales();
+
+    oversample_result(o, cfg, value, std);
+    s->channel_mask = plan.mask;
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        if (!(plan.mask & (1u << c))) {
+            s->ch[c] = s->std[c] = NAN;
+            continue;
+        }
+        s->ch[c] = fixcal_to_float(fixcal_apply(scales, c, value[c]));
+        s->std[c] = fixcal_to_float(fixcal_apply(scales, c, std[c]));
+        s->n[c] = o->n[c];
+    }
+    s->flags |= SPECTRUM_FLAG_STATS;
+    if (raw_active) s->flags |= SPECTRUM_FLAG_RAW;
+}
+
+// With a per-unit calibration for the current settings the measurement
+// becomes reflectance against the white reference, with its colour. value
+// is taken above offset (NULL: the dark reference); std is in counts.
+static void to_reflectance(spectrum_t *s, const uint32_t value[AS7265X_NUM_CHANNELS],
+                           const uint32_t *offset, const uint32_t std[AS7265X_NUM_CHANNELS])
+{
+    static const uint32_t zero[AS7265X_NUM_CHANNELS];
+    int32_t refl[AS7265X_NUM_CHANNELS], refl_std[AS7265X_NUM_CHANNELS], xyz[3];
+
+    uint8_t gain = as7265x_get_gain();
+    uint8_t cycles = as7265x_get_integration_cycles();
+
+    if (!unitcal.valid) return;
+    if (!unitcal_matches(&unitcal, gain, cycles)) {
+        if (!unitcal_warned) {
+            ESP_LOGW(TAG, "Calibration was taken at gain %u, %u cycles; measurements stay uncorrected",
+                     unitcal.gain, unitcal.integration_cycles);
+            unitcal_warned = true;
+        }
+        return;
+    }
+
+    unitcal_reflectance(&unitcal, value, offset, refl);
+    unitcal_reflectance(&unitcal, std, zero, refl_std);
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        if (!(s->channel_mask & (1u << c))) continue;
+        bool usable = unitcal.gain_q[c] != 0;
+        s->ch[c] = usable ? refl[c] * (1.0f / (1 << UNITCAL_SHIFT)) : NAN;
+        s->std[c] = usable ? refl_std[c] * (1.0f / (1 << UNITCAL_SHIFT)) : NAN;
+    }
+    // Reflectance is final: nothing for the relay to calibrate
+    s->flags = (s->flags & ~SPECTRUM_FLAG_RAW) | SPECTRUM_FLAG_REFLECTANCE;
+
+    if (unitcal_xyz(&unitcal, refl, s->channel_mask, xyz)) {
+        for (int k = 0; k < 3; k++) s->xyz[k] = xyz[k] * (1.0f / (1 << UNITCAL_SHIFT));
+        unitcal_lab(&unitcal, xyz, s->lab);
+        s->flags |= SPECTRUM_FLAG_COLOR;
+    }
+}
+
+// On-demand measurement: up to the configured number of one-shot frames,
+// combined by the oversampler. Frames are read as raw counts and kept as
+// integers; the first good frame is also read calibrated to refresh the
+// scales. Frames that fail to read are discarded rather than counted as
+// zeros.
+static void take_single(void)
+{
+    spectrum_t s = { .kind = SPECTRUM_KIND_SINGLE };
+    oversample_config_t cfg;
+    bool learned = false;
+    int64_t start_us = esp_timer_get_time();
+
+    sampler_get_oversample(&cfg);
+    oversample_reset(&os);
+    for (int i = 0; i < cfg.n; i++) {
+        uint16_t raw[AS7265X_NUM_CHANNELS];
+        uint32_t txn;
+
+        // Each sample is a fresh one-shot integration, read as soon as it is ready
+        if (as7265x_start_one_shot() != ESP_OK ||
+            as7265x_wait_data_ready(data_ready_timeout_ms()) != ESP_OK) {
+            ESP_LOGE(TAG, "Measurement did not complete");
+            continue;
+        }
+        s.timestamp_us = esp_timer_get_time();
+
+        txn = as7265x_get_i2c_transactions();
+        if (as7265x_read_raw_plan(&plan, raw) != ESP_OK) {
+            ESP_LOGE(TAG, "Spectrum read incomplete, frame discarded");
+            continue;
+        }
+        ESP_LOGD(TAG, "Spectrum read took %lu I2C transactions",
+                 (unsigned long)(as7265x_get_i2c_transactions() - txn));
+
+        learn_scales(raw, &learned);
+        oversample_add(&os, raw);
+        if (oversample_converged(&os, &cfg)) break;
+    }
+
+    if (os.frames == 0) {
+        s.flags |= SPECTRUM_FLAG_FAILED;
+        publish(&s);
+        return;
+    }
+
+    histogram_t readout;
+    as7265x_get_readout_histogram(&readout);
+    ESP_LOGI(TAG, "%u frames in %lu ms, readout p50=%lu us p99=%lu us at %lu Hz I2C",
+             os.frames, (unsigned long)((esp_timer_get_time() - start_us) / 1000),
+             (unsigned long)histogram_percentile(&readout, 50),
+             (unsigned long)histogram_percentile(&readout, 99),
+             (unsigned long)i2c_bus_get_clock());
+
+    uint32_t value[AS7265X_NUM_CHANNELS], std[AS7265X_NUM_CHANNELS];
+    fill_stats(&s, &os, &cfg, value, std);
+    to_reflectance(&s, value, NULL, std);
+    publish(&s);
+}
+
+// Ambient-corrected measurement: the frame budget is split between bulb-on
+// and bulb-off frames, interleaved in continuous mode so each frame is read
+// while the next one integrates. The bulb-off spectrum goes out first as
+// SPECTRUM_KIND_AMBIENT, then the bulb-on spectrum minus it.
+static void take_ambient(void)
+{
+    spectrum_t lit = { .kind = SPECTRUM_KIND_SINGLE };
+    spectrum_t dark = { .kind = SPECTRUM_KIND_AMBIENT };
+    oversample_config_t cfg;
+    uint32_t switch_max_us = 0;
+    unsigned discarded = 0;
+    bool learned = false;
+    int64_t start_us = esp_timer_get_time();
+
+    sampler_get_oversample(&cfg);
+    int frames = cfg.n >= 2 ? cfg.n / 2 * 2 : 2;
+    oversample_reset(&os);
+    oversample_reset(&os_dark);
+
+    if (as7265x_interleave_start(scan_bulbs) != ESP_OK) frames = 0;
+    for (int i = 0; i < frames; i++) {
+        uint16_t raw[AS7265X_NUM_CHANNELS];
+        as7265x_frame_info_t info;
+        bool on;
+
+        if (as7265x_interleave_next(data_ready_timeout_ms(), i == frames - 1, &info, &on) != ESP_OK) {
+            ESP_LOGE(TAG, "Interleaved measurement stopped after %d frames", i);
+            break;
+        }
+        lit.timestamp_us = dark.timestamp_us = info.end_us;
+        if (info.switch_us > switch_max_us) switch_max_us = info.switch_us;
+
+        esp_err_t ret = as7265x_read_raw_plan(&plan, raw);
+        if (ret == ESP_OK && on) learn_scales(raw, &learned);
+        // A frame torn by the next one is mixed lit and dark
+        if (!as7265x_stream_frame_read(&info) || ret != ESP_OK) {
+            discarded++;
+            continue;
+        }
+        oversample_add(on ? &os : &os_dark, raw);
+    }
+    as7265x_interleave_stop();
+    apply_bulbs();
+
+    if (os.frames == 0 || os_dark.frames == 0) {
+        lit.flags |= SPECTRUM_FLAG_FAILED;
+        publish(&lit);
+        return;
+    }
+
+    uint32_t frame_us = as7265x_frame_time_us();
+    uint32_t share_bp = frame_us ? (uint32_t)((uint64_t)switch_max_us * 10000 / frame_us) : 0;
+    ESP_LOGI(TAG, "Ambient-corrected: %u lit + %u dark frames (%u discarded) in %lu ms, "
+             "bulbs switched within %lu us (%lu.%02lu%% of a frame)",
+             os.frames, os_dark.frames, discarded,
+             (unsigned long)((esp_timer_get_time() - start_us) / 1000), (unsigned long)switch_max_us,
+             (unsigned long)(share_bp / 100), (unsigned long)(share_bp % 100));
+
+    uint32_t lit_value[AS7265X_NUM_CHANNELS], lit_std[AS7265X_NUM_CHANNELS];
+    uint32_t dark_value[AS7265X_NUM_CHANNELS], dark_std[AS7265X_NUM_CHANNELS];
+    fill_stats(&dark, &os_dark, &cfg, dark_value, dark_std);
+    fill_stats(&lit, &os, &cfg, lit_value, lit_std);
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        if (!(plan.mask & (1u << c))) continue;
+        // Independent frames: the variances add, in Q24.8 counts
+        lit.ch[c] -= dark.ch[c];
+        lit_std[c] = oversample_isqrt64((uint64_t)lit_std[c] * lit_std[c] + (uint64_t)dark_std[c] * dark_std[c]);
+        lit.std[c] = fixcal_to_float(fixcal_apply(active_scales(), c, lit_std[c]));
+        if (dark.n[c] < lit.n[c]) lit.n[c] = dark.n[c];
+    }
+    lit.flags |= SPECTRUM_FLAG_CORRECTED;
+    // The ambient frames stand in for the dark reference
+    to_reflectance(&lit, lit_value, dark_value, lit_std);
+
+    publish(&dark);
+    publish(&lit);
+}
+
+// Calibration reference: the mean of the configured number of one-shot
+// frames over every channel, bulbs off for dark and the scan bulbs lit for
+// white. Once both were taken at the same settings they become the unit's
+// calibration.
+static void take_reference(sampler_reference_t ref)
+{
+    oversample_config_t cfg;
+    as7265x_read_plan_t all;
+    uint32_t std[AS7265X_NUM_CHANNELS];
+    char msg[SAMPLER_STATUS_MAX];
+
+    if (ref == SAMPLER_REFERENCE_CLEAR) {
+        ref_taken = 0;
+        unitcal.valid = false;
+        post_status(unitcal_erase() == ESP_OK ? "Calibration cleared" : "Calibration could not be erased");
+        return;
+    }
+
+    sampler_get_oversample(&cfg);
+    cfg.method = OVERSAMPLE_MEAN;
+    as7265x_plan_init(&all, AS7265X_ALL_CHANNELS);
+    as7265x_set_bulbs(AS7265X_ALL_BULBS, false);
+    if (ref == SAMPLER_REFERENCE_WHITE) as7265x_set_bulbs(scan_bulbs, true);
+
+    oversample_reset(&os);
+    for (int i = 0; i < cfg.n; i++) {
+        uint16_t raw[AS7265X_NUM_CHANNELS];
+
+        if (as7265x_start_one_shot() != ESP_OK ||
+            as7265x_wait_data_ready(data_ready_timeout_ms()) != ESP_OK ||
+            as7265x_read_raw_plan(&all, raw) != ESP_OK) {
+            continue;
+        }
+        oversample_add(&os, raw);
+    }
+    apply_bulbs();
+
+    if (os.frames == 0) {
+        post_status("Calibration reference failed");
+        return;
+    }
+    oversample_result(&os, &cfg, ref_q8[ref], std);
+
+    // References taken at other settings are stale
+    uint8_t gain = as7265x_get_gain();
+    uint8_t cycles = as7265x_get_integration_cycles();
+    if (gain != ref_gain || cycles != ref_cycles) ref_taken = 0;
+    ref_gain = gain;
+    ref_cycles = cycles;
+    ref_taken |= 1u << ref;
+
+    if (ref_taken != 0x3) {
+        post_status("%s reference taken from %u frames, now take the %s one",
+                    ref == SAMPLER_REFERENCE_WHITE ? "White" : "Dark", os.frames,
+                    ref == SAMPLER_REFERENCE_WHITE ? "dark" : "white");
+        return;
+    }
+
+    unitcal_record_t rec;
+    int unusable = unitcal_make_record(&rec, ref_q8[SAMPLER_REFERENCE_DARK], ref_q8[SAMPLER_REFERENCE_WHITE],
+                                       gain, cycles);
+    esp_err_t err = unitcal_save(&rec);
+    unitcal_init(&unitcal, &rec);
+    unitcal_warned = false;
+    ref_taken = 0;
+    snprintf(msg, sizeof(msg), "Calibration %s at gain %u, %u cycles, %d unusable channels",
+             err == ESP_OK ? "saved" : "applied but not saved", gain, cycles, unusable);
+    ESP_LOGI(TAG, "%s", msg);
+    post_status("%s", msg);
+}
+
+// One frame of the continuous stream. Continuous mode integrates the next
+// frame on its own; we only wake up when DATA_RDY says a new one is there.
+static bool take_stream_frame(void)
+{
+    spectrum_t s = { .kind = SPECTRUM_KIND_STREAM };
+    as7265x_frame_info_t info;
+
+    if (as7265x_stream_wait(data_ready_timeout_ms(), &info) != ESP_OK) {
+        ESP_LOGW(TAG, "No data ready in continuous mode");
+        return false;
+    }
+    // The sensor is already integrating the next frame while this one is read
+    s.timestamp_us = info.end_us;
+    if (info.skipped > 0) {
+        ESP_LOGD(TAG, "%lu frames finished during the last read", (unsigned long)info.skipped);
+    }
+
+    read_frame(&s); // failed channels come back as 0
+    as7265x_stream_frame_read(&info);
+    publish(&s);
+
+    if ((info.index + 1) % JITTER_LOG_FRAMES == 0) {
+        as7265x_stream_stats_t st;
+        as7265x_stream_get_stats(&st);
+        ESP_LOGI(TAG, "Stream %lu.%03lu fps of %lu.%03lu, %lu skipped, %lu overruns",
+                 (unsigned long)(st.fps_milli / 1000), (unsigned long)(st.fps_milli % 1000),
+                 (unsigned long)(st.max_fps_milli / 1000), (unsigned long)(st.max_fps_milli % 1000),
+                 (unsigned long)st.skipped, (unsigned long)st.overruns);
+    }
+    return true;
+}
+
+static void tick_cb(void *arg)
+{
+    tick_count++;
+    xTaskNotify(sampler_task_handle, SAMPLER_CMD_TICK, eSetBits);
+}
+
+static bool start_ticks(void)
+{
+    uint32_t frame_us = as7265x_frame_time_us();
+
+    tick_interval_us = interval_us;
+    if (tick_interval_us <= frame_us) {
+        ESP_LOGW(TAG, "Interval %lu us is shorter than the %lu us frame; ticks will be missed",
+                 (unsigned long)tick_interval_us, (unsigned long)frame_us);
+    }
+
+    tick_count = 0;
+    last_tick = 0;
+    missed_ticks = 0;
+    timed_frames = 0;
+    histogram_reset(&tick_jitter);
+    tick_base_us = esp_timer_get_time();
+
+    if (esp_timer_start_periodic(tick_timer, tick_interval_us) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start the sample timer");
+        return false;
+    }
+    ESP_LOGI(TAG, "Timed streaming every %lu us", (unsigned long)tick_interval_us);
+    return true;
+}
+
+// One frame of the timed stream: a one-shot integration started on the tick
+static void take_timed_frame(void)
+{
+    spectrum_t s = { .kind = SPECTRUM_KIND_STREAM };
+    uint32_t n = tick_count;
+    int64_t ideal_us = tick_base_us + (int64_t)n * tick_interval_us;
+    int64_t late_us = esp_timer_get_time() - ideal_us;
+
+    // Ticks that came in while the previous frame was still being read
+    if (n - last_tick > 1) missed_ticks += n - last_tick - 1;
+    last_tick = n;
+    histogram_record(&tick_jitter, late_us > 0 ? (uint32_t)late_us : 0);
+
+    if (as7265x_start_one_shot() != ESP_OK ||
+        as7265x_wait_data_ready(data_ready_timeout_ms()) != ESP_OK) {
+        ESP_LOGW(TAG, "Timed measurement did not complete");
+        return;
+    }
+    s.timestamp_us = esp_timer_get_time();
+
+    read_frame(&s);
+    publish(&s);
+
+    if (++timed_frames % JITTER_LOG_FRAMES == 0) {
+        ESP_LOGI(TAG, "Tick jitter p50=%lu us p99=%lu us max=%lu us, %lu ticks missed",
+                 (unsigned long)histogram_percentile(&tick_jitter, 50),
+                 (unsigned long)histogram_percentile(&tick_jitter, 99),
+                 (unsigned long)tick_jitter.max, (unsigned long)missed_ticks);
+    }
+}
+
+static void sampler_task(void *pvParameters)
+{
+    bool streaming = false;
+    bool sensor_streaming = false;
+    bool timed = false;
+
+    warm_up();
+
+    while (1) {
+        uint32_t cmd = 0;
+        bool free_running = streaming && !timed;
+
+        // While free-running the data-ready wait paces the loop, so only peek
+        xTaskNotifyWait(0, UINT32_MAX, &cmd, free_running ? 0 : portMAX_DELAY);
+
+        if (cmd & SAMPLER_CMD_READOUT) {
+            raw_active = raw_readout;
+            raw_frames = 0;
+        }
+        if (cmd & SAMPLER_CMD_CHANNELS) {
+            as7265x_plan_init(&plan, channel_mask);
+            raw_frames = 0;     // fresh scales for channels that were not read
+            ESP_LOGI(TAG, "Reading channels 0x%05lx from %u devices",
+                     (unsigned long)plan.mask, plan.num_devices);
+        }
+        if (cmd & SAMPLER_CMD_BULBS) apply_bulbs();
+        if (cmd & SAMPLER_CMD_CLOCK) {
+            uint32_t old_hz = i2c_bus_get_clock();
+
+            if (i2c_bus_set_clock(bus_clock_hz) == ESP_OK) {
+                ESP_LOGI(TAG, "I2C clock %lu -> %lu Hz", (unsigned long)old_hz, (unsigned long)bus_clock_hz);
+            }
+        }
+        if ((cmd & SAMPLER_CMD_CALIBRATE) && streaming) {
+            post_status("Stop the stream before taking a calibration reference");
+            cmd &= ~SAMPLER_CMD_CALIBRATE;
+        }
+        if (cmd & SAMPLER_CMD_STREAM_ON) streaming = true;
+        if (cmd & SAMPLER_CMD_STREAM_OFF) streaming = false;
+
+        if (cmd & (SAMPLER_CMD_STREAM_ON | SAMPLER_CMD_STREAM_OFF | SAMPLER_CMD_INTERVAL)) {
+            if (timed) {
+                esp_timer_stop(tick_timer);
+                timed = false;
+            }
+            if (streaming && interval_us > 0) timed = start_ticks();
+        }
+
+        if (!streaming || timed) {
+            if (sensor_streaming) {
+                as7265x_stream_stop();
+                sensor_streaming = false;
+            }
+            if (cmd & SAMPLER_CMD_CALIBRATE) take_reference(pending_reference);
+            if (timed) {
+                if (cmd & SAMPLER_CMD_TICK) take_timed_frame();
+            } else if (cmd & SAMPLER_CMD_READ) {
+                if (ambient_scan) take_ambient();
+                else take_single();
+            }
+            continue;
+        }
+
+        if (!sensor_streaming) {
+            sensor_streaming = as7265x_stream_start() == ESP_OK;
+            if (!sensor_streaming) {
+                vTaskDelay(pdMS_TO_TICKS(500));
+                continue;
+            }
+        }
+        if (!take_stream_frame()) sensor_streaming = false;
+    }
+}
+
+void sampler_start(void)
+{
+    if (sampler_task_handle) return;
+
+#if CONFIG_FIXCAL_BENCHMARK
+    fixcal_benchmark();
+#endif
+
+    spectrum_ring_init(&ring, RING_POLICY);
+    as7265x_plan_init(&plan, channel_mask);
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        unity.scale[c] = 1u << FIXCAL_SCALE_SHIFT;
+    }
+    if (unitcal_load(&unitcal) == ESP_OK) {
+        ESP_LOGI(TAG, "Unit calibration loaded, gain %u, %u cycles", unitcal.gain, unitcal.integration_cycles);
+    }
+
+    const esp_timer_create_args_t tick_args = {
+        .callback = tick_cb,
+        .name = "sample_tick",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&tick_args, &tick_timer));
+
+    // Above the websocket tasks so frames are read as soon as they are ready
+    xTaskCreate(sampler_task, "sampler", 4096, NULL, 6, &sampler_task_handle);
+}
+
+void sampler_request_read(void)
+{
+    if (sampler_task_handle) xTaskNotify(sampler_task_handle, SAMPLER_CMD_READ, eSetBits);
+}
+
+void sampler_set_streaming(bool on)
+{
+    if (sampler_task_handle) {
+        xTaskNotify(sampler_task_handle, on ? SAMPLER_CMD_STREAM_ON : SAMPLER_CMD_STREAM_OFF, eSetBits);
+    }
+}
+
+uint32_t sampler_set_interval_us(uint32_t us)
+{
+    if (us != 0) {
+        if (us < SAMPLER_MIN_INTERVAL_US) us = SAMPLER_MIN_INTERVAL_US;
+        if (us > SAMPLER_MAX_INTERVAL_US) us = SAMPLER_MAX_INTERVAL_US;
+    }
+    interval_us = us;
+    if (sampler_task_handle) xTaskNotify(sampler_task_handle, SAMPLER_CMD_INTERVAL, eSetBits);
+    return us;
+}
+
+uint32_t sampler_set_bus_clock(uint32_t hz)
+{
+    if (hz < I2C_BUS_MIN_CLOCK_HZ) hz = I2C_BUS_MIN_CLOCK_HZ;
+    if (hz > I2C_BUS_MAX_CLOCK_HZ) hz = I2C_BUS_MAX_CLOCK_HZ;
+    bus_clock_hz = hz;
+    if (sampler_task_handle) xTaskNotify(sampler_task_handle, SAMPLER_CMD_CLOCK, eSetBits);
+    return hz;
+}
+
+void sampler_set_raw_readout(bool on)
+{
+    if (on == raw_readout) return;
+
+    raw_readout = on;
+    if (sampler_task_handle) xTaskNotify(sampler_task_handle, SAMPLER_CMD_READOUT, eSetBits);
+}
+
+void sampler_set_oversample(const oversample_config_t *cfg)
+{
+    oversample_config_t c = *cfg;
+
+    oversample_config_clamp(&c);
+    portENTER_CRITICAL(&oversample_lock);
+    oversample_cfg = c;
+    portEXIT_CRITICAL(&oversample_lock);
+}
+
+void sampler_get_oversample(oversample_config_t *out)
+{
+    portENTER_CRITICAL(&oversample_lock);
+    *out = oversample_cfg;
+    portEXIT_CRITICAL(&oversample_lock);
+}
+
+bool sampler_raw_readout(void)
+{
+    return raw_readout;
+}
+
+void sampler_set_bulbs(uint8_t bulbs)
+{
+    manual_bulbs = bulbs & AS7265X_ALL_BULBS;
+    if (sampler_task_handle) xTaskNotify(sampler_task_handle, SAMPLER_CMD_BULBS, eSetBits);
+}
+
+uint8_t sampler_bulbs(void)
+{
+    return manual_bulbs;
+}
+
+void sampler_set_ambient_scan(bool on, uint8_t bulbs)
+{
+    bulbs &= AS7265X_ALL_BULBS;
+    if (bulbs) scan_bulbs = bulbs;
+    ambient_scan = on;
+}
+
+bool sampler_ambient_scan(uint8_t *bulbs)
+{
+    if (bulbs) *bulbs = scan_bulbs;
+    return ambient_scan;
+}
+
+void sampler_calibrate(sampler_reference_t ref)
+{
+    pending_reference = ref;
+    if (sampler_task_handle) xTaskNotify(sampler_task_handle, SAMPLER_CMD_CALIBRATE, eSetBits);
+}
+
+bool sampler_calibrated(void)
+{
+    return unitcal.valid;
+}
+
+uint32_t sampler_set_channel_mask(uint32_t mask)
+{
+    mask &= AS7265X_ALL_CHANNELS;
+    channel_mask = mask ? mask : AS7265X_ALL_CHANNELS;
+    if (sampler_task_handle) xTaskNotify(sampler_task_handle, SAMPLER_CMD_CHANNELS, eSetBits);
+    return channel_mask;
+}
+
+uint32_t sampler_channel_mask(void)
+{
+    return channel_mask;
+}
+
+uint32_t sampler_get_interval_us(void)
+{
+    return interval_us;
+}
+
+void sampler_get_jitter_histogram(histogram_t *out)
+{
+    *out = tick_jitter;
+}
+
+uint32_t sampler_missed_ticks(void)
+{
+    return missed_ticks;
+}
+
+void sampler_set_consumer(TaskHandle_t task)
+{
+    consumer_task = task;
+}
+
+bool sampler_pop(spectrum_t *out)
+{
+    return spectrum_ring_pop(&ring, out);
+}
+
+bool sampler_pop_status(char out[SAMPLER_STATUS_MAX])
+{
+    bool ok = false;
+
+    portENTER_CRITICAL(&status_lock);
+    if (status_count > 0) {
+        memcpy(out, status_msgs[status_head], SAMPLER_STATUS_MAX);
+        status_head = (status_head + 1) % SAMPLER_STATUS_SLOTS;
+        status_count--;
+        ok = true;
+    }
+    portEXIT_CRITICAL(&status_lock);
+    return ok;
+}
+
+unsigned sampler_dropped(void)
+{
+    return atomic_load(&ring.dropped);
+}
+
+unsigned sampler_queue_depth(void)
+{
+    return spectrum_ring_count(&ring);
+}
+
+unsigned sampler_queue_max_depth(void)
+{
+    return atomic_load(&ring.max_depth);
+}
+
+void sampler_set_drop_policy(spectrum_ring_policy_t policy)
+{
+    ring.policy = policy;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "spectrum.h"
+#include "histogram.h"
+#include "spectrum_ring.h"
+#include "oversample.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdbool.h>
+
+// The sampler task is the only user of the I2C bus once started. Commands
+// only set notification bits, so they are safe to call from any task.
+void sampler_start(void);
+void sampler_request_read(void);
+void sampler_set_streaming(bool on);
+
+// Streaming period. 0 streams as fast as the sensor produces frames; any
+// other value is clamped to 10 ms..60 s and starts a one-shot integration on
+// every tick of a periodic esp_timer. Returns the interval actually used.
+uint32_t sampler_set_interval_us(uint32_t us);
+uint32_t sampler_get_interval_us(void);
+// I2C bus clock, clamped to 10 kHz..1 MHz and applied by the sampler task
+// between frames. Readout times per spectrum are in the telemetry, next to
+// the clock they were taken at. Returns the clock that will be used.
+uint32_t sampler_set_bus_clock(uint32_t hz);
+// How read_sensor combines frames; applies from the next measurement.
+// Out-of-range fields are clamped.
+void sampler_set_oversample(const oversample_config_t *cfg);
+void sampler_get_oversample(oversample_config_t *out);
+// Raw readout: spectra carry ADC counts (SPECTRUM_FLAG_RAW), with half the
+// I2C reads of calibrated values. The sensor's scales are published as a
+// SPECTRUM_KIND_CALIBRATION record before the first raw spectrum, with
+// every on-demand measurement and every few hundred stream frames.
+void sampler_set_raw_readout(bool on);
+bool sampler_raw_readout(void);
+// Channels to read, bit n = channel n; 0 selects all. Devices without a
+// selected channel are skipped. Applies from the next frame; returns the
+// mask that will be used.
+uint32_t sampler_set_channel_mask(uint32_t mask);
+// Bulbs lit outside of ambient-corrected measurements, bit n = device n
+void sampler_set_bulbs(uint8_t bulbs);
+uint8_t sampler_bulbs(void);
+// Ambient-corrected read_sensor: bulb-on and bulb-off frames with the given
+// bulbs (0 keeps the current ones), see take_ambient() in sampler.c. A
+// SPECTRUM_KIND_AMBIENT spectrum with the bulb-off values precedes the
+// corrected one, which has SPECTRUM_FLAG_CORRECTED.
+void sampler_set_ambient_scan(bool on, uint8_t bulbs);
+bool sampler_ambient_scan(uint8_t *bulbs);
+uint32_t sampler_channel_mask(void);
+// Per-unit calibration (unitcal.h). A dark and a white reference taken at
+// the same settings are stored in NVS; from then on on-demand measurements
+// at those settings are reflectance (SPECTRUM_FLAG_REFLECTANCE) with their
+// colour (SPECTRUM_FLAG_COLOR). Progress goes to the consumer as status
+// messages.
+typedef enum {
+    SAMPLER_REFERENCE_DARK = 0,     // sensor covered
+    SAMPLER_REFERENCE_WHITE = 1,    // white standard, lit by the scan bulbs
+    SAMPLER_REFERENCE_CLEAR = 2,    // erase the stored calibration
+} sampler_reference_t;
+void sampler_calibrate(sampler_reference_t ref);
+bool sampler_calibrated(void);
+// How late each timed integration started relative to its ideal tick, in us
+void sampler_get_jitter_histogram(histogram_t *out);
+uint32_t sampler_missed_ticks(void);
+
+// Consumer side: the given task is notified (xTaskNotifyGive) whenever a
+// spectrum or a status message is queued, and drains them with
+// sampler_pop() and sampler_pop_status()
+void sampler_set_consumer(TaskHandle_t task);
+bool sampler_pop(spectrum_t *out);
+// Longest status message, NUL included
+#define SAMPLER_STATUS_MAX 96
+bool sampler_pop_status(char out[SAMPLER_STATUS_MAX]);
+
+// The ring between sampler and consumer is the outbound queue: when the
+// network falls behind, the policy decides which spectra are dropped
+// (CONFIG_WS_TX_DROP_POLICY by default)
+void sampler_set_drop_policy(spectrum_ring_policy_t policy);
+unsigned sampler_dropped(void);
+unsigned sampler_queue_depth(void);
+unsigned sampler_queue_max_depth(void);
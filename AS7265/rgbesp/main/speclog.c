@@ -0,0 +1,297 @@
+#include "speclog.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_log.h"
+#include <string.h>
+
+#define SPECLOG_LABEL "speclog"
+#define SPECLOG_MAGIC 0x474C5053    // "SPLG"
+
+#define SECTOR_SIZE 4096
+#define SECTOR_HEADER_SIZE 16
+#define ERASED_WORD 0xFFFFFFFFu
+
+// Give up on a peek after this many unreadable slots in a row
+#define PEEK_MAX_WALK (SPECLOG_PEEK_MAX * 2)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;           // one more than the sector written before it
+    uint32_t record_size;   // sectors from a firmware with another layout are ignored
+    uint32_t reserved;
+} sector_header_t;
+
+// Slots are programmed once after the sector erase; sent is then cleared
+// in place, which NOR flash allows without another erase
+typedef struct {
+    uint32_t crc;           // of s; ERASED_WORD means the slot is free
+    uint32_t sent;          // ERASED_WORD until replayed, then 0
+    spectrum_t s;
+} record_t;
+
+#define SLOTS_PER_SECTOR ((SECTOR_SIZE - SECTOR_HEADER_SIZE) / sizeof(record_t))
+
+static const char *TAG = "SPECLOG";
+
+static const esp_partition_t *part = NULL;
+static uint32_t num_sectors = 0;
+
+static uint32_t head_sector;    // sector being written
+static uint32_t head_seq;
+static uint32_t head_slot;      // next free slot, SLOTS_PER_SECTOR when full
+static uint32_t tail_sector;    // oldest unsent record
+static uint32_t tail_slot;
+static uint32_t pending = 0;    // slots from tail to head
+static uint32_t dropped = 0;
+
+static uint32_t peek_count = 0;
+static uint32_t peek_walk = 0;
+static uint8_t peek_slots[SPECLOG_PEEK_MAX];   // slots walked through record i
+
+static size_t slot_offset(uint32_t sector, uint32_t slot)
+{
+    return sector * SECTOR_SIZE + SECTOR_HEADER_SIZE + slot * sizeof(record_t);
+}
+
+static uint32_t next_sector(uint32_t sector)
+{
+    return (sector + 1) % num_sectors;
+}
+
+static uint32_t record_crc(const spectrum_t *s)
+{
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)s, sizeof(*s));
+    // Keep the erased pattern meaning "free"
+    return crc == ERASED_WORD ? 0 : crc;
+}
+
+static bool read_header(uint32_t sector, sector_header_t *h)
+{
+    return esp_partition_read(part, sector * SECTOR_SIZE, h, sizeof(*h)) == ESP_OK &&
+           h->magic == SPECLOG_MAGIC && h->record_size == sizeof(record_t);
+}
+
+// First two words of a slot: crc and sent
+static void read_slot_words(uint32_t sector, uint32_t slot, uint32_t words[2])
+{
+    if (esp_partition_read(part, slot_offset(sector, slot), words, 2 * sizeof(uint32_t)) != ESP_OK) {
+        words[0] = words[1] = 0;
+    }
+}
+
+static uint32_t first_free_slot(uint32_t sector)
+{
+    uint32_t words[2];
+
+    for (uint32_t slot = 0; slot < SLOTS_PER_SECTOR; slot++) {
+        read_slot_words(sector, slot, words);
+        if (words[0] == ERASED_WORD) return slot;
+    }
+    return SLOTS_PER_SECTOR;
+}
+
+esp_err_t speclog_init(void)
+{
+    sector_header_t h;
+    bool found = false;
+
+    part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, SPECLOG_LABEL);
+    if (!part) {
+        ESP_LOGW(TAG, "No %s partition; spectra taken offline will be dropped", SPECLOG_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+    num_sectors = part->size / SECTOR_SIZE;
+    if (num_sectors < 2) {
+        part = NULL;
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // The newest sector has the highest sequence number
+    for (uint32_t i = 0; i < num_sectors; i++) {
+        if (read_header(i, &h) && (!found || (int32_t)(h.seq - head_seq) > 0)) {
+            head_sector = i;
+            head_seq = h.seq;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        // Empty log: the first append starts sector 0
+        head_sector = num_sectors - 1;
+        head_seq = 0;
+        head_slot = SLOTS_PER_SECTOR;
+        tail_sector = head_sector;
+        tail_slot = head_slot;
+        pending = 0;
+        ESP_LOGI(TAG, "Empty log, %lu sectors of %u spectra",
+                 (unsigned long)num_sectors, (unsigned)SLOTS_PER_SECTOR);
+        return ESP_OK;
+    }
+    head_slot = first_free_slot(head_sector);
+
+    // Older sectors precede it physically with consecutive sequence numbers
+    uint32_t oldest = head_sector;
+    for (uint32_t k = 1; k < num_sectors; k++) {
+        uint32_t i = (head_sector + num_sectors - k) % num_sectors;
+        if (!read_header(i, &h) || h.seq != head_seq - k) break;
+        oldest = i;
+    }
+
+    // Records are sent oldest first, so replay resumes at the first unsent
+    // one. A full sector whose last record was sent is skipped whole.
+    tail_sector = head_sector;
+    tail_slot = head_slot;
+    for (uint32_t i = oldest; ; i = next_sector(i)) {
+        uint32_t used = i == head_sector ? head_slot : SLOTS_PER_SECTOR;
+        uint32_t words[2];
+
+        if (used > 0) {
+            read_slot_words(i, used - 1, words);
+            if (words[1] == ERASED_WORD) {
+                uint32_t slot = 0;
+                for (; slot < used; slot++) {
+                    read_slot_words(i, slot, words);
+                    if (words[1] == ERASED_WORD) break;
+                }
+                tail_sector = i;
+                tail_slot = slot;
+                break;
+            }
+        }
+        if (i == head_sector) break;
+    }
+
+    pending = ((head_sector + num_sectors - tail_sector) % num_sectors) * SLOTS_PER_SECTOR +
+              head_slot - tail_slot;
+    ESP_LOGI(TAG, "%lu spectra waiting for replay", (unsigned long)pending);
+    return ESP_OK;
+}
+
+static esp_err_t start_sector(void)
+{
+    uint32_t next = next_sector(head_sector);
+    sector_header_t h = {
+        .magic = SPECLOG_MAGIC,
+        .seq = head_seq + 1,
+        .record_size = sizeof(record_t),
+        .reserved = ERASED_WORD,
+    };
+    esp_err_t err;
+
+    // Ring full: the oldest sector is reused and its unsent records are lost
+    if (pending > 0 && next == tail_sector) {
+        uint32_t lost = SLOTS_PER_SECTOR - tail_slot;
+        dropped += lost;
+        pending -= lost;
+        tail_sector = next_sector(tail_sector);
+        tail_slot = 0;
+        ESP_LOGW(TAG, "Log full, dropped %lu spectra", (unsigned long)lost);
+    }
+
+    err = esp_partition_erase_range(part, next * SECTOR_SIZE, SECTOR_SIZE);
+    if (err == ESP_OK) err = esp_partition_write(part, next * SECTOR_SIZE, &h, sizeof(h));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start sector %lu: %s", (unsigned long)next, esp_err_to_name(err));
+        return err;
+    }
+
+    head_sector = next;
+    head_seq = h.seq;
+    head_slot = 0;
+    return ESP_OK;
+}
+
+esp_err_t speclog_append(const spectrum_t *s)
+{
+    record_t rec;
+    esp_err_t err;
+
+    if (!part) return ESP_ERR_INVALID_STATE;
+
+    if (head_slot >= SLOTS_PER_SECTOR) {
+        err = start_sector();
+        if (err != ESP_OK) return err;
+    }
+
+    rec.crc = record_crc(s);
+    rec.sent = ERASED_WORD;
+    rec.s = *s;
+    err = esp_partition_write(part, slot_offset(head_sector, head_slot), &rec, sizeof(rec));
+
+    // The slot is used even if the write failed; replay skips it by its CRC
+    if (pending == 0) {
+        tail_sector = head_sector;
+        tail_slot = head_slot;
+    }
+    head_slot++;
+    pending++;
+    return err;
+}
+
+size_t speclog_peek(spectrum_t *out, size_t max)
+{
+    uint32_t sector = tail_sector, slot = tail_slot;
+    record_t rec;
+    size_t n = 0;
+
+    peek_count = 0;
+    peek_walk = 0;
+    if (!part) return 0;
+    if (max > SPECLOG_PEEK_MAX) max = SPECLOG_PEEK_MAX;
+
+    while (n < max && peek_walk < pending && peek_walk < PEEK_MAX_WALK) {
+        if (slot >= SLOTS_PER_SECTOR) {
+            sector = next_sector(sector);
+            slot = 0;
+        }
+        esp_err_t err = esp_partition_read(part, slot_offset(sector, slot), &rec, sizeof(rec));
+        slot++;
+        peek_walk++;
+
+        if (err != ESP_OK || rec.crc != record_crc(&rec.s)) continue;
+        out[n] = rec.s;
+        peek_slots[n++] = peek_walk;
+    }
+    peek_count = n;
+
+    // Nothing readable in reach: step over the damaged slots
+    if (n == 0 && peek_walk > 0) speclog_consume(0);
+    return n;
+}
+
+esp_err_t speclog_consume(size_t n)
+{
+    // Consuming everything peeked also steps over trailing damaged slots
+    uint32_t slots = n == 0 ? (peek_count == 0 ? peek_walk : 0) :
+                     n >= peek_count ? peek_walk : peek_slots[n - 1];
+    static const uint32_t zero = 0;
+    esp_err_t err = ESP_OK;
+
+    if (!part) return ESP_ERR_INVALID_STATE;
+
+    for (uint32_t i = 0; i < slots && pending > 0; i++) {
+        if (tail_slot >= SLOTS_PER_SECTOR) {
+            tail_sector = next_sector(tail_sector);
+            tail_slot = 0;
+        }
+        esp_err_t e = esp_partition_write(part, slot_offset(tail_sector, tail_slot) + sizeof(uint32_t),
+                                          &zero, sizeof(zero));
+        if (e != ESP_OK) err = e;
+        tail_slot++;
+        pending--;
+    }
+
+    peek_count = 0;
+    peek_walk = 0;
+    return err;
+}
+
+uint32_t speclog_pending(void)
+{
+    return pending;
+}
+
+uint32_t speclog_dropped(void)
+{
+    return dropped;
+}
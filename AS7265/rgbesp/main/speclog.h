@@ -0,0 +1,33 @@
+#pragma once
+
+#include "spectrum.h"
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Store-and-forward log of spectra taken while the websocket is down, kept
+// in the raw "speclog" data partition. Records are appended to a ring of
+// flash sectors and marked sent in place once replayed, so they survive a
+// reboot. When the ring is full the oldest sector is erased and its unsent
+// records are counted as dropped.
+//
+// Not thread-safe: only the websocket sender task uses it after init. The
+// two counters are plain word reads and may be polled from anywhere.
+
+#define SPECLOG_PEEK_MAX 32
+
+// Finds the partition and recovers the write and replay positions.
+// Returns ESP_ERR_NOT_FOUND without a speclog partition; the other
+// functions then do nothing.
+esp_err_t speclog_init(void);
+
+esp_err_t speclog_append(const spectrum_t *s);
+
+// Copies up to max (at most SPECLOG_PEEK_MAX) of the oldest unsent spectra
+// into out without consuming them. Records that fail their CRC are skipped.
+size_t speclog_peek(spectrum_t *out, size_t max);
+// Marks the first n spectra returned by the last speclog_peek() as sent
+esp_err_t speclog_consume(size_t n);
+
+uint32_t speclog_pending(void);
+uint32_t speclog_dropped(void);
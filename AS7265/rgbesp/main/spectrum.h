@@ -0,0 +1,38 @@
+#pragma once
+
+#include "as7265x.h"
+#include <stdint.h>
+
+// What produced a spectrum
+typedef enum {
+    SPECTRUM_KIND_SINGLE = 0,   // averaged on-demand measurement (read_sensor)
+    SPECTRUM_KIND_STREAM = 1,   // one frame of the debug stream
+    SPECTRUM_KIND_CALIBRATION = 2,  // ch holds calibrated units per raw count
+    SPECTRUM_KIND_AMBIENT = 3,  // bulb-off frames of an ambient-corrected measurement
+} spectrum_kind_t;
+
+#define SPECTRUM_FLAG_FAILED 0x01   // no valid data, channels are zero
+#define SPECTRUM_FLAG_RAW 0x02      // channels are raw ADC counts
+#define SPECTRUM_FLAG_STATS 0x04    // n and std are filled in
+#define SPECTRUM_FLAG_CORRECTED 0x08    // ambient subtracted; that spectrum was published just before
+#define SPECTRUM_FLAG_REFLECTANCE 0x10  // ch and std are reflectance against the unit's white reference
+#define SPECTRUM_FLAG_COLOR 0x20    // xyz and lab are filled in
+
+typedef struct {
+    int64_t timestamp_us;   // esp_timer time the last frame's integration ended (RTC time in low-power mode)
+    int64_t wall_us;        // the same moment in UTC, us since the epoch; 0 while the clock is not synced
+    uint32_t seq;
+    uint8_t kind;
+    uint8_t flags;
+    uint8_t gain;                 // sensor settings the spectrum was taken with
+    uint8_t integration_cycles;
+    uint32_t channel_mask;        // channels read; the others are NAN
+    float ch[AS7265X_NUM_CHANNELS];
+    // Oversampled measurements: per channel, the frames that went into the
+    // value and their standard deviation, in the same units
+    uint8_t n[AS7265X_NUM_CHANNELS];
+    float std[AS7265X_NUM_CHANNELS];
+    // Colour of a reflectance spectrum: CIE XYZ (Y of white = 1) and L*a*b*
+    float xyz[3];
+    float lab[3];
+} spectrum_t;
@@ -0,0 +1,82 @@
+#include "spectrum_ring.h"
+
+#define RING_MASK (SPECTRUM_RING_SIZE - 1)
+
+void spectrum_ring_init(spectrum_ring_t *ring, spectrum_ring_policy_t policy)
+{
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->tail, 0);
+    atomic_store(&ring->dropped, 0);
+    atomic_store(&ring->max_depth, 0);
+    ring->policy = policy;
+}
+
+// Producer side: moves tail up to keep, unless the consumer got there first
+static void discard_to(spectrum_ring_t *ring, unsigned keep)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    while ((int)(keep - tail) > 0) {
+        if (atomic_compare_exchange_weak_explicit(&ring->tail, &tail, keep,
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            atomic_fetch_add_explicit(&ring->dropped, keep - tail, memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+bool spectrum_ring_push(spectrum_ring_t *ring, const spectrum_t *s)
+{
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail;
+
+    switch (ring->policy) {
+        case SPECTRUM_RING_CONFLATE:
+            discard_to(ring, head);
+            break;
+        case SPECTRUM_RING_DROP_OLDEST:
+            discard_to(ring, head + 1 - SPECTRUM_RING_SIZE);
+            break;
+        default:
+            break;
+    }
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= SPECTRUM_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+
+    ring->slots[head & RING_MASK] = *s;
+    // Publish the slot contents before the new head
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    if (head + 1 - tail > atomic_load_explicit(&ring->max_depth, memory_order_relaxed)) {
+        atomic_store_explicit(&ring->max_depth, head + 1 - tail, memory_order_relaxed);
+    }
+    return true;
+}
+
+bool spectrum_ring_pop(spectrum_ring_t *ring, spectrum_t *out)
+{
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    while (1) {
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        if (head == tail) return false;
+
+        *out = ring->slots[tail & RING_MASK];
+        // If the producer discarded this slot meanwhile it may also have
+        // rewritten it, so the copy only counts if tail is still ours
+        if (atomic_compare_exchange_strong_explicit(&ring->tail, &tail, tail + 1,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            return true;
+        }
+    }
+}
+
+unsigned spectrum_ring_count(spectrum_ring_t *ring)
+{
+    return atomic_load(&ring->head) - atomic_load(&ring->tail);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "spectrum.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#define SPECTRUM_RING_SIZE 16   // must be a power of two
+
+// What a push does when the consumer has fallen behind
+typedef enum {
+    SPECTRUM_RING_DROP_NEWEST = 0,  // a full ring rejects the new spectrum
+    SPECTRUM_RING_DROP_OLDEST = 1,  // a full ring discards its oldest spectrum
+    SPECTRUM_RING_CONFLATE = 2,     // every push discards all queued spectra
+} spectrum_ring_policy_t;
+
+// Lock-free single-producer/single-consumer ring. Only the producer writes
+// head. The consumer advances tail, and so does the producer when its policy
+// discards queued spectra, so tail only moves by compare-and-swap.
+typedef struct {
+    spectrum_t slots[SPECTRUM_RING_SIZE];
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_uint dropped;
+    atomic_uint max_depth;
+    volatile spectrum_ring_policy_t policy;
+} spectrum_ring_t;
+
+void spectrum_ring_init(spectrum_ring_t *ring, spectrum_ring_policy_t policy);
+// Returns false only if the new spectrum itself was dropped
+bool spectrum_ring_push(spectrum_ring_t *ring, const spectrum_t *s);
+bool spectrum_ring_pop(spectrum_ring_t *ring, spectrum_t *out);
+unsigned spectrum_ring_count(spectrum_ring_t *ring);
@@ -0,0 +1,176 @@
+#include "telemetry.h"
+#include "as7265x.h"
+#include "i2c_driver.h"
+#include "sampler.h"
+#include "websocket.h"
+#include "wifi.h"
+#include "clocksync.h"
+#include "json_writer.h"
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <math.h>
+
+// Five histograms of up to 20 buckets plus the counters
+#define TELEMETRY_JSON_SIZE 2560
+
+static const char *TAG = "TELEMETRY";
+
+// Tasks whose stack headroom is reported; missing ones are skipped
+static const char *const stack_tasks[] = {
+    "sampler", "ws_sender", "telemetry", "websocket_task", "tiT", "sys_evt",
+};
+
+typedef struct {
+    int64_t at_us;
+    histogram_t i2c;
+    histogram_t readout;
+    histogram_t encode;
+    histogram_t send;
+    histogram_t jitter;
+} snapshot_t;
+
+// Telemetry task only
+static snapshot_t last;     // as of the last message that went out
+static char json_buf[TELEMETRY_JSON_SIZE];
+
+// Recorded since the previous message: count, p50/p99/max bucket bounds in
+// us, and the bucket counts without trailing empty buckets
+static void write_histogram(json_writer_t *w, const char *key,
+                            const histogram_t *now, const histogram_t *prev)
+{
+    histogram_t d;
+    int used = HISTOGRAM_BUCKETS;
+
+    histogram_diff(&d, now, prev);
+    while (used > 0 && d.buckets[used - 1] == 0) used--;
+
+    json_key(w, key);
+    json_begin_object(w);
+    json_key(w, "n");
+    json_number(w, d.count);
+    json_key(w, "p50");
+    json_number(w, histogram_percentile(&d, 50));
+    json_key(w, "p99");
+    json_number(w, histogram_percentile(&d, 99));
+    json_key(w, "max");
+    json_number(w, histogram_percentile(&d, 100));
+    json_key(w, "b");
+    json_begin_array(w);
+    for (int i = 0; i < used; i++) json_number(w, d.buckets[i]);
+    json_end_array(w);
+    json_end_object(w);
+}
+
+static void write_counter(json_writer_t *w, const char *key, double value)
+{
+    json_key(w, key);
+    json_number(w, value);
+}
+
+static void publish(void)
+{
+    snapshot_t now;
+    websocket_stats_t ws;
+    wifi_stats_t wifi;
+    as7265x_stream_stats_t stream;
+    clocksync_stats_t clock;
+    json_writer_t w;
+
+    now.at_us = esp_timer_get_time();
+    as7265x_get_i2c_histogram(&now.i2c);
+    as7265x_get_readout_histogram(&now.readout);
+    sampler_get_jitter_histogram(&now.jitter);
+    websocket_get_stats(&ws);
+    now.encode = ws.encode_latency;
+    now.send = ws.send_latency;
+    wifi_get_stats(&wifi);
+    as7265x_stream_get_stats(&stream);
+    clocksync_get_stats(&clock);
+
+    json_writer_init(&w, json_buf, sizeof(json_buf));
+    json_begin_object(&w);
+    json_key(&w, "type");
+    json_string(&w, "telemetry");
+    write_counter(&w, "uptime_ms", (double)(now.at_us / 1000));
+    write_counter(&w, "interval_ms", (double)((now.at_us - last.at_us) / 1000));
+    write_counter(&w, "heap_free", esp_get_free_heap_size());
+    write_counter(&w, "heap_min", esp_get_minimum_free_heap_size());
+    write_counter(&w, "rssi", wifi.connected ? wifi.rssi : NAN);
+    write_counter(&w, "wifi_disconnects", wifi.disconnects);
+    write_counter(&w, "wifi_reconnects", wifi.reconnects);
+    write_counter(&w, "wifi_connect_ms", wifi.connect_ms);
+    write_counter(&w, "wifi_boot_ms", wifi.boot_connect_ms);
+    json_key(&w, "wifi_fast");
+    json_bool(&w, wifi.fast);
+    write_counter(&w, "queue_depth", ws.queue_depth);
+    write_counter(&w, "queue_max_depth", ws.queue_max_depth);
+    write_counter(&w, "queue_dropped", ws.queue_dropped);
+    write_counter(&w, "offline_pending", ws.offline_pending);
+    write_counter(&w, "offline_dropped", ws.offline_dropped);
+    write_counter(&w, "sends", ws.sends);
+    write_counter(&w, "send_failures", ws.send_failures);
+    write_counter(&w, "i2c_transactions", as7265x_get_i2c_transactions());
+    write_counter(&w, "i2c_timeouts", as7265x_get_timeout_count());
+    write_counter(&w, "i2c_clock_hz", i2c_bus_get_clock());
+    write_counter(&w, "missed_ticks", sampler_missed_ticks());
+    write_counter(&w, "stream_fps", stream.fps_milli / 1000.0);
+    write_counter(&w, "stream_max_fps", stream.max_fps_milli / 1000.0);
+    write_counter(&w, "stream_skipped", stream.skipped);
+    write_counter(&w, "stream_overruns", stream.overruns);
+    json_key(&w, "clock_synced");
+    json_bool(&w, clock.synced);
+    write_counter(&w, "clock_syncs", clock.syncs);
+    write_counter(&w, "clock_offset_us", clock.synced ? clock.offset_us : NAN);
+    write_counter(&w, "clock_drift_ppb", clock.synced ? clock.drift_ppb : NAN);
+    write_counter(&w, "clock_sync_age_s", clock.synced ? clock.since_sync_s : NAN);
+
+    // Bytes of stack never used since the task started
+    json_key(&w, "stack_free");
+    json_begin_object(&w);
+    for (size_t i = 0; i < sizeof(stack_tasks) / sizeof(stack_tasks[0]); i++) {
+        TaskHandle_t task = xTaskGetHandle(stack_tasks[i]);
+        if (task) write_counter(&w, stack_tasks[i], uxTaskGetStackHighWaterMark(task));
+    }
+    json_end_object(&w);
+
+    json_key(&w, "us");
+    json_begin_object(&w);
+    write_histogram(&w, "i2c", &now.i2c, &last.i2c);
+    write_histogram(&w, "readout", &now.readout, &last.readout);
+    write_histogram(&w, "encode", &now.encode, &last.encode);
+    write_histogram(&w, "send", &now.send, &last.send);
+    write_histogram(&w, "jitter", &now.jitter, &last.jitter);
+    json_end_object(&w);
+    json_end_object(&w);
+
+    const char *json = json_writer_finish(&w);
+    if (!json) {
+        ESP_LOGE(TAG, "Telemetry does not fit in %d bytes", TELEMETRY_JSON_SIZE);
+        return;
+    }
+
+    // While offline the next message covers the gap as well
+    if (websocket_send_json(json, w.len)) last = now;
+}
+
+static void telemetry_task(void *pvParameters)
+{
+    TickType_t wake = xTaskGetTickCount();
+
+    while (1) {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(CONFIG_TELEMETRY_INTERVAL_S * 1000));
+        publish();
+    }
+}
+
+void telemetry_start(void)
+{
+    static TaskHandle_t task = NULL;
+
+    if (CONFIG_TELEMETRY_INTERVAL_S == 0 || task) return;
+    xTaskCreate(telemetry_task, "telemetry", 3072, NULL, 2, &task);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// Device health published as a "telemetry" message every
+// CONFIG_TELEMETRY_INTERVAL_S: free heap, stack headroom of our tasks, WiFi
+// signal and reconnects, queue depths, SNTP offset and drift, and per-stage
+// timing histograms (I2C transaction, spectrum readout, serialization, send,
+// tick jitter) covering the time since the previous message.
+void telemetry_start(void);
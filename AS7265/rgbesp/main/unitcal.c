@@ -0,0 +1,176 @@
+#include "unitcal.h"
+#include "oversample.h"
+#include "nvs.h"
+#include <math.h>
+#include <string.h>
+
+#define UNITCAL_NVS_NAMESPACE "unitcal"
+#define UNITCAL_NVS_KEY "rec"
+
+// A white reference less than this many counts above dark is unusable
+#define UNITCAL_MIN_SPAN_COUNTS 16
+
+// CIE 1931 2-degree colour matching functions under D65, sampled at the
+// channel wavelengths in device order (610 680 730 760 810 860 | 560 585
+// 645 705 900 940 | 410 435 460 485 510 535 nm) and weighted by the
+// spacing between neighbouring channels. Rows sum to the D65 white point.
+static const float default_xyz[3][AS7265X_NUM_CHANNELS] = {
+    { 0.25289f, 0.00821f, 0.00003f, 0.0f, 0.0f, 0.0f, 0.14184f, 0.21213f, 0.09830f,
+      0.00057f, 0.0f, 0.0f, 0.01054f, 0.07402f, 0.07785f, 0.01641f, 0.00419f, 0.05424f },
+    { 0.12656f, 0.00418f, 0.00005f, 0.0f, 0.0f, 0.0f, 0.23307f, 0.17803f, 0.03778f,
+      0.00049f, 0.0f, 0.0f, 0.00057f, 0.00316f, 0.01543f, 0.04539f, 0.12669f, 0.22859f },
+    { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.00084f, 0.00006f, 0.0f,
+      0.0f, 0.0f, 0.0f, 0.04391f, 0.37028f, 0.46301f, 0.16268f, 0.03966f, 0.00746f },
+};
+
+esp_err_t unitcal_load(unitcal_t *uc)
+{
+    unitcal_record_t rec;
+    size_t len = sizeof(rec);
+    nvs_handle_t nvs;
+    esp_err_t err;
+
+    uc->valid = false;
+    err = nvs_open(UNITCAL_NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) return ESP_ERR_NOT_FOUND;
+    err = nvs_get_blob(nvs, UNITCAL_NVS_KEY, &rec, &len);
+    nvs_close(nvs);
+
+    // A record from another firmware layout is as good as none
+    if (err != ESP_OK || len != sizeof(rec) || rec.version != UNITCAL_VERSION) return ESP_ERR_NOT_FOUND;
+    unitcal_init(uc, &rec);
+    return ESP_OK;
+}
+
+esp_err_t unitcal_save(const unitcal_record_t *rec)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(UNITCAL_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+
+    if (err != ESP_OK) return err;
+    err = nvs_set_blob(nvs, UNITCAL_NVS_KEY, rec, sizeof(*rec));
+    if (err == ESP_OK) err = nvs_commit(nvs);
+    nvs_close(nvs);
+    return err;
+}
+
+esp_err_t unitcal_erase(void)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(UNITCAL_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+
+    if (err != ESP_OK) return err;
+    err = nvs_erase_key(nvs, UNITCAL_NVS_KEY);
+    if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) err = nvs_commit(nvs);
+    nvs_close(nvs);
+    return err;
+}
+
+int unitcal_make_record(unitcal_record_t *rec, const uint32_t dark_q8[AS7265X_NUM_CHANNELS],
+                        const uint32_t white_q8[AS7265X_NUM_CHANNELS], uint8_t gain,
+                        uint8_t integration_cycles)
+{
+    const float q8 = 1.0f / (1 << OVERSAMPLE_SHIFT);
+    int unusable = 0;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->version = UNITCAL_VERSION;
+    rec->gain = gain;
+    rec->integration_cycles = integration_cycles;
+    memcpy(rec->xyz, default_xyz, sizeof(rec->xyz));
+
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        float dark = dark_q8[c] * q8;
+        float span = white_q8[c] * q8 - dark;
+
+        rec->dark[c] = dark;
+        if (span >= UNITCAL_MIN_SPAN_COUNTS && white_q8[c] < (uint32_t)OVERSAMPLE_SATURATED << OVERSAMPLE_SHIFT) {
+            rec->gain_corr[c] = 1.0f / span;
+        } else {
+            unusable++;
+        }
+    }
+    return unusable;
+}
+
+void unitcal_init(unitcal_t *uc, const unitcal_record_t *rec)
+{
+    memset(uc, 0, sizeof(*uc));
+    uc->gain = rec->gain;
+    uc->integration_cycles = rec->integration_cycles;
+
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        float dark = rec->dark[c] * (1 << OVERSAMPLE_SHIFT);
+        float g = rec->gain_corr[c] * 4294967296.0f;
+
+        uc->dark_q8[c] = dark > 0.0f ? (uint32_t)(dark + 0.5f) : 0;
+        uc->gain_q[c] = g >= 4294967295.0f ? UINT32_MAX : g > 0.0f ? (uint32_t)(g + 0.5f) : 0;
+
+        for (int k = 0; k < 3; k++) {
+            uc->xyz_q16[k][c] = (int32_t)lroundf(rec->xyz[k][c] * (1 << UNITCAL_SHIFT));
+            if (uc->xyz_q16[k][c] != 0) uc->xyz_mask |= 1u << c;
+            uc->white[k] += rec->xyz[k][c];
+        }
+    }
+    uc->valid = true;
+}
+
+bool unitcal_matches(const unitcal_t *uc, uint8_t gain, uint8_t integration_cycles)
+{
+    return uc->valid && uc->gain == gain && uc->integration_cycles == integration_cycles;
+}
+
+void unitcal_reflectance(const unitcal_t *uc, const uint32_t counts_q8[AS7265X_NUM_CHANNELS],
+                         const uint32_t *offset_q8, int32_t out_q16[AS7265X_NUM_CHANNELS])
+{
+    if (!offset_q8) offset_q8 = uc->dark_q8;
+
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+        int64_t diff = (int64_t)counts_q8[c] - offset_q8[c];
+        // At most 2^24 * 2^32: fits, and the shift brings Q8 * 2^32 to Q16
+        int64_t r = (diff * uc->gain_q[c]) >> (UNITCAL_GAIN_SHIFT + OVERSAMPLE_SHIFT - UNITCAL_SHIFT);
+
+        out_q16[c] = r > INT32_MAX ? INT32_MAX : r < INT32_MIN ? INT32_MIN : (int32_t)r;
+    }
+}
+
+bool unitcal_xyz(const unitcal_t *uc, const int32_t refl_q16[AS7265X_NUM_CHANNELS], uint32_t mask,
+                 int32_t out_q16[3])
+{
+    if ((uc->xyz_mask & mask) != uc->xyz_mask) return false;
+
+    for (int k = 0; k < 3; k++) {
+        int64_t acc = 0;
+        for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) {
+            acc += (int64_t)refl_q16[c] * uc->xyz_q16[k][c];
+        }
+        acc >>= UNITCAL_SHIFT;
+        out_q16[k] = acc > INT32_MAX ? INT32_MAX : acc < INT32_MIN ? INT32_MIN : (int32_t)acc;
+    }
+    return true;
+}
+
+static float lab_f(float t)
+{
+    const float d = 6.0f / 29.0f;
+
+    return t > d * d * d ? cbrtf(t) : t / (3.0f * d * d) + 4.0f / 29.0f;
+}
+
+void unitcal_lab(const unitcal_t *uc, const int32_t xyz_q16[3], float lab[3])
+{
+    float f[3];
+
+    for (int k = 0; k < 3; k++) {
+        float v = xyz_q16[k] * (1.0f / (1 << UNITCAL_SHIFT));
+        f[k] = lab_f(uc->white[k] > 0.0f ? v / uc->white[k] : 0.0f);
+    }
+    lab[0] = 116.0f * f[1] - 16.0f;
+    lab[1] = 500.0f * (f[0] - f[1]);
+    lab[2] = 200.0f * (f[1] - f[2]);
+}
+
+float unitcal_ita(const float lab[3])
+{
+    return atan2f(lab[0] - 50.0f, lab[2]) * (180.0f / (float)M_PI);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "as7265x.h"
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Per-unit calibration, kept in NVS: the dark offset and gain correction of
+// every channel, taken from a dark and a white reference, and a matrix from
+// the corrected spectrum to CIE XYZ. On-demand measurements come out as
+// reflectance against the white reference (1.0 = white) with their colour,
+// so consumers need no constants of their own.
+//
+// The record holds floats; unitcal_init() turns it into a fixed-point
+// kernel that works on the oversampler's Q24.8 counts.
+
+#define UNITCAL_VERSION 1
+
+// Reflectance and XYZ are Q16.16 (1.0 = the white reference)
+#define UNITCAL_SHIFT 16
+// Gains are reflectance per count, times 2^32
+#define UNITCAL_GAIN_SHIFT 32
+
+typedef struct {
+    uint8_t version;
+    uint8_t gain;                   // sensor settings the references were taken with
+    uint8_t integration_cycles;
+    uint8_t reserved;
+    float dark[AS7265X_NUM_CHANNELS];   // counts with the sensor covered, bulbs off
+    float gain_corr[AS7265X_NUM_CHANNELS];  // reflectance per count above dark, 0 if unusable
+    float xyz[3][AS7265X_NUM_CHANNELS];     // reflectance to XYZ, D65, Y of white = 1
+} unitcal_record_t;
+
+typedef struct {
+    bool valid;
+    uint8_t gain;
+    uint8_t integration_cycles;
+    uint32_t dark_q8[AS7265X_NUM_CHANNELS];
+    uint32_t gain_q[AS7265X_NUM_CHANNELS];
+    int32_t xyz_q16[3][AS7265X_NUM_CHANNELS];
+    uint32_t xyz_mask;              // channels the matrix uses
+    float white[3];                 // XYZ of the white reference, for L*a*b*
+} unitcal_t;
+
+// Loads the record from NVS. Returns ESP_ERR_NOT_FOUND without one; uc is
+// then invalid and measurements stay uncorrected.
+esp_err_t unitcal_load(unitcal_t *uc);
+esp_err_t unitcal_save(const unitcal_record_t *rec);
+esp_err_t unitcal_erase(void);
+
+// Builds a record from dark and white reference means in Q24.8 counts, with
+// the default XYZ matrix. Returns the number of channels whose white
+// reference was too close to dark to use.
+int unitcal_make_record(unitcal_record_t *rec, const uint32_t dark_q8[AS7265X_NUM_CHANNELS],
+                        const uint32_t white_q8[AS7265X_NUM_CHANNELS], uint8_t gain,
+                        uint8_t integration_cycles);
+// Precomputes the fixed-point kernel
+void unitcal_init(unitcal_t *uc, const unitcal_record_t *rec);
+
+// Whether uc applies to spectra taken at these settings
+bool unitcal_matches(const unitcal_t *uc, uint8_t gain, uint8_t integration_cycles);
+
+// Reflectance Q16.16 of counts_q8 above offset_q8 (NULL: the dark offset).
+// Channels without a usable gain come out as 0.
+void unitcal_reflectance(const unitcal_t *uc, const uint32_t counts_q8[AS7265X_NUM_CHANNELS],
+                         const uint32_t *offset_q8, int32_t out_q16[AS7265X_NUM_CHANNELS]);
+// XYZ Q16.16 of a reflectance spectrum. Returns false if the matrix needs a
+// channel outside mask.
+bool unitcal_xyz(const unitcal_t *uc, const int32_t refl_q16[AS7265X_NUM_CHANNELS], uint32_t mask,
+                 int32_t out_q16[3]);
+// CIE L*a*b* of an XYZ Q16.16 colour against the white reference
+void unitcal_lab(const unitcal_t *uc, const int32_t xyz_q16[3], float lab[3]);
+// Individual typology angle in degrees, from L*a*b*
+float unitcal_ita(const float lab[3]);
@@ -1,55 +1,458 @@
 #include "websocket.h"
 #include "wifi.h"
-#include "as7265x.h"
+#include "sampler.h"
+#include "frame.h"
+#include "json_writer.h"
+#include "cmd_parser.h"
+#include "speclog.h"
+#include "unitcal.h"
+#include "sdkconfig.h"
 #include "esp_log.h"
+#include "esp_mac.h"
 #include "esp_websocket_client.h"
 #include "esp_timer.h"
-#include "cJSON.h"
+#include "esp_event.h"
+#include "esp_wifi.h"
+#include "boot.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include <string.h>
 
 #define WS_URI "ws://10.98.101.51:8765"
 
+// Sent on connect; a relay that understands binary frames answers with a
+// set_format command, older relays ignore it and we stay on JSON. Likewise
+// raw readout is only used once the relay asks for it with set_readout.
+#define WS_HELLO "{\"type\":\"hello\",\"role\":\"device\",\"formats\":[\"json\",\"bin1\",\"bin1_i16\",\"bin1_delta\"]," \
+                 "\"readouts\":[\"calibrated\",\"raw\"]}"
+
+// Stream batching: up to WS_BATCH_MAX spectra per binary frame. A batch is
+// sent when it is full or its oldest spectrum is batch_max_ms old.
+#define WS_BATCH_MAX 32
+#define WS_BATCH_MAX_MS_LIMIT 2000
+#define WS_BATCH_DEFAULT_MS 100
+
+// Default quantization step of the delta encoding, in sensor units (uW/cm2)
+#define WS_DELTA_DEFAULT_STEP 0.1f
+// Log the delta encoding's size against float32 frames every this many frames
+#define WS_DELTA_LOG_FRAMES 100
+
+// Replay of the offline log: batches of up to WS_BATCH_MAX spectra, sent
+// only when no live spectra are waiting and throttled to a byte budget
+#define WS_REPLAY_BYTES_PER_S 8192
+#define WS_REPLAY_BURST_BYTES (2 * (FRAME_HEADER_SIZE + WS_BATCH_MAX * (4 + AS7265X_NUM_CHANNELS * 4)))
+#define WS_REPLAY_RETRY_MS 1000
+
+typedef enum {
+    WIRE_JSON = 0,
+    WIRE_BIN_F32,
+    WIRE_BIN_I16,
+    WIRE_BIN_DELTA,
+} wire_format_t;
+
 static const char *TAG = "WS";
 static esp_websocket_client_handle_t client = NULL;
-volatile bool debug_enabled = false;
-TaskHandle_t debug_task_handle = NULL;
+static TaskHandle_t sender_task_handle = NULL;
+static volatile wire_format_t wire_format = WIRE_JSON;
+static uint16_t device_id = 0;
+
+static volatile uint8_t batch_size = 1;
+static volatile uint16_t batch_max_ms = WS_BATCH_DEFAULT_MS;
+
+// Owned by the sender task
+static spectrum_t batch[WS_BATCH_MAX];
+static size_t batch_len = 0;
+static wire_format_t batch_format = WIRE_JSON;
+
+static volatile float delta_step = WS_DELTA_DEFAULT_STEP;
+// Set by the websocket task when the peer may have lost the delta chain
+static volatile bool delta_reset = true;
+// Owned by the sender task
+static frame_delta_state_t delta_state;
+static uint32_t delta_frames = 0;
+static uint64_t delta_bytes = 0;
+static uint64_t delta_f32_bytes = 0;
+
+// Send counters, updated from the sender and websocket tasks
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static histogram_t encode_latency;  // us per serialized message or frame
+static histogram_t send_latency;    // us per send call
+static uint32_t sends = 0;
+static uint32_t send_failures = 0;
+
+// Sender task only
+static spectrum_t replay_buf[WS_BATCH_MAX];
+static int64_t replay_tokens = 0;
+static int64_t replay_refill_us = 0;
+static uint32_t replayed = 0;
+
+// Websocket opcodes of the data frames we take commands from
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT 0x1
+// Longest command accepted when it has to be reassembled
+#define WS_RX_MAX 512
+
+// 18 values and 18 standard deviations of at most 24 characters, 18 frame
+// counts, the colour, plus the fixed fields
+#define WS_SENSOR_JSON_SIZE 1408
+#define WS_STATUS_JSON_SIZE 160
+// Status plus a version string and 7 boot timestamps
+#define WS_BOOT_JSON_SIZE 320
+
+// Sender task only
+static char sensor_json[WS_SENSOR_JSON_SIZE];
+
+static uint8_t frame_buf[FRAME_MAX_SIZE(WS_BATCH_MAX)];
+
+// Websocket task only
+static char boot_json[WS_BOOT_JSON_SIZE];
+
+// The client is started once WiFi has an IP; started any earlier, its
+// first attempt fails and it waits out the whole reconnect timeout
+static portMUX_TYPE start_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool client_started = false;
+
+
+// Every send goes through here, so none can block longer than
+// CONFIG_WS_SEND_TIMEOUT_MS. Returns false if the data did not go out.
+static bool ws_send(bool binary, const char *data, size_t len)
+{
+    TickType_t timeout = pdMS_TO_TICKS(CONFIG_WS_SEND_TIMEOUT_MS);
+    int64_t start_us = esp_timer_get_time();
+    int ret = binary ? esp_websocket_client_send_bin(client, data, len, timeout)
+                     : esp_websocket_client_send_text(client, data, len, timeout);
+    uint32_t elapsed_us = (uint32_t)(esp_timer_get_time() - start_us);
+
+    portENTER_CRITICAL(&stats_lock);
+    histogram_record(&send_latency, elapsed_us);
+    sends++;
+    if (ret < 0) send_failures++;
+    portEXIT_CRITICAL(&stats_lock);
+
+    if (ret < 0) {
+        ESP_LOGW(TAG, "Send of %u bytes failed after %lu us", (unsigned)len, (unsigned long)elapsed_us);
+    }
+    return ret >= 0;
+}
 
+static void record_encode(int64_t start_us)
+{
+    uint32_t elapsed_us = (uint32_t)(esp_timer_get_time() - start_us);
+
+    portENTER_CRITICAL(&stats_lock);
+    histogram_record(&encode_latency, elapsed_us);
+    portEXIT_CRITICAL(&stats_lock);
+}
 
-static void handle_incoming_message(const char *data, int len)
+// Rounds to whole microseconds without overflowing; the sampler clamps further
+static uint32_t to_us(double us)
 {
-    char *msg = strndup(data, len);
-    if (!msg) return;
+    return us >= UINT32_MAX ? UINT32_MAX : (uint32_t)(us + 0.5);
+}
 
-    ESP_LOGI(TAG, "Received: %s", msg);
+// Command handlers run on the websocket client task: they only signal the
+// sampler and sender and never touch the bus or block
 
-    cJSON *root = cJSON_Parse(msg);
-    if (root) {
-        cJSON *type = cJSON_GetObjectItem(root, "type");
+// Ignored by the sampler while the debug stream is on
+static void cmd_read_sensor(const cmd_message_t *msg)
+{
+    sampler_request_read();
+}
 
-        if (cJSON_IsString(type)) {
-            if (strcmp(type->valuestring, "command") == 0) {
-                cJSON *action = cJSON_GetObjectItem(root, "action");
-                if (cJSON_IsString(action)) {
-                    ESP_LOGI(TAG, "Command: %s", action->valuestring);
+static void cmd_debug_on(const cmd_message_t *msg)
+{
+    sampler_set_streaming(true);
+}
 
-                    if (!strcmp(action->valuestring, "read_sensor") && !debug_enabled) {
-                        send_sensor_data();
-                    }
+static void cmd_debug_off(const cmd_message_t *msg)
+{
+    sampler_set_streaming(false);
+}
+
+static void cmd_set_format(const cmd_message_t *msg)
+{
+    const cmd_field_t *format = cmd_find(msg, "format");
+    double step;
+
+    if (!format || format->type != CMD_VALUE_STRING) return;
+
+    if (cmd_get_number(msg, "step", &step) && step > 0) delta_step = step;
+    if (cmd_string_is(format, "bin1")) wire_format = WIRE_BIN_F32;
+    else if (cmd_string_is(format, "bin1_i16")) wire_format = WIRE_BIN_I16;
+    else if (cmd_string_is(format, "bin1_delta")) wire_format = WIRE_BIN_DELTA;
+    else wire_format = WIRE_JSON;
+    delta_reset = true;
+    ESP_LOGI(TAG, "Wire format: %.*s", (int)format->str_len, format->str);
+    // Binary peers can take the offline log now
+    if (sender_task_handle) xTaskNotifyGive(sender_task_handle);
+}
 
-                    if (!strcmp(action->valuestring, "debug_on")) {
-                        debug_enabled = true;
-                    }
+// "raw" or "calibrated"; every connection starts out calibrated
+static void cmd_set_readout(const cmd_message_t *msg)
+{
+    const cmd_field_t *mode = cmd_find(msg, "mode");
 
-                    if (!strcmp(action->valuestring, "debug_off")) {
-                        debug_enabled = false;
-                    }
-                }
-            }
+    if (!mode || mode->type != CMD_VALUE_STRING) return;
+
+    sampler_set_raw_readout(cmd_string_is(mode, "raw"));
+    ESP_LOGI(TAG, "Readout: %s", sampler_raw_readout() ? "raw" : "calibrated");
+}
+
+// Any of n, method ("mean", "median", "trimmed"), trim_pct and
+// noise_target_pct; fields left out keep their value
+static void cmd_set_oversample(const cmd_message_t *msg)
+{
+    const cmd_field_t *method = cmd_find(msg, "method");
+    oversample_config_t cfg;
+    double v;
+
+    sampler_get_oversample(&cfg);
+    if (cmd_get_number(msg, "n", &v)) cfg.n = v < 1 ? 1 : v > OVERSAMPLE_MAX_N ? OVERSAMPLE_MAX_N : (uint8_t)v;
+    if (cmd_get_number(msg, "trim_pct", &v)) cfg.trim_pct = v < 0 ? 0 : v > 100 ? 100 : (uint8_t)v;
+    if (cmd_get_number(msg, "noise_target_pct", &v)) {
+        cfg.noise_target_bp = v <= 0 ? 0 : v >= 100 ? 10000 : (uint16_t)(v * 100 + 0.5);
+    }
+    if (cmd_string_is(method, "mean")) cfg.method = OVERSAMPLE_MEAN;
+    else if (cmd_string_is(method, "median")) cfg.method = OVERSAMPLE_MEDIAN;
+    else if (cmd_string_is(method, "trimmed")) cfg.method = OVERSAMPLE_TRIMMED;
+
+    sampler_set_oversample(&cfg);
+    sampler_get_oversample(&cfg);
+    ESP_LOGI(TAG, "Oversampling: %u frames, method %d, trim %u%%, target %u bp",
+             cfg.n, cfg.method, cfg.trim_pct, cfg.noise_target_bp);
+}
+
+// mask selects channels by bit, 0 for all; preset "all" or "preview" (the
+// channels of the dashboard's colour preview) instead of a mask
+static void cmd_set_channels(const cmd_message_t *msg)
+{
+    const cmd_field_t *preset = cmd_find(msg, "preset");
+    double v;
+    uint32_t mask;
+
+    if (cmd_string_is(preset, "preview")) mask = AS7265X_PREVIEW_CHANNELS;
+    else if (cmd_string_is(preset, "all")) mask = AS7265X_ALL_CHANNELS;
+    else if (cmd_get_number(msg, "mask", &v) && v >= 0 && v <= AS7265X_ALL_CHANNELS) mask = (uint32_t)v;
+    else return;
+
+    mask = sampler_set_channel_mask(mask);
+    ESP_LOGI(TAG, "Channels: 0x%05lx", (unsigned long)mask);
+}
+
+// Optional bulbs mask (bit n = device n); without it every bulb
+static void set_bulbs_from(const cmd_message_t *msg, bool on)
+{
+    double v;
+    uint8_t bulbs = AS7265X_ALL_BULBS;
+
+    if (cmd_get_number(msg, "bulbs", &v) && v >= 0 && v <= AS7265X_ALL_BULBS) bulbs = (uint8_t)v;
+    bulbs = on ? sampler_bulbs() | bulbs : sampler_bulbs() & ~bulbs;
+    sampler_set_bulbs(bulbs);
+    ESP_LOGI(TAG, "Bulbs lit: 0x%x", bulbs);
+}
+
+static void cmd_bulb_on(const cmd_message_t *msg)
+{
+    set_bulbs_from(msg, true);
+}
+
+static void cmd_bulb_off(const cmd_message_t *msg)
+{
+    set_bulbs_from(msg, false);
+}
+
+// ambient (bool) turns ambient correction of read_sensor on or off; bulbs
+// picks the bulbs it uses. Fields left out keep their value.
+static void cmd_set_scan(const cmd_message_t *msg)
+{
+    const cmd_field_t *ambient = cmd_find(msg, "ambient");
+    uint8_t bulbs;
+    bool on = sampler_ambient_scan(&bulbs);
+    double v;
+
+    if (ambient && ambient->type == CMD_VALUE_BOOL) on = ambient->number != 0;
+    if (cmd_get_number(msg, "bulbs", &v) && v >= 1 && v <= AS7265X_ALL_BULBS) bulbs = (uint8_t)v;
+
+    sampler_set_ambient_scan(on, bulbs);
+    ESP_LOGI(TAG, "Ambient correction %s, bulbs 0x%x", on ? "on" : "off", bulbs);
+}
+
+// Streaming period; 0 returns to free-running at the frame rate
+static void cmd_set_interval(const cmd_message_t *msg)
+{
+    double ms;
+
+    if (cmd_get_number(msg, "interval_ms", &ms) && ms >= 0) {
+        uint32_t us = sampler_set_interval_us(to_us(ms * 1000));
+        ESP_LOGI(TAG, "Stream interval: %lu us", (unsigned long)us);
+    }
+}
+
+static void cmd_set_rate(const cmd_message_t *msg)
+{
+    double hz;
+
+    if (cmd_get_number(msg, "rate_hz", &hz) && hz >= 0) {
+        uint32_t us = sampler_set_interval_us(hz > 0 ? to_us(1e6 / hz) : 0);
+        ESP_LOGI(TAG, "Stream interval: %lu us", (unsigned long)us);
+    }
+}
+
+static void cmd_set_i2c_clock(const cmd_message_t *msg)
+{
+    double hz;
+
+    if (cmd_get_number(msg, "hz", &hz) && hz > 0) {
+        uint32_t used = sampler_set_bus_clock(hz > UINT32_MAX ? UINT32_MAX : (uint32_t)hz);
+        ESP_LOGI(TAG, "I2C clock: %lu Hz", (unsigned long)used);
+    }
+}
+
+// Only binary frames carry more than one spectrum
+static void cmd_set_batch(const cmd_message_t *msg)
+{
+    double v;
+
+    if (cmd_get_number(msg, "size", &v)) {
+        batch_size = v < 1 ? 1 : v > WS_BATCH_MAX ? WS_BATCH_MAX : (uint8_t)v;
+    }
+    if (cmd_get_number(msg, "max_ms", &v)) {
+        batch_max_ms = v < 1 ? 1 : v > WS_BATCH_MAX_MS_LIMIT ? WS_BATCH_MAX_MS_LIMIT : (uint16_t)v;
+    }
+    ESP_LOGI(TAG, "Batch: %u spectra / %u ms", batch_size, batch_max_ms);
+    if (sender_task_handle) xTaskNotifyGive(sender_task_handle);
+}
+
+// reference is "dark" (sensor covered), "white" (white standard) or "clear";
+// the sampler reports progress as status messages
+static void cmd_calibrate(const cmd_message_t *msg)
+{
+    const cmd_field_t *ref = cmd_find(msg, "reference");
+
+    if (cmd_string_is(ref, "dark")) {
+        sampler_calibrate(SAMPLER_REFERENCE_DARK);
+    } else if (cmd_string_is(ref, "white")) {
+        sampler_calibrate(SAMPLER_REFERENCE_WHITE);
+    } else if (cmd_string_is(ref, "clear")) {
+        sampler_calibrate(SAMPLER_REFERENCE_CLEAR);
+    }
+}
+
+static const cmd_entry_t commands[] = {
+    { "read_sensor", cmd_read_sensor },
+    { "debug_on", cmd_debug_on },
+    { "debug_off", cmd_debug_off },
+    { "set_format", cmd_set_format },
+    { "set_interval", cmd_set_interval },
+    { "set_rate", cmd_set_rate },
+    { "set_batch", cmd_set_batch },
+    { "set_readout", cmd_set_readout },
+    { "set_oversample", cmd_set_oversample },
+    { "set_channels", cmd_set_channels },
+    { "bulb_on", cmd_bulb_on },
+    { "bulb_off", cmd_bulb_off },
+    { "set_scan", cmd_set_scan },
+    { "calibrate", cmd_calibrate },
+    { "set_i2c_clock", cmd_set_i2c_clock },
+};
+
+static cmd_table_t command_table;
+
+// Websocket task only
+static cmd_message_t cmd_msg;
+static char rx_buf[WS_RX_MAX];
+static size_t rx_len = 0;
+static bool rx_active = false;      // inside a text message
+static bool rx_overflow = false;
+
+static void handle_incoming_message(const char *data, size_t len)
+{
+    const cmd_field_t *action;
+    const cmd_entry_t *cmd;
+
+    if (cmd_parse(data, len, &cmd_msg) != ESP_OK) {
+        ESP_LOGW(TAG, "Ignoring malformed message (%u bytes)", (unsigned)len);
+        return;
+    }
+    if (!cmd_string_is(cmd_find(&cmd_msg, "type"), "command")) return;
+
+    action = cmd_find(&cmd_msg, "action");
+    if (!action || action->type != CMD_VALUE_STRING) return;
+
+    cmd = cmd_table_find(&command_table, action->str, action->str_len);
+    if (!cmd) {
+        ESP_LOGW(TAG, "Unknown command: %.*s", (int)action->str_len, action->str);
+        return;
+    }
+    ESP_LOGI(TAG, "Command: %s", cmd->action);
+    cmd->handler(&cmd_msg);
+}
+
+// Text messages can arrive in pieces: a frame larger than the client's
+// buffer comes as several events with increasing payload_offset, and a
+// fragmented message as continuation frames. Only those are copied; a
+// message that arrives whole is parsed where it lies.
+static void handle_text_data(const esp_websocket_event_data_t *data)
+{
+    size_t len = data->data_len;
+    bool frame_done = data->payload_offset + data->data_len >= data->payload_len;
+
+    if (data->op_code == WS_OP_TEXT && data->payload_offset == 0) {
+        if (frame_done && data->fin) {
+            rx_active = false;
+            handle_incoming_message(data->data_ptr, len);
+            return;
         }
-        cJSON_Delete(root);
+        rx_active = true;
+        rx_overflow = false;
+        rx_len = 0;
+    }
+    if (!rx_active) return;
+
+    if (rx_overflow || rx_len + len > sizeof(rx_buf)) {
+        rx_overflow = true;
+    } else {
+        memcpy(rx_buf + rx_len, data->data_ptr, len);
+        rx_len += len;
+    }
+    if (!frame_done || !data->fin) return;
+
+    rx_active = false;
+    if (rx_overflow) {
+        ESP_LOGW(TAG, "Dropped message longer than %d bytes", WS_RX_MAX);
+    } else {
+        handle_incoming_message(rx_buf, rx_len);
+    }
+}
+
+// The first "ESP connected" after boot also carries the boot timeline
+static void send_connected_status(void)
+{
+    static bool boot_reported = false;
+    json_writer_t w;
+
+    if (boot_reported) {
+        send_status("ESP connected");
+        return;
+    }
+
+    json_writer_init(&w, boot_json, sizeof(boot_json));
+    json_begin_object(&w);
+    json_key(&w, "type");
+    json_string(&w, "status");
+    json_key(&w, "message");
+    json_string(&w, "ESP connected");
+    boot_write_json(&w);
+    json_end_object(&w);
+
+    const char *json = json_writer_finish(&w);
+    if (!json) {
+        ESP_LOGE(TAG, "Boot report does not fit in %d bytes", WS_BOOT_JSON_SIZE);
+        send_status("ESP connected");
+        boot_reported = true;
+    } else if (ws_send(false, json, w.len)) {
+        boot_reported = true;
     }
-    free(msg);
 }
 
 static void websocket_event_handler(void *handler_args, esp_event_base_t base,
@@ -60,12 +463,20 @@ static void websocket_event_handler(void *handler_args, esp_event_base_t base,
     switch (event_id) {
         case WEBSOCKET_EVENT_CONNECTED:
             ESP_LOGI(TAG, "Connected");
-            send_status("ESP connected");
+            // Every connection starts out as JSON until the peer asks otherwise
+            wire_format = WIRE_JSON;
+            delta_reset = true;
+            sampler_set_raw_readout(false);
+            boot_mark(BOOT_WS_CONNECTED);
+            send_connected_status();
+            ws_send(false, WS_HELLO, strlen(WS_HELLO));
             break;
 
         case WEBSOCKET_EVENT_DATA:
-            if (data->op_code == 0x1)
-                handle_incoming_message(data->data_ptr, data->data_len);
+            // Control frames may arrive between the fragments of a message
+            if (data->op_code == WS_OP_TEXT || data->op_code == WS_OP_CONTINUATION) {
+                handle_text_data(data);
+            }
             break;
 
         default:
@@ -73,58 +484,324 @@ static void websocket_event_handler(void *handler_args, esp_event_base_t base,
     }
 }
 
-void send_sensor_data(void)
+static void log_delta_ratio(size_t len, size_t count)
 {
-    if (!esp_websocket_client_is_connected(client)) return;
+    delta_bytes += len;
+    delta_f32_bytes += FRAME_HEADER_SIZE + count * (4 + AS7265X_NUM_CHANNELS * 4);
 
-    float sumCh[18] = {0};
-    //We are going to measure ten times to get the valid data
-    for (int i = 0; i < 10; i++) {
-        int idx = 0;
-
-        for (uint8_t dev = 0; dev < 3; dev++) {
-        as7265x_set_device(dev);
-            for (uint8_t base = 0x14; base < 0x2C; base += 4) {
-                float value;
-                if (as7265x_read_calibrated_value(base, &value) != ESP_OK) {
-                    ESP_LOGE("AS7265X", "Read failed dev=%d chan=%d", dev, idx % 6);
-                    value = 0.0f; // fallback
-                }
-                sumCh[idx++] += value; 
-            }
+    if (++delta_frames % WS_DELTA_LOG_FRAMES == 0) {
+        ESP_LOGI(TAG, "Delta frames: %llu bytes, %.2fx smaller than float32",
+                 (unsigned long long)delta_bytes, (double)delta_f32_bytes / delta_bytes);
+    }
+}
+
+// Raw counts always go as uint16, whatever encoding was negotiated
+static frame_encoding_t fixed_encoding(const spectrum_t *s, wire_format_t format)
+{
+    if (s->flags & SPECTRUM_FLAG_RAW) return FRAME_ENC_U16;
+    return format == WIRE_BIN_I16 ? FRAME_ENC_I16 : FRAME_ENC_F32;
+}
+
+static void send_spectra_bin(const spectrum_t *s, size_t count, wire_format_t format)
+{
+    int64_t start_us = esp_timer_get_time();
+    size_t len;
+
+    if (format == WIRE_BIN_DELTA && !(s->flags & SPECTRUM_FLAG_RAW)) {
+        if (delta_reset) {
+            delta_reset = false;
+            memset(&delta_state, 0, sizeof(delta_state));
         }
+        len = frame_encode_delta(frame_buf, sizeof(frame_buf), s, count, delta_step,
+                                 device_id, &delta_state);
+    } else {
+        len = frame_encode(frame_buf, sizeof(frame_buf), s, count,
+                           fixed_encoding(s, format), 0, device_id);
+    }
+    record_encode(start_us);
+    if (len == 0) return;
+
+    if (!ws_send(true, (const char *)frame_buf, len)) {
+        // The next delta frame would not decode without this one
+        delta_state.valid = false;
+        // A failed send drops the connection; keep the spectra for replay
+        for (size_t i = 0; i < count; i++) speclog_append(&s[i]);
+    } else if (format == WIRE_BIN_DELTA && !(s->flags & SPECTRUM_FLAG_RAW)) {
+        log_delta_ratio(len, count);
+    }
+}
 
-        vTaskDelay(pdMS_TO_TICKS(100));
+static void batch_flush(void)
+{
+    if (batch_len == 0) return;
+
+    if (esp_websocket_client_is_connected(client)) {
+        send_spectra_bin(batch, batch_len, batch_format);
+    } else {
+        for (size_t i = 0; i < batch_len; i++) speclog_append(&batch[i]);
     }
+    batch_len = 0;
+}
+
+// A frame header describes every sample in it, so a spectrum that differs in
+// anything the header carries starts a new batch
+static bool batch_accepts(const spectrum_t *s, wire_format_t format)
+{
+    const spectrum_t *last = &batch[batch_len - 1];
+
+    return format == batch_format &&
+           s->seq == last->seq + 1 &&
+           (s->flags & SPECTRUM_FLAG_RAW) == (last->flags & SPECTRUM_FLAG_RAW) &&
+           s->channel_mask == last->channel_mask &&
+           s->gain == last->gain &&
+           s->integration_cycles == last->integration_cycles &&
+           // One timebase per frame, and a clock sync must not step it back
+           (s->wall_us != 0) == (last->wall_us != 0) &&
+           frame_sample_us(s) >= frame_sample_us(last) &&
+           s->timestamp_us - batch[0].timestamp_us <= (int64_t)batch_max_ms * 1000;
+}
 
-    for (int i = 0; i < 18; i++) {
-        sumCh[i] /= 10.0f;
+static void batch_add(const spectrum_t *s, wire_format_t format)
+{
+    if (batch_len > 0 && !batch_accepts(s, format)) batch_flush();
+
+    if (batch_len == 0) batch_format = format;
+    batch[batch_len++] = *s;
+
+    if (batch_len >= batch_size) batch_flush();
+}
+
+// Ticks until the pending batch is due, or portMAX_DELAY if there is none
+static TickType_t batch_wait_ticks(void)
+{
+    if (batch_len == 0) return portMAX_DELAY;
+
+    int64_t due_us = batch[0].timestamp_us + (int64_t)batch_max_ms * 1000;
+    int64_t left_us = due_us - esp_timer_get_time();
+    if (left_us <= 0) return 0;
+    return pdMS_TO_TICKS(left_us / 1000) + 1;
+}
+
+// How many of the first n logged spectra one frame header can describe
+static size_t replay_run(const spectrum_t *s, size_t n)
+{
+    size_t i = 1;
+
+    for (; i < n; i++) {
+        int64_t dt = frame_sample_us(&s[i]) - frame_sample_us(&s[0]);
+        if (s[i].seq != s[i - 1].seq + 1 || s[i].kind != s[0].kind ||
+            (s[i].wall_us != 0) != (s[0].wall_us != 0) ||
+            ((s[i].flags ^ s[0].flags) & (SPECTRUM_FLAG_RAW | SPECTRUM_FLAG_REFLECTANCE)) ||
+            s[i].channel_mask != s[0].channel_mask ||
+            s[i].gain != s[0].gain || s[i].integration_cycles != s[0].integration_cycles ||
+            dt < 0 || dt > UINT32_MAX) {
+            break;
+        }
     }
-    
+    return n ? i : 0;
+}
 
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "type", "sensor");
+// Sends one frame of logged spectra if the byte budget allows. Live spectra
+// always go first: this only runs once the sampler ring is drained.
+// Returns the ticks until the next attempt.
+static TickType_t replay_step(void)
+{
+    wire_format_t format = wire_format;
+    int64_t now = esp_timer_get_time();
+    const int64_t need = FRAME_HEADER_SIZE + WS_BATCH_MAX * (4 + AS7265X_NUM_CHANNELS * 4);
+    size_t n, len;
+
+    // Replay is binary only; JSON peers leave the log for a later connection
+    if (format == WIRE_JSON || speclog_pending() == 0 ||
+        !esp_websocket_client_is_connected(client)) {
+        return portMAX_DELAY;
+    }
 
-    cJSON *arr = cJSON_CreateArray();
-    for (int i = 0; i < 18; i++) {
-        cJSON_AddItemToArray(arr, cJSON_CreateNumber(sumCh[i]));
+    replay_tokens += (now - replay_refill_us) * WS_REPLAY_BYTES_PER_S / 1000000;
+    if (replay_tokens > WS_REPLAY_BURST_BYTES) replay_tokens = WS_REPLAY_BURST_BYTES;
+    replay_refill_us = now;
+    if (replay_tokens < need) {
+        return pdMS_TO_TICKS((need - replay_tokens) * 1000 / WS_REPLAY_BYTES_PER_S) + 1;
     }
-    cJSON_AddItemToObject(root, "readings", arr);
 
-    char *json = cJSON_PrintUnformatted(root);
-    if (json) {
-        esp_websocket_client_send_text(client, json, strlen(json), portMAX_DELAY);
-        free(json);
+    n = replay_run(replay_buf, speclog_peek(replay_buf, WS_BATCH_MAX));
+    if (n == 0) return 1;
+
+    int64_t start_us = esp_timer_get_time();
+    len = frame_encode(frame_buf, sizeof(frame_buf), replay_buf, n,
+                       fixed_encoding(&replay_buf[0], format), FRAME_FLAG_REPLAY, device_id);
+    record_encode(start_us);
+    if (len == 0 || !ws_send(true, (const char *)frame_buf, len)) {
+        return pdMS_TO_TICKS(WS_REPLAY_RETRY_MS);
+    }
+
+    speclog_consume(n);
+    replay_tokens -= len;
+    replayed += n;
+    if (speclog_pending() == 0) {
+        ESP_LOGI(TAG, "Replayed %lu logged spectra", (unsigned long)replayed);
+        replayed = 0;
+    }
+    return 0;
+}
+
+// Scales for the raw spectra that follow; JSON in every wire format
+static void send_calibration(const spectrum_t *s)
+{
+    int64_t start_us = esp_timer_get_time();
+    json_writer_t w;
+
+    json_writer_init(&w, sensor_json, sizeof(sensor_json));
+    json_begin_object(&w);
+    json_key(&w, "type");
+    json_string(&w, "calibration");
+    json_key(&w, "device_id");
+    json_number(&w, device_id);
+    json_key(&w, "gain");
+    json_number(&w, s->gain);
+    json_key(&w, "integration_cycles");
+    json_number(&w, s->integration_cycles);
+    json_key(&w, "scale");
+    json_begin_array(&w);
+    for (int i = 0; i < AS7265X_NUM_CHANNELS; i++) {
+        json_number(&w, s->ch[i]);
     }
-    cJSON_Delete(root);
+    json_end_array(&w);
+    json_end_object(&w);
+
+    const char *json = json_writer_finish(&w);
+    record_encode(start_us);
+    if (json) ws_send(false, json, w.len);
 }
 
-static void sensor_task(void *pvParameters)
+// Whether a spectrum that could not be sent goes to the offline log. Scales
+// are sent again once raw readout is back on. Frames have no room to mark
+// the bulb-off half of an ambient-corrected measurement, so only the
+// corrected spectrum is kept.
+static bool loggable(const spectrum_t *s)
 {
-    while (1) {
-        xEventGroupWaitBits(wifi_event_group, WIFI_CONNECTED_BIT, false, true, portMAX_DELAY);
+    return !(s->flags & SPECTRUM_FLAG_FAILED) && s->kind != SPECTRUM_KIND_CALIBRATION &&
+           s->kind != SPECTRUM_KIND_AMBIENT;
+}
+
+static void send_spectrum(const spectrum_t *s)
+{
+    wire_format_t format = wire_format;
+
+    if (s->kind == SPECTRUM_KIND_CALIBRATION) {
+        // Spectra already batched were taken with the previous scales
+        batch_flush();
+        send_calibration(s);
+        return;
+    }
+
+    // Keep the stream in order: anything else goes out after the pending batch
+    if (format == WIRE_JSON || s->kind != SPECTRUM_KIND_STREAM ||
+        (s->flags & SPECTRUM_FLAG_FAILED)) {
+        batch_flush();
+    }
+
+    if (s->flags & SPECTRUM_FLAG_FAILED) {
+        send_status("Sensor measurement failed");
+        return;
+    }
+
+    // Frames have no room for the statistics, so those spectra go as JSON
+    if (format != WIRE_JSON && !(s->flags & SPECTRUM_FLAG_STATS)) {
+        if (s->kind == SPECTRUM_KIND_STREAM) {
+            batch_add(s, format);
+        } else {
+            send_spectra_bin(s, 1, format);
+        }
+        return;
+    }
 
-        vTaskDelay(5000 / portTICK_PERIOD_MS);
+    int64_t start_us = esp_timer_get_time();
+    json_writer_t w;
+    json_writer_init(&w, sensor_json, sizeof(sensor_json));
+    json_begin_object(&w);
+    json_key(&w, "type");
+    json_string(&w, "sensor");
+    if (s->kind == SPECTRUM_KIND_STREAM) {
+        json_key(&w, "mode");
+        json_string(&w, "debug");
+    }
+    // Enough for the relay to calibrate the counts
+    if (s->flags & SPECTRUM_FLAG_RAW) {
+        json_key(&w, "raw");
+        json_bool(&w, true);
+        json_key(&w, "device_id");
+        json_number(&w, device_id);
+        json_key(&w, "gain");
+        json_number(&w, s->gain);
+        json_key(&w, "integration_cycles");
+        json_number(&w, s->integration_cycles);
+    }
+    if (s->flags & SPECTRUM_FLAG_REFLECTANCE) {
+        json_key(&w, "reflectance");
+        json_bool(&w, true);
+    }
+    if (s->kind == SPECTRUM_KIND_AMBIENT) {
+        json_key(&w, "ambient");
+        json_bool(&w, true);
+    } else if (s->flags & SPECTRUM_FLAG_CORRECTED) {
+        json_key(&w, "ambient_corrected");
+        json_bool(&w, true);
+    }
+    // Acquisition time, as in frames: UTC when the clock was synced
+    json_key(&w, "seq");
+    json_number(&w, s->seq);
+    json_key(&w, "timestamp_us");
+    json_number(&w, (double)frame_sample_us(s));
+    if (s->wall_us != 0) {
+        json_key(&w, "utc");
+        json_bool(&w, true);
+    }
+    // Channels that were not read are null
+    if (s->channel_mask != 0 && s->channel_mask != AS7265X_ALL_CHANNELS) {
+        json_key(&w, "channel_mask");
+        json_number(&w, s->channel_mask);
+    }
+    json_key(&w, "readings");
+    json_begin_array(&w);
+    for (int i = 0; i < AS7265X_NUM_CHANNELS; i++) {
+        json_number(&w, s->ch[i]);
+    }
+    json_end_array(&w);
+    if (s->flags & SPECTRUM_FLAG_COLOR) {
+        json_key(&w, "xyz");
+        json_begin_array(&w);
+        for (int k = 0; k < 3; k++) json_number(&w, s->xyz[k]);
+        json_end_array(&w);
+        json_key(&w, "lab");
+        json_begin_array(&w);
+        for (int k = 0; k < 3; k++) json_number(&w, s->lab[k]);
+        json_end_array(&w);
+        json_key(&w, "ita");
+        json_number(&w, unitcal_ita(s->lab));
+    }
+    if (s->flags & SPECTRUM_FLAG_STATS) {
+        json_key(&w, "std");
+        json_begin_array(&w);
+        for (int i = 0; i < AS7265X_NUM_CHANNELS; i++) {
+            json_number(&w, s->std[i]);
+        }
+        json_end_array(&w);
+        json_key(&w, "n");
+        json_begin_array(&w);
+        for (int i = 0; i < AS7265X_NUM_CHANNELS; i++) {
+            json_number(&w, s->n[i]);
+        }
+        json_end_array(&w);
+    }
+    json_end_object(&w);
+
+    const char *json = json_writer_finish(&w);
+    record_encode(start_us);
+    if (!json) {
+        ESP_LOGE(TAG, "Sensor message does not fit in %d bytes", WS_SENSOR_JSON_SIZE);
+    } else if (!ws_send(false, json, w.len) && loggable(s)) {
+        speclog_append(s);
     }
 }
 
@@ -132,66 +809,138 @@ void send_status(const char *message)
 {
     if (!esp_websocket_client_is_connected(client)) return;
 
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "type", "status");
-    cJSON_AddStringToObject(root, "message", message);
+    // On the caller's stack: status messages come from more than one task
+    char buf[WS_STATUS_JSON_SIZE];
+    json_writer_t w;
+
+    json_writer_init(&w, buf, sizeof(buf));
+    json_begin_object(&w);
+    json_key(&w, "type");
+    json_string(&w, "status");
+    json_key(&w, "message");
+    json_string(&w, message);
+    json_end_object(&w);
 
-    char *json = cJSON_PrintUnformatted(root);
+    const char *json = json_writer_finish(&w);
     if (json) {
-        esp_websocket_client_send_text(client, json, strlen(json), portMAX_DELAY);
-        free(json);
+        ws_send(false, json, w.len);
+    } else {
+        ESP_LOGE(TAG, "Status message too long: %s", message);
     }
-    cJSON_Delete(root);
 }
 
-void debug_task(void *pvParameters)
+bool websocket_send_json(const char *json, size_t len)
 {
+    if (!websocket_is_connected()) return false;
+    return ws_send(false, json, len);
+}
+
+// Consumer end of the sampler ring: drains spectra to the network
+static void sender_task(void *pvParameters)
+{
+    spectrum_t s;
+    char status[SAMPLER_STATUS_MAX];
+    TickType_t replay_wait = portMAX_DELAY;
+
     while (1)
     {
-        if (debug_enabled && esp_websocket_client_is_connected(client))
+        TickType_t wait = batch_wait_ticks();
+
+        if (replay_wait < wait) wait = replay_wait;
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        while (sampler_pop(&s))
         {
-            float ch[18];
-            int idx = 0;
-
-            for (uint8_t dev = 0; dev < 3; dev++)
-            {
-                as7265x_set_device(dev);
-                for (uint8_t base = 0x14; base < 0x2C; base += 4)
-                {
-                    if (as7265x_read_calibrated_value(base, &ch[idx]) != ESP_OK)
-                    {
-                        ch[idx] = 0.0f; // fallback
-                    }
-                    idx++;
-                }
+            // Offline: keep the spectra in flash until the link is back
+            if (!esp_websocket_client_is_connected(client)) {
+                batch_flush();
+                if (loggable(&s)) speclog_append(&s);
+                continue;
             }
+            send_spectrum(&s);
+        }
+        while (sampler_pop_status(status))
+        {
+            send_status(status);
+        }
 
-            cJSON *root = cJSON_CreateObject();
-            cJSON_AddStringToObject(root, "type", "sensor");
-            cJSON_AddStringToObject(root, "mode", "debug");
+        // Full batches went out in send_spectrum(); this sends the ones whose
+        // time is up, or that a smaller set_batch size made full
+        if (batch_len >= batch_size || batch_wait_ticks() == 0) batch_flush();
 
-            cJSON *arr = cJSON_CreateArray();
-            for (int i = 0; i < 18; i++)
-            {
-                cJSON_AddItemToArray(arr, cJSON_CreateNumber(ch[i]));
-            }
-            cJSON_AddItemToObject(root, "readings", arr);
+        replay_wait = replay_step();
+    }
+}
 
-            char *json = cJSON_PrintUnformatted(root);
-            if (json)
-            {
-                esp_websocket_client_send_text(client, json, strlen(json), portMAX_DELAY);
-                free(json);
-            }
-            cJSON_Delete(root);
-        }
+bool websocket_is_connected(void)
+{
+    return client && esp_websocket_client_is_connected(client);
+}
 
-        vTaskDelay(pdMS_TO_TICKS(500));
+void websocket_stop(void)
+{
+    if (!client) return;
+    if (esp_websocket_client_is_connected(client)) {
+        esp_websocket_client_close(client, pdMS_TO_TICKS(CONFIG_WS_SEND_TIMEOUT_MS));
+    } else {
+        esp_websocket_client_stop(client);
     }
 }
 
+void websocket_get_stats(websocket_stats_t *out)
+{
+    out->queue_depth = sampler_queue_depth();
+    out->queue_max_depth = sampler_queue_max_depth();
+    out->queue_dropped = sampler_dropped();
+    out->offline_pending = speclog_pending();
+    out->offline_dropped = speclog_dropped();
+
+    portENTER_CRITICAL(&stats_lock);
+    out->sends = sends;
+    out->send_failures = send_failures;
+    out->encode_latency = encode_latency;
+    out->send_latency = send_latency;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+static void start_client(void)
+{
+    bool start;
+
+    portENTER_CRITICAL(&start_lock);
+    start = !client_started;
+    client_started = true;
+    portEXIT_CRITICAL(&start_lock);
+
+    if (start) esp_websocket_client_start(client);
+}
+
+static void got_ip_handler(void *arg, esp_event_base_t base, int32_t id, void *data)
+{
+    start_client();
+}
+
 void websocket_start(void)
 {
+    uint8_t mac[6];
+
+#if CONFIG_JSON_WRITER_SELF_TEST
+    if (!json_writer_self_test()) {
+        ESP_LOGE(TAG, "JSON writer self test failed");
+    }
+#endif
+
+    // Every action must resolve: a table that drops commands stops the boot
+    // rather than answering them all with "Unknown command"
+    if (cmd_table_init(&command_table, commands, sizeof(commands) / sizeof(commands[0])) != ESP_OK) {
+        ESP_LOGW(TAG, "No collision-free hash for the command table, searching it linearly");
+    }
+    ESP_ERROR_CHECK(cmd_table_self_test(&command_table) ? ESP_OK : ESP_FAIL);
+
+    if (esp_efuse_mac_get_default(mac) == ESP_OK) {
+        device_id = (mac[4] << 8) | mac[5];
+    }
+
     esp_websocket_client_config_t cfg = {
         .uri = WS_URI,
         .reconnect_timeout_ms = 5000
@@ -201,13 +950,13 @@ void websocket_start(void)
     esp_websocket_register_events(client, WEBSOCKET_EVENT_ANY,
                                   websocket_event_handler, NULL);
 
-    esp_websocket_client_start(client);
-
-    if (debug_task_handle == NULL)
+    if (sender_task_handle == NULL)
     {
-        xTaskCreate(debug_task, "debug_task", 4096, NULL, 5, &debug_task_handle);
+        xTaskCreate(sender_task, "ws_sender", 4096, NULL, 5, &sender_task_handle);
+        sampler_set_consumer(sender_task_handle);
     }
 
-    xTaskCreate(sensor_task, "sensor_task", 4096, NULL, 5, NULL);
-
+    // Later reconnects are the client's own business
+    esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, got_ip_handler, NULL, NULL);
+    if (xEventGroupGetBits(wifi_event_group) & WIFI_CONNECTED_BIT) start_client();
 }
@@ -1,5 +1,29 @@
 #pragma once
 
+#include "histogram.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint32_t queue_depth;       // spectra waiting between sampler and sender
+    uint32_t queue_max_depth;
+    uint32_t queue_dropped;     // discarded by the queue's drop policy
+    uint32_t offline_pending;   // spectra in the offline log waiting for replay
+    uint32_t offline_dropped;   // overwritten in the offline log before replay
+    uint32_t sends;
+    uint32_t send_failures;     // timed out or rejected by the client
+    histogram_t encode_latency; // us to serialize one message or frame
+    histogram_t send_latency;   // us per send call
+} websocket_stats_t;
+
 void websocket_start(void);
-void send_sensor_data(void);
+bool websocket_is_connected(void);
+// Closes the connection cleanly so everything sent is delivered, e.g.
+// before deep sleep. The client does not reconnect afterwards.
+void websocket_stop(void);
 void send_status(const char *message);
+// Sends a complete JSON message from any task. Returns false if not
+// connected or the send failed.
+bool websocket_send_json(const char *json, size_t len);
+void websocket_get_stats(websocket_stats_t *out);
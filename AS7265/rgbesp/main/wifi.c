@@ -1,42 +1,259 @@
 #include "wifi.h"
+#include "boot.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "sdkconfig.h"
 #include "freertos/event_groups.h"
+#include <string.h>
 
 #define WIFI_SSID "Internetas"
 #define WIFI_PASS "12345678"
 
+// Last AP and lease, kept for a directed connect on the next boot
+#define WIFI_NVS_NAMESPACE "wifi"
+#define WIFI_NVS_KEY "fast"
+#define WIFI_FAST_VERSION 1
+
+// Bool options are undefined when off
+#if CONFIG_WIFI_FAST_CONNECT
+#define FAST_CONNECT true
+#else
+#define FAST_CONNECT false
+#endif
+#if CONFIG_WIFI_FAST_STATIC_IP
+#define FAST_STATIC_IP true
+#else
+#define FAST_STATIC_IP false
+#endif
+
+typedef struct {
+    uint8_t version;
+    uint8_t channel;
+    uint8_t bssid[6];
+    uint32_t ssid_crc;      // a cache for another network is ignored
+    uint32_t ip;            // network byte order as in esp_ip4_addr_t; 0 if none
+    uint32_t netmask;
+    uint32_t gw;
+    uint32_t dns;
+} wifi_fast_t;
+
 static const char *TAG = "WIFI";
 
 EventGroupHandle_t wifi_event_group;
 const int WIFI_CONNECTED_BIT = BIT0;
 
+// Updated on the event loop task
+static volatile uint32_t disconnects = 0;
+static volatile uint32_t connects = 0;
+static volatile uint32_t connect_ms = 0;
+static volatile uint32_t boot_connect_ms = 0;
+static volatile bool fast_connected = false;
+
+// Event loop task only
+static esp_netif_t *sta_netif = NULL;
+static esp_timer_handle_t retry_timer = NULL;
+static wifi_fast_t cache;
+static bool cache_valid = false;
+static bool fast_attempt = false;   // current attempt targets the cached AP
+static bool static_ip = false;      // DHCP is stopped and the cached lease is in use
+static uint32_t failures = 0;       // full-scan attempts since the last connect
+static int64_t outage_start_us = 0;
+
+static uint32_t ssid_crc(void)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)WIFI_SSID, strlen(WIFI_SSID));
+}
+
+static void load_cache(void)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(cache);
+
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) return;
+    cache_valid = nvs_get_blob(nvs, WIFI_NVS_KEY, &cache, &len) == ESP_OK &&
+                  len == sizeof(cache) && cache.version == WIFI_FAST_VERSION &&
+                  cache.ssid_crc == ssid_crc() && cache.channel != 0;
+    nvs_close(nvs);
+}
+
+// Only written when something changed, so reconnects to the same AP
+// with the same lease cost no flash writes
+static void save_cache(const esp_netif_ip_info_t *ip)
+{
+    wifi_ap_record_t ap;
+    esp_netif_dns_info_t dns = { 0 };
+    wifi_fast_t next = { 0 };
+    nvs_handle_t nvs;
+
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) return;
+    esp_netif_get_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dns);
+
+    next.version = WIFI_FAST_VERSION;
+    next.channel = ap.primary;
+    memcpy(next.bssid, ap.bssid, sizeof(next.bssid));
+    next.ssid_crc = ssid_crc();
+    next.ip = ip->ip.addr;
+    next.netmask = ip->netmask.addr;
+    next.gw = ip->gw.addr;
+    next.dns = dns.ip.u_addr.ip4.addr;
+
+    if (cache_valid && memcmp(&next, &cache, sizeof(next)) == 0) return;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return;
+    if (nvs_set_blob(nvs, WIFI_NVS_KEY, &next, sizeof(next)) == ESP_OK && nvs_commit(nvs) == ESP_OK) {
+        cache = next;
+        cache_valid = true;
+    }
+    nvs_close(nvs);
+}
+
+static void use_static_ip(bool on)
+{
+    if (on == static_ip) return;
+
+    if (on) {
+        esp_netif_ip_info_t ip = {
+            .ip.addr = cache.ip,
+            .netmask.addr = cache.netmask,
+            .gw.addr = cache.gw,
+        };
+        esp_netif_dns_info_t dns = { .ip.u_addr.ip4.addr = cache.dns, .ip.type = ESP_IPADDR_TYPE_V4 };
+
+        if (esp_netif_dhcpc_stop(sta_netif) != ESP_OK) return;
+        esp_netif_set_ip_info(sta_netif, &ip);
+        if (cache.dns) esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &dns);
+    } else {
+        esp_netif_dhcpc_start(sta_netif);
+    }
+    static_ip = on;
+}
+
+// A directed connect goes straight to the cached BSSID on its channel; the
+// fallback is the usual scan of every channel for the SSID
+static void configure(bool fast)
+{
+    wifi_config_t wifi_config = {
+        .sta = {
+            .ssid = WIFI_SSID,
+            .password = WIFI_PASS,
+            .threshold.authmode = WIFI_AUTH_WPA2_PSK,
+        },
+    };
+
+    fast_attempt = fast;
+    if (fast) {
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, cache.bssid, sizeof(cache.bssid));
+        wifi_config.sta.channel = cache.channel;
+    }
+    use_static_ip(fast && FAST_STATIC_IP && cache.ip != 0);
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+}
+
+static void retry_cb(void *arg)
+{
+    esp_wifi_connect();
+}
+
+// Exponential backoff with equal jitter: half the delay is fixed, the other
+// half random, so devices that lost the same AP do not retry in lockstep
+static uint32_t backoff_ms(void)
+{
+    uint32_t shift = failures < 16 ? failures : 16;
+    uint64_t delay = (uint64_t)CONFIG_WIFI_BACKOFF_MIN_MS << shift;
+
+    if (delay > CONFIG_WIFI_BACKOFF_MAX_MS) delay = CONFIG_WIFI_BACKOFF_MAX_MS;
+    failures++;
+    return delay / 2 + esp_random() % (delay / 2 + 1);
+}
+
+static void on_disconnected(const wifi_event_sta_disconnected_t *event)
+{
+    bool was_connected = xEventGroupGetBits(wifi_event_group) & WIFI_CONNECTED_BIT;
+
+    disconnects++;
+    xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
+
+    // A new outage gets one directed attempt before scanning
+    if (was_connected) {
+        outage_start_us = esp_timer_get_time();
+        failures = 0;
+        if (FAST_CONNECT && cache_valid) {
+            ESP_LOGI(TAG, "WiFi disconnected (reason %d), reconnecting to the last AP", event->reason);
+            configure(true);
+            esp_wifi_connect();
+            return;
+        }
+    }
+
+    if (fast_attempt) {
+        ESP_LOGW(TAG, "Directed connect failed (reason %d), scanning", event->reason);
+        configure(false);
+        esp_wifi_connect();
+        return;
+    }
+
+    uint32_t delay = backoff_ms();
+    ESP_LOGI(TAG, "WiFi disconnected (reason %d), retry %lu in %lu ms",
+             event->reason, (unsigned long)failures, (unsigned long)delay);
+    esp_timer_stop(retry_timer);
+    esp_timer_start_once(retry_timer, (uint64_t)delay * 1000);
+}
+
+static void on_got_ip(const ip_event_got_ip_t *event)
+{
+    int64_t now = esp_timer_get_time();
+
+    connect_ms = (now - outage_start_us) / 1000;
+    fast_connected = fast_attempt;
+    if (connects++ == 0) boot_connect_ms = now / 1000;
+    boot_mark(BOOT_WIFI_IP);
+    failures = 0;
+
+    ESP_LOGI(TAG, "Got IP in %lu ms (%s%s), %lu ms after boot",
+             (unsigned long)connect_ms, fast_attempt ? "directed" : "scan",
+             static_ip ? ", cached lease" : "", (unsigned long)(now / 1000));
+
+    // A lease from DHCP is the one to remember; ours is already cached
+    if (!static_ip) save_cache(&event->ip_info);
+    xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
+}
+
 static void wifi_event_handler(void* arg, esp_event_base_t event_base,
                                int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        ESP_LOGI(TAG, "WiFi disconnected, reconnecting...");
-        esp_wifi_connect();
-        xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        on_disconnected(event_data);
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
+        on_got_ip(event_data);
     }
 }
 
 void wifi_init_sta(void)
 {
     wifi_event_group = xEventGroupCreate();
+    outage_start_us = esp_timer_get_time();
 
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    sta_netif = esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
+    esp_timer_create_args_t retry_args = {
+        .callback = retry_cb,
+        .name = "wifi_retry",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&retry_args, &retry_timer));
+
     esp_event_handler_instance_t instance_any_id;
     esp_event_handler_instance_t instance_got_ip;
 
@@ -52,17 +269,25 @@ void wifi_init_sta(void)
                                                         NULL,
                                                         &instance_got_ip));
 
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = WIFI_SSID,
-            .password = WIFI_PASS,
-            .threshold.authmode = WIFI_AUTH_WPA2_PSK,
-        },
-    };
+    load_cache();
 
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+    configure(FAST_CONNECT && cache_valid);
     ESP_ERROR_CHECK(esp_wifi_start());
 
-    ESP_LOGI(TAG, "WiFi initialized");
+    ESP_LOGI(TAG, "WiFi initialized%s", fast_attempt ? ", trying the last AP first" : "");
+}
+
+void wifi_get_stats(wifi_stats_t *out)
+{
+    wifi_ap_record_t ap;
+    uint32_t n = connects;
+
+    out->connected = (xEventGroupGetBits(wifi_event_group) & WIFI_CONNECTED_BIT) != 0;
+    out->rssi = out->connected && esp_wifi_sta_get_ap_info(&ap) == ESP_OK ? ap.rssi : 0;
+    out->disconnects = disconnects;
+    out->reconnects = n > 0 ? n - 1 : 0;
+    out->connect_ms = connect_ms;
+    out->boot_connect_ms = boot_connect_ms;
+    out->fast = fast_connected;
 }
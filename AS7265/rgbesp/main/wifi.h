@@ -2,7 +2,24 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include <stdbool.h>
+#include <stdint.h>
 
+typedef struct {
+    bool connected;
+    int8_t rssi;                // dBm of the current AP, 0 when not connected
+    uint32_t disconnects;       // disconnect events, including failed attempts
+    uint32_t reconnects;        // times an IP was got back after the first
+    uint32_t connect_ms;        // start of the last boot or outage until its IP
+    uint32_t boot_connect_ms;   // boot until the first IP
+    bool fast;                  // the last connect was a directed one to the cached AP
+} wifi_stats_t;
+
+// Connects to the AP used last time first (CONFIG_WIFI_FAST_CONNECT): its
+// BSSID, channel and lease are kept in NVS. If that fails, or the AP is
+// lost later, it falls back to scanning every channel with exponential
+// backoff and jitter between attempts.
 void wifi_init_sta(void);
 extern EventGroupHandle_t wifi_event_group;
 extern const int WIFI_CONNECTED_BIT;
+void wifi_get_stats(wifi_stats_t *out);
@@ -0,0 +1,230 @@
+// Host test of the offline spectrum log against an emulated NOR partition:
+// append, replay, replay across a reboot, wrap-around and damaged records.
+//
+// Run from AS7265/rgbesp/test with: make
+
+#include "speclog.h"
+#include "esp_partition.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FLASH_SECTORS 4
+#define FLASH_SECTOR_SIZE 4096
+
+// Layout of speclog.c: a 16-byte sector header, then crc and sent words
+// ahead of each spectrum
+#define RECORD_SIZE (2 * sizeof(uint32_t) + sizeof(spectrum_t))
+#define SLOTS ((FLASH_SECTOR_SIZE - 16) / RECORD_SIZE)
+#define CAPACITY (FLASH_SECTORS * SLOTS)
+
+static uint8_t flash[FLASH_SECTORS * FLASH_SECTOR_SIZE];
+static bool partition_present = true;
+static unsigned nor_violations = 0;     // writes that would set a cleared bit
+static unsigned failures = 0;
+
+static const esp_partition_t partition = {
+    .type = ESP_PARTITION_TYPE_DATA,
+    .subtype = ESP_PARTITION_SUBTYPE_ANY,
+    .size = sizeof(flash),
+    .erase_size = FLASH_SECTOR_SIZE,
+    .label = "speclog",
+};
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label)
+{
+    return partition_present && strcmp(label, partition.label) == 0 ? &partition : NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t size)
+{
+    if (offset + size > sizeof(flash)) return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, &flash[offset], size);
+    return ESP_OK;
+}
+
+// NOR programming only clears bits; anything else needs an erase first
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t size)
+{
+    const uint8_t *p = src;
+
+    if (offset + size > sizeof(flash)) return ESP_ERR_INVALID_SIZE;
+    for (size_t i = 0; i < size; i++) {
+        if (p[i] & ~flash[offset + i]) nor_violations++;
+        flash[offset + i] &= p[i];
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset, size_t size)
+{
+    if (offset % FLASH_SECTOR_SIZE || size % FLASH_SECTOR_SIZE || offset + size > sizeof(flash)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(&flash[offset], 0xFF, size);
+    return ESP_OK;
+}
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static void format(void)
+{
+    memset(flash, 0xFF, sizeof(flash));
+    CHECK(speclog_init() == ESP_OK);
+}
+
+static spectrum_t make_spectrum(uint32_t seq)
+{
+    spectrum_t s;
+
+    memset(&s, 0, sizeof(s));
+    s.seq = seq;
+    s.timestamp_us = 1000 * (int64_t)seq;
+    s.channel_mask = AS7265X_ALL_CHANNELS;
+    for (int c = 0; c < AS7265X_NUM_CHANNELS; c++) s.ch[c] = seq + c * 0.5f;
+    return s;
+}
+
+static void append(uint32_t first, uint32_t count)
+{
+    for (uint32_t seq = first; seq < first + count; seq++) {
+        spectrum_t s = make_spectrum(seq);
+        CHECK(speclog_append(&s) == ESP_OK);
+    }
+}
+
+// Replays up to count spectra in peeks of at most chunk and checks they
+// come out in order from first; returns how many were replayed
+static uint32_t replay(uint32_t first, uint32_t count, size_t chunk)
+{
+    spectrum_t out[SPECLOG_PEEK_MAX];
+    uint32_t done = 0;
+
+    while (done < count) {
+        size_t n = speclog_peek(out, chunk);
+
+        if (n == 0) break;
+        if (n > count - done) n = count - done;
+        for (size_t i = 0; i < n; i++) {
+            spectrum_t want = make_spectrum(first + done + i);
+            CHECK(memcmp(&out[i], &want, sizeof(want)) == 0);
+        }
+        CHECK(speclog_consume(n) == ESP_OK);
+        done += n;
+    }
+    return done;
+}
+
+static void test_missing_partition(void)
+{
+    spectrum_t s = make_spectrum(0), out[1];
+
+    partition_present = false;
+    CHECK(speclog_init() == ESP_ERR_NOT_FOUND);
+    CHECK(speclog_append(&s) == ESP_ERR_INVALID_STATE);
+    CHECK(speclog_peek(out, 1) == 0);
+    partition_present = true;
+}
+
+static void test_append_and_replay(void)
+{
+    format();
+    CHECK(speclog_pending() == 0);
+    append(0, 5);
+    CHECK(speclog_pending() == 5);
+
+    // Peeking twice without consuming returns the same spectra
+    CHECK(replay(0, 0, 3) == 0);
+    CHECK(replay(0, 2, 3) == 2);
+    CHECK(speclog_pending() == 3);
+    CHECK(replay(2, 3, 8) == 3);
+    CHECK(speclog_pending() == 0);
+}
+
+static void test_reboot_resumes(void)
+{
+    uint32_t total = SLOTS + SLOTS / 2;
+
+    format();
+    append(0, total);
+    CHECK(replay(0, SLOTS + 2, 7) == SLOTS + 2);
+
+    // A reboot finds the same pending records, and appends continue after them
+    CHECK(speclog_init() == ESP_OK);
+    CHECK(speclog_pending() == total - (SLOTS + 2));
+    append(total, 3);
+    CHECK(speclog_pending() == total + 3 - (SLOTS + 2));
+    CHECK(replay(SLOTS + 2, total + 3 - (SLOTS + 2), SPECLOG_PEEK_MAX) == total + 3 - (SLOTS + 2));
+    CHECK(speclog_pending() == 0);
+
+    // Fully replayed, the log stays empty across a reboot
+    CHECK(speclog_init() == ESP_OK);
+    CHECK(speclog_pending() == 0);
+}
+
+static void test_wrap_drops_oldest(void)
+{
+    uint32_t dropped = speclog_dropped();
+    uint32_t total = CAPACITY + SLOTS + 5;
+
+    format();
+    append(0, total);
+    // Two sectors were reused, each losing its records
+    CHECK(speclog_dropped() - dropped == 2 * SLOTS);
+    CHECK(speclog_pending() == total - 2 * SLOTS);
+
+    CHECK(speclog_init() == ESP_OK);
+    CHECK(speclog_pending() == total - 2 * SLOTS);
+    CHECK(replay(2 * SLOTS, total - 2 * SLOTS, SPECLOG_PEEK_MAX) == total - 2 * SLOTS);
+    CHECK(speclog_pending() == 0);
+}
+
+// Clears bits in the spectrum of a record, as a torn write would
+static void damage(uint32_t sector, uint32_t slot)
+{
+    flash[sector * FLASH_SECTOR_SIZE + 16 + slot * RECORD_SIZE + 2 * sizeof(uint32_t) +
+          offsetof(spectrum_t, channel_mask)] = 0;
+}
+
+static void test_damaged_records(void)
+{
+    spectrum_t out[SPECLOG_PEEK_MAX];
+    size_t n;
+
+    format();
+    append(0, 5);
+    damage(0, 2);
+    n = speclog_peek(out, SPECLOG_PEEK_MAX);
+    CHECK(n == 4);
+    CHECK(n == 4 && out[1].seq == 1 && out[2].seq == 3 && out[3].seq == 4);
+    CHECK(speclog_consume(n) == ESP_OK);
+    CHECK(speclog_pending() == 0);
+
+    // Only damaged records in reach: the peek steps over them
+    append(5, 2);
+    damage(0, 5);
+    damage(0, 6);
+    CHECK(speclog_peek(out, SPECLOG_PEEK_MAX) == 0);
+    CHECK(speclog_pending() == 0);
+    append(7, 1);
+    CHECK(replay(7, 1, 4) == 1);
+}
+
+int main(void)
+{
+    test_missing_partition();
+    test_append_and_replay();
+    test_reboot_resumes();
+    test_wrap_drops_oldest();
+    test_damaged_records();
+
+    CHECK(nor_violations == 0);
+    printf("speclog: %u slots per sector, %s\n", (unsigned)SLOTS, failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+"""Calibration of raw-count spectra from devices in raw readout mode
+
+A device in raw readout sends ADC counts plus the gain and integration
+cycles they were taken with. Before the counts it sends a `calibration`
+message with the sensor's own scale (calibrated units per count) for every
+channel, learned at one gain and integration time. Counts taken at other
+settings are scaled by the nominal gain and integration time ratios.
+"""
+from typing import Any, Dict, List, Optional, Tuple
+
+from .frames import NUM_CHANNELS
+
+# Nominal amplification of each CONFIG register gain setting
+GAIN_FACTORS = {0: 1.0, 1: 3.7, 2: 16.0, 3: 64.0}
+
+
+class UnitCalibration:
+    """Scales of one device, as learned at one gain and integration time"""
+
+    def __init__(self, scale: List[float], gain: int, integration_cycles: int):
+        self.scale = scale
+        self.gain = gain
+        self.integration_cycles = integration_cycles
+        # Scales for other settings, computed once per setting
+        self._scaled: Dict[Tuple[int, int], List[float]] = {}
+
+    def scales_for(self, gain: int, integration_cycles: int) -> Optional[List[float]]:
+        key = (gain, integration_cycles)
+        if key not in self._scaled:
+            if gain not in GAIN_FACTORS or integration_cycles <= 0:
+                return None
+            factor = (GAIN_FACTORS[self.gain] / GAIN_FACTORS[gain] *
+                      self.integration_cycles / integration_cycles)
+            self._scaled[key] = [s * factor for s in self.scale]
+        return self._scaled[key]
+
+
+class Calibrations:
+    """Latest calibration of every device, by device id"""
+
+    def __init__(self):
+        self.units: Dict[int, UnitCalibration] = {}
+
+    def update(self, data: Dict[str, Any]) -> bool:
+        """Store the scales from a `calibration` message; False if it is malformed"""
+        device_id = data.get("device_id")
+        scale = data.get("scale")
+        gain = data.get("gain")
+        cycles = data.get("integration_cycles")
+
+        if not isinstance(device_id, int) or gain not in GAIN_FACTORS:
+            return False
+        if not isinstance(cycles, int) or cycles <= 0:
+            return False
+        if (not isinstance(scale, list) or len(scale) != NUM_CHANNELS or
+                not all(isinstance(s, (int, float)) and not isinstance(s, bool) for s in scale)):
+            return False
+
+        self.units[device_id] = UnitCalibration([float(s) for s in scale], gain, cycles)
+        return True
+
+    def apply(self, device_id: int, readings_list: List[List[Optional[float]]], gain: int,
+              integration_cycles: int) -> bool:
+        """
+        Calibrate raw readings in place. One frame's samples share their
+        settings, so the scales are looked up once for all of them.
+
+        Returns:
+            False if there is no usable calibration for the device; the
+            readings are then left as counts
+        """
+        unit = self.units.get(device_id)
+        scales = unit.scales_for(gain, integration_cycles) if unit else None
+        if scales is None:
+            return False
+
+        for readings in readings_list:
+            for ch, (value, s) in enumerate(zip(readings, scales)):
+                if value is not None:
+                    readings[ch] = value * s
+        return True
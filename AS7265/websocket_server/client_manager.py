@@ -1,6 +1,6 @@
 """Client connection manager for WebSocket server"""
 import logging
-from typing import Set
+from typing import Dict, List, Set
 import websockets
 from datetime import datetime
 
@@ -12,6 +12,8 @@ class ClientManager:
     
     def __init__(self):
         self.clients: Set[websockets.WebSocketServerProtocol] = set()
+        # Binary frame formats each client announced it can decode
+        self.frame_formats: Dict[websockets.WebSocketServerProtocol, Set[str]] = {}
     
     def add_client(self, websocket: websockets.WebSocketServerProtocol) -> None:
         """Add a client to the connection pool"""
@@ -21,11 +23,19 @@ class ClientManager:
     
     def remove_client(self, websocket: websockets.WebSocketServerProtocol) -> None:
         """Remove a client from the connection pool"""
+        self.frame_formats.pop(websocket, None)
         if websocket in self.clients:
             self.clients.remove(websocket)
             client_ip = websocket.remote_address[0] if websocket.remote_address else "unknown"
             logger.info(f"Client disconnected: {client_ip} (Total: {len(self.clients)})")
     
+    def set_frame_formats(self, websocket: websockets.WebSocketServerProtocol, formats: Set[str]) -> None:
+        """Record which binary spectrum frame formats a client accepts"""
+        if formats:
+            self.frame_formats[websocket] = set(formats)
+        else:
+            self.frame_formats.pop(websocket, None)
+    
     def get_client_count(self) -> int:
         """Get the number of connected clients"""
         return len(self.clients)
@@ -58,6 +68,41 @@ class ClientManager:
         for client in disconnected:
             self.remove_client(client)
     
+    async def broadcast_frame(self, frame: bytes, frame_format: str, messages: List[dict],
+                              sender: websockets.WebSocketServerProtocol = None) -> None:
+        """
+        Broadcast a binary frame: forwarded as-is to clients that accept its
+        format, sent as the equivalent JSON messages to everyone else
+        
+        Args:
+            frame: Raw binary frame
+            frame_format: Format name of the frame's encoding (e.g. "bin1")
+            messages: The frame decoded into JSON-compatible sensor messages
+            sender: Optional sender websocket to exclude from broadcast
+        """
+        if not self.clients:
+            return
+        
+        import json
+        encoded = [json.dumps(message) for message in messages]
+        disconnected = set()
+        
+        for client in self.clients:
+            if client == sender:
+                continue
+            try:
+                if frame_format in self.frame_formats.get(client, ()):
+                    await client.send(frame)
+                else:
+                    for message in encoded:
+                        await client.send(message)
+            except Exception as e:
+                logger.warning(f"Failed to send to client: {e}")
+                disconnected.add(client)
+        
+        for client in disconnected:
+            self.remove_client(client)
+    
     def get_all_clients(self) -> Set[websockets.WebSocketServerProtocol]:
         """Get all connected clients"""
         return self.clients.copy()
@@ -1,6 +1,6 @@
 """Configuration module for WebSocket server"""
 import os
-from typing import List
+from typing import Any, Dict, List
 
 
 class Config:
@@ -18,9 +18,46 @@ class Config:
     ALLOWED_COMMANDS: List[str] = [
         "read_sensor",
         "debug_on",
-        "debug_off"
+        "debug_off",
+        "set_batch",
+        "set_interval",
+        "set_rate",
+        "set_readout",
+        "set_oversample",
+        "set_channels",
+        "bulb_on",
+        "bulb_off",
+        "set_scan",
+        "calibrate",
+        "set_i2c_clock"
     ]
     
+    # Parameters forwarded with a command, by name and expected type (or
+    # tuple of types); anything else in a command message is dropped
+    COMMAND_PARAMS: Dict[str, Dict[str, Any]] = {
+        "set_batch": {"size": int, "max_ms": int},
+        "set_interval": {"interval_ms": (int, float)},
+        "set_rate": {"rate_hz": (int, float)},
+        "set_readout": {"mode": str},
+        "set_oversample": {"n": int, "method": str, "trim_pct": (int, float),
+                           "noise_target_pct": (int, float)},
+        "set_channels": {"mask": int, "preset": str},
+        "bulb_on": {"bulbs": int},
+        "bulb_off": {"bulbs": int},
+        "set_scan": {"ambient": bool, "bulbs": int},
+        "calibrate": {"reference": str},
+        "set_i2c_clock": {"hz": int},
+    }
+    
+    # Binary frame formats this relay can decode, in order of preference
+    FRAME_FORMATS: List[str] = ["bin1", "bin1_i16", "bin1_delta", "bin1_raw"]
+    # Format requested from devices that announce binary support ("json" to disable)
+    DEVICE_FORMAT: str = os.getenv("WS_DEVICE_FORMAT", "bin1")
+    # Quantization step for bin1_delta, in sensor units
+    DELTA_STEP: float = float(os.getenv("WS_DELTA_STEP", "0.1"))
+    # "raw" has devices that support it send ADC counts, calibrated here
+    DEVICE_READOUT: str = os.getenv("WS_DEVICE_READOUT", "calibrated")
+    
     # Logging
     LOG_LEVEL: str = os.getenv("WS_LOG_LEVEL", "INFO")
     
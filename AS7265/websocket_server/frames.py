@@ -0,0 +1,224 @@
+"""Decoder for the binary spectrum frames sent by the ESP32 firmware
+
+Layout (little-endian), see AS7265/rgbesp/main/frame.h:
+
+    u8 version, u8 type, u8 encoding, u8 flags,
+    u16 device_id, u16 count, u32 seq, u32 channel_mask,
+    u64 timestamp_us, f32 scale, u8 gain, u8 integration_cycles, u16 reserved
+
+followed by `count` samples of a u32 time offset (us) and one value per
+channel present in the mask.
+
+Delta frames (encoding 2) carry quantized values instead: `scale` is the
+quantization step. Each sample is a varint time offset from the previous
+sample, then per channel a zig-zag varint difference from the previous
+sample. A frame without the keyframe flag continues from the last sample of
+the frame with the preceding sequence number, so decoding needs a
+DeltaState per device.
+
+Frames with the raw flag carry ADC counts, as uint16 (encoding 3); see
+calibration.py. With the UTC flag, timestamps are microseconds since the
+epoch; otherwise they are device uptime.
+"""
+import struct
+from typing import Any, Dict, List, Optional, Tuple
+
+FRAME_VERSION = 1
+FRAME_TYPE_SPECTRUM = 1
+
+ENC_F32 = 0
+ENC_I16 = 1
+ENC_DELTA = 2
+ENC_U16 = 3
+
+FLAG_STREAM = 0x01
+FLAG_KEYFRAME = 0x02
+FLAG_REPLAY = 0x04
+FLAG_RAW = 0x08
+FLAG_REFLECTANCE = 0x10
+FLAG_UTC = 0x20
+
+NUM_CHANNELS = 18
+ALL_CHANNELS = (1 << NUM_CHANNELS) - 1
+
+HEADER = struct.Struct("<BBBBHHIIQfBBH")
+
+# Format names used in hello/set_format, by frame encoding
+ENCODING_FORMATS = {ENC_F32: "bin1", ENC_I16: "bin1_i16", ENC_DELTA: "bin1_delta",
+                    ENC_U16: "bin1_raw"}
+
+# Struct code and whether the header scale applies, by fixed-size encoding
+_FIXED_VALUES = {ENC_F32: ("f", False), ENC_I16: ("h", True), ENC_U16: ("H", True)}
+
+
+class FrameError(ValueError):
+    """Raised for frames that cannot be decoded"""
+
+
+class DeltaState:
+    """Decoder side of one device's delta chain"""
+
+    def __init__(self):
+        self.next_seq: Optional[int] = None
+        self.step: Optional[float] = None
+        self.prev: List[int] = [0] * NUM_CHANNELS
+
+
+def _channels(mask: int) -> List[int]:
+    return [ch for ch in range(NUM_CHANNELS) if mask & (1 << ch)]
+
+
+def _varint(data: bytes, offset: int) -> Tuple[int, int]:
+    value = 0
+    for shift in range(0, 35, 7):
+        if offset >= len(data):
+            raise FrameError("Frame truncated")
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7F) << shift
+        if not byte & 0x80:
+            return value & 0xFFFFFFFF, offset
+    raise FrameError("Varint too long")
+
+
+def _int32(value: int) -> int:
+    value &= 0xFFFFFFFF
+    return value - (1 << 32) if value & 0x80000000 else value
+
+
+def _decode_delta_samples(data: bytes, count: int, channels: List[int], seq: int,
+                          timestamp_us: int, step: float, keyframe: bool,
+                          state: Optional[DeltaState]) -> List[Dict[str, Any]]:
+    if state is None:
+        raise FrameError("Delta frame needs decoder state")
+    if keyframe:
+        state.prev = [0] * NUM_CHANNELS
+    elif state.next_seq != seq or state.step != step:
+        # Lost the chain; wait for the next keyframe
+        state.next_seq = None
+        raise FrameError(f"Delta frame {seq} without its predecessor")
+
+    samples = []
+    offset = HEADER.size
+    # Decode into a copy so a truncated frame leaves the chain untouched
+    prev = list(state.prev)
+    t = timestamp_us
+    for i in range(count):
+        dt_us, offset = _varint(data, offset)
+        t += dt_us
+
+        readings: List[Optional[float]] = [None] * NUM_CHANNELS
+        for ch in channels:
+            zz, offset = _varint(data, offset)
+            delta = (zz >> 1) ^ -(zz & 1)
+            prev[ch] = _int32(prev[ch] + delta)
+            readings[ch] = prev[ch] * step
+        samples.append({"seq": seq + i, "timestamp_us": t, "readings": readings})
+
+    state.prev = prev
+    state.step = step
+    state.next_seq = (seq + count) & 0xFFFFFFFF
+    return samples
+
+
+def _decode_fixed_samples(data: bytes, count: int, channels: List[int], seq: int,
+                          timestamp_us: int, scale: float, encoding: int) -> List[Dict[str, Any]]:
+    value_fmt, scaled = _FIXED_VALUES[encoding]
+    sample = struct.Struct("<I" + value_fmt * len(channels))
+    if len(data) < HEADER.size + count * sample.size:
+        raise FrameError("Frame truncated")
+
+    samples = []
+    offset = HEADER.size
+    for i in range(count):
+        dt_us, *values = sample.unpack_from(data, offset)
+        offset += sample.size
+
+        readings: List[Optional[float]] = [None] * NUM_CHANNELS
+        for ch, value in zip(channels, values):
+            readings[ch] = value * scale if scaled else value
+        samples.append({
+            "seq": seq + i,
+            "timestamp_us": timestamp_us + dt_us,
+            "readings": readings,
+        })
+    return samples
+
+
+def decode_frame(data: bytes, delta_state: Optional[DeltaState] = None) -> Dict[str, Any]:
+    """
+    Decode a binary spectrum frame
+
+    Args:
+        data: The raw frame
+        delta_state: The sending device's DeltaState; required for delta frames
+
+    Returns:
+        Dictionary with the header fields and a `samples` list, each sample
+        holding its own `seq`, `timestamp_us` and 18 `readings` (None for
+        channels not in the mask)
+    """
+    if len(data) < HEADER.size:
+        raise FrameError(f"Frame too short: {len(data)} bytes")
+
+    (version, frame_type, encoding, flags, device_id, count, seq, mask,
+     timestamp_us, scale, gain, integration_cycles, _) = HEADER.unpack_from(data)
+
+    if version != FRAME_VERSION:
+        raise FrameError(f"Unsupported frame version {version}")
+    if frame_type != FRAME_TYPE_SPECTRUM:
+        raise FrameError(f"Unsupported frame type {frame_type}")
+
+    channels = _channels(mask)
+
+    if encoding == ENC_DELTA:
+        samples = _decode_delta_samples(data, count, channels, seq, timestamp_us, scale,
+                                        bool(flags & FLAG_KEYFRAME), delta_state)
+    elif encoding in _FIXED_VALUES:
+        samples = _decode_fixed_samples(data, count, channels, seq, timestamp_us, scale,
+                                        encoding)
+    else:
+        raise FrameError(f"Unsupported encoding {encoding}")
+
+    return {
+        "version": version,
+        "encoding": encoding,
+        "stream": bool(flags & FLAG_STREAM),
+        "replay": bool(flags & FLAG_REPLAY),
+        "raw": bool(flags & FLAG_RAW),
+        "reflectance": bool(flags & FLAG_REFLECTANCE),
+        "utc": bool(flags & FLAG_UTC),
+        "device_id": device_id,
+        "channel_mask": mask,
+        "gain": gain,
+        "integration_cycles": integration_cycles,
+        "samples": samples,
+    }
+
+
+def frame_to_messages(frame: Dict[str, Any]) -> List[Dict[str, Any]]:
+    """Expand a decoded frame into the JSON sensor messages older clients expect"""
+    messages = []
+    for sample in frame["samples"]:
+        message = {"type": "sensor"}
+        if frame["stream"]:
+            message["mode"] = "debug"
+        if frame["replay"]:
+            message["replay"] = True
+        if frame["channel_mask"] != ALL_CHANNELS:
+            message["channel_mask"] = frame["channel_mask"]
+        if frame["raw"]:
+            # Counts the relay had no calibration for
+            message["raw"] = True
+            message["gain"] = frame["gain"]
+            message["integration_cycles"] = frame["integration_cycles"]
+        if frame["reflectance"]:
+            message["reflectance"] = True
+        message["readings"] = sample["readings"]
+        message["seq"] = sample["seq"]
+        message["timestamp_us"] = sample["timestamp_us"]
+        if frame["utc"]:
+            message["utc"] = True
+        message["device_id"] = frame["device_id"]
+        messages.append(message)
+    return messages
@@ -1,11 +1,14 @@
 """Message handler for processing WebSocket messages"""
 import json
 import logging
+import time
 from datetime import datetime
-from typing import Dict, Any
+from typing import Dict, Any, Union
 import websockets
+from .calibration import Calibrations
 from .client_manager import ClientManager
 from .config import config
+from .frames import ENCODING_FORMATS, DeltaState, FrameError, decode_frame, frame_to_messages
 
 logger = logging.getLogger(__name__)
 
@@ -15,16 +18,32 @@ class MessageHandler:
     
     def __init__(self, client_manager: ClientManager):
         self.client_manager = client_manager
+        # Delta-encoding chain of each device, by device id
+        self.delta_states: Dict[int, DeltaState] = {}
+        # Scales of devices in raw readout, by device id
+        self.calibrations = Calibrations()
     
-    async def handle_message(self, message: str, websocket: websockets.WebSocketServerProtocol) -> None:
+    def _note_latency(self, device_id: Any, sample: Dict[str, Any], replay: bool) -> None:
+        """Log how long a live sample with a UTC timestamp took from acquisition to here"""
+        if replay or not sample.get("utc") or not isinstance(sample.get("timestamp_us"), (int, float)):
+            return
+        latency_ms = (time.time() * 1e6 - sample["timestamp_us"]) / 1000
+        logger.debug(f"Device {device_id}: sample {sample.get('seq')} arrived after {latency_ms:.1f} ms")
+    
+    async def handle_message(self, message: Union[str, bytes], websocket: websockets.WebSocketServerProtocol) -> None:
         """
         Process an incoming message from a client
         
         Args:
-            message: Raw message string
+            message: Raw message string, or bytes for a binary frame
             websocket: The websocket connection that sent the message
         """
         client_ip = websocket.remote_address[0] if websocket.remote_address else "unknown"
+        
+        if isinstance(message, bytes):
+            await self._handle_binary(message, websocket)
+            return
+        
         logger.debug(f"Received from {client_ip}: {message}")
         
         try:
@@ -35,6 +54,14 @@ class MessageHandler:
                 await self._handle_sensor_data(data, websocket)
             elif message_type == "command":
                 await self._handle_command(data, websocket)
+            elif message_type == "hello":
+                await self._handle_hello(data, websocket)
+            elif message_type == "telemetry":
+                await self._handle_telemetry(data, websocket)
+            elif message_type == "status":
+                await self._handle_status(data, websocket)
+            elif message_type == "calibration":
+                await self._handle_calibration(data, websocket)
             else:
                 logger.warning(f"Unknown message type: {message_type}")
         
@@ -43,11 +70,98 @@ class MessageHandler:
         except Exception as e:
             logger.error(f"Error handling message: {e}", exc_info=True)
     
+    async def _handle_binary(self, frame: bytes, sender: websockets.WebSocketServerProtocol) -> None:
+        """Handle binary spectrum frames - pass through or transcode per client"""
+        try:
+            device_id = int.from_bytes(frame[4:6], "little")
+            decoded = decode_frame(frame, self.delta_states.setdefault(device_id, DeltaState()))
+        except FrameError as e:
+            client_ip = sender.remote_address[0] if sender.remote_address else "unknown"
+            logger.warning(f"Bad binary frame from {client_ip}: {e}")
+            return
+        
+        # Clients that take bin1_raw get the counts; JSON clients get values
+        if decoded["raw"] and self.calibrations.apply(
+                decoded["device_id"], [sample["readings"] for sample in decoded["samples"]],
+                decoded["gain"], decoded["integration_cycles"]):
+            decoded["raw"] = False
+        
+        messages = frame_to_messages(decoded)
+        if messages:
+            # The newest sample of a batch waited the least
+            self._note_latency(decoded["device_id"], messages[-1], decoded["replay"])
+        await self.client_manager.broadcast_frame(frame, ENCODING_FORMATS[decoded["encoding"]],
+                                                  messages, sender=sender)
+        logger.debug(f"Broadcasted frame with {len(decoded['samples'])} sample(s)")
+    
+    async def _handle_hello(self, data: Dict[str, Any], sender: websockets.WebSocketServerProtocol) -> None:
+        """
+        Handle connection handshakes. Clients list the formats they accept;
+        devices that can send binary frames are told which one to use.
+        """
+        formats = data.get("formats") or []
+        self.client_manager.set_frame_formats(sender, {f for f in formats if f in config.FRAME_FORMATS})
+        
+        client_ip = sender.remote_address[0] if sender.remote_address else "unknown"
+        logger.info(f"Hello from {client_ip} ({data.get('role', 'client')}), formats: {formats}")
+        
+        if data.get("role") == "device" and config.DEVICE_FORMAT in formats:
+            command = {
+                "type": "command",
+                "action": "set_format",
+                "format": config.DEVICE_FORMAT,
+            }
+            if config.DEVICE_FORMAT == "bin1_delta":
+                command["step"] = config.DELTA_STEP
+            await sender.send(json.dumps(command))
+        
+        if (data.get("role") == "device" and config.DEVICE_READOUT != "calibrated" and
+                config.DEVICE_READOUT in (data.get("readouts") or [])):
+            command = {"type": "command", "action": "set_readout", "mode": config.DEVICE_READOUT}
+            await sender.send(json.dumps(command))
+    
     async def _handle_sensor_data(self, data: Dict[str, Any], sender: websockets.WebSocketServerProtocol) -> None:
-        """Handle sensor data messages - broadcast to all other clients"""
+        """Handle sensor data messages - calibrate raw counts and broadcast to all other clients"""
+        # Standard deviations of oversampled measurements scale like the readings
+        lists = [data[key] for key in ("readings", "std") if isinstance(data.get(key), list)]
+        if data.get("raw") and lists and self.calibrations.apply(
+                data.get("device_id"), lists, data.get("gain"), data.get("integration_cycles")):
+            for key in ("raw", "gain", "integration_cycles"):
+                data.pop(key, None)
+        self._note_latency(data.get("device_id"), data, bool(data.get("replay")))
         await self.client_manager.broadcast(data, sender=sender)
         logger.debug("Broadcasted sensor data to all clients")
     
+    async def _handle_telemetry(self, data: Dict[str, Any], sender: websockets.WebSocketServerProtocol) -> None:
+        """Handle device health reports - broadcast to all other clients"""
+        await self.client_manager.broadcast(data, sender=sender)
+        logger.debug(f"Telemetry: heap {data.get('heap_free')} B free, rssi {data.get('rssi')} dBm, "
+                     f"clock offset {data.get('clock_offset_us')} us, drift {data.get('clock_drift_ppb')} ppb")
+    
+    async def _handle_calibration(self, data: Dict[str, Any], sender: websockets.WebSocketServerProtocol) -> None:
+        """Handle a device's raw-count scales - keep them and broadcast to all other clients"""
+        client_ip = sender.remote_address[0] if sender.remote_address else "unknown"
+        if not self.calibrations.update(data):
+            logger.warning(f"Malformed calibration from {client_ip}")
+            return
+        logger.info(f"Calibration for device {data['device_id']} (from {client_ip}), "
+                    f"gain {data['gain']}, {data['integration_cycles']} cycles")
+        await self.client_manager.broadcast(data, sender=sender)
+    
+    async def _handle_status(self, data: Dict[str, Any], sender: websockets.WebSocketServerProtocol) -> None:
+        """Handle device status messages - log boot and low-power reports and broadcast to all other clients"""
+        boot = data.get("boot")
+        if isinstance(boot, dict):
+            client_ip = sender.remote_address[0] if sender.remote_address else "unknown"
+            phases = ", ".join(f"{k} {v} ms" for k, v in boot.items() if k != "version")
+            logger.info(f"Boot of {client_ip} (firmware {boot.get('version', '?')}): {phases}")
+        lowpower = data.get("lowpower")
+        if isinstance(lowpower, dict):
+            logger.info(f"Low-power upload: {lowpower.get('samples')} samples, "
+                        f"{lowpower.get('energy_uj_per_sample')} uJ/sample, "
+                        f"{lowpower.get('avg_current_ua')} uA average")
+        await self.client_manager.broadcast(data, sender=sender)
+    
     async def _handle_command(self, data: Dict[str, Any], sender: websockets.WebSocketServerProtocol) -> None:
         """Handle command messages - validate and broadcast to all clients"""
         action = data.get("action")
@@ -62,6 +176,13 @@ class MessageHandler:
             "timestamp": datetime.now().isoformat()
         }
         
+        for name, kind in config.COMMAND_PARAMS.get(action, {}).items():
+            value = data.get(name)
+            kinds = kind if isinstance(kind, tuple) else (kind,)
+            # bool is an int subclass; only forward it where a bool is expected
+            if isinstance(value, kinds) and not (isinstance(value, bool) and bool not in kinds):
+                command[name] = value
+        
         await self.client_manager.broadcast(command, sender=sender)
         client_ip = sender.remote_address[0] if sender.remote_address else "unknown"
         logger.info(f"Broadcasted command '{action}' to all clients (from {client_ip})")
@@ -0,0 +1,155 @@
+"""Tests for the binary spectrum frame decoder
+
+Run from AS7265/ with: python -m unittest websocket_server.test_frames
+"""
+import struct
+import unittest
+
+from . import frames
+from .frames import (ALL_CHANNELS, ENC_DELTA, ENC_F32, ENC_I16, ENC_U16, FLAG_KEYFRAME,
+                     FLAG_RAW, FLAG_REPLAY, FLAG_STREAM, FLAG_UTC, HEADER, DeltaState,
+                     FrameError, decode_frame, frame_to_messages)
+
+
+def header(encoding, count, seq, mask=ALL_CHANNELS, flags=0, timestamp_us=1_000_000,
+           scale=1.0, device_id=0x1234, version=frames.FRAME_VERSION,
+           frame_type=frames.FRAME_TYPE_SPECTRUM):
+    return HEADER.pack(version, frame_type, encoding, flags, device_id, count, seq, mask,
+                       timestamp_us, scale, 3, 50, 0)
+
+
+def fixed_frame(encoding, samples, seq=10, mask=ALL_CHANNELS, **kwargs):
+    """samples: (time offset in us, values of the channels in mask)"""
+    code = {ENC_F32: "f", ENC_I16: "h", ENC_U16: "H"}[encoding]
+    body = b"".join(struct.pack("<I" + code * len(values), dt, *values) for dt, values in samples)
+    return header(encoding, len(samples), seq, mask, **kwargs) + body
+
+
+def varint(value):
+    out = bytearray()
+    value &= 0xFFFFFFFF
+    while value >= 0x80:
+        out.append(value & 0x7F | 0x80)
+        value >>= 7
+    out.append(value)
+    return bytes(out)
+
+
+def delta_frame(samples, seq, prev, step=0.5, mask=ALL_CHANNELS, keyframe=False):
+    """samples: (time offset in us, quantized values); prev is the last sample
+    of the preceding frame"""
+    channels = [ch for ch in range(frames.NUM_CHANNELS) if mask & (1 << ch)]
+    body = bytearray()
+    for dt, values in samples:
+        body += varint(dt)
+        for ch, value in zip(channels, values):
+            delta = value - prev[ch]
+            body += varint((delta << 1) ^ (delta >> 31))
+            prev[ch] = value
+    flags = FLAG_STREAM | (FLAG_KEYFRAME if keyframe else 0)
+    return header(ENC_DELTA, len(samples), seq, mask, flags=flags, scale=step) + bytes(body)
+
+
+class FixedEncodingTest(unittest.TestCase):
+    def test_f32_frame(self):
+        values = [float(ch) + 0.25 for ch in range(18)]
+        frame = decode_frame(fixed_frame(ENC_F32, [(0, values), (5000, values[::-1])]))
+
+        self.assertEqual(frame["device_id"], 0x1234)
+        self.assertEqual(frame["gain"], 3)
+        self.assertEqual(frame["integration_cycles"], 50)
+        self.assertEqual([s["seq"] for s in frame["samples"]], [10, 11])
+        self.assertEqual([s["timestamp_us"] for s in frame["samples"]], [1_000_000, 1_005_000])
+        self.assertEqual(frame["samples"][0]["readings"], values)
+        self.assertEqual(frame["samples"][1]["readings"], values[::-1])
+
+    def test_i16_frame_with_channel_subset(self):
+        mask = (1 << 0) | (1 << 14) | (1 << 17)
+        frame = decode_frame(fixed_frame(ENC_I16, [(0, [-4, 100, 2])], mask=mask, scale=0.25))
+        readings = frame["samples"][0]["readings"]
+
+        self.assertEqual((readings[0], readings[14], readings[17]), (-1.0, 25.0, 0.5))
+        self.assertEqual(sum(r is None for r in readings), 15)
+        message = frame_to_messages(frame)[0]
+        self.assertEqual(message["channel_mask"], mask)
+
+    def test_raw_u16_frame(self):
+        frame = decode_frame(fixed_frame(ENC_U16, [(0, [65535] * 18)], flags=FLAG_RAW))
+
+        self.assertTrue(frame["raw"])
+        self.assertEqual(frame["samples"][0]["readings"], [65535.0] * 18)
+        message = frame_to_messages(frame)[0]
+        self.assertTrue(message["raw"])
+        self.assertEqual((message["gain"], message["integration_cycles"]), (3, 50))
+
+    def test_flags_reach_messages(self):
+        data = fixed_frame(ENC_F32, [(0, [1.0] * 18)], flags=FLAG_STREAM | FLAG_REPLAY | FLAG_UTC,
+                           timestamp_us=1_760_000_000_000_000)
+        message = frame_to_messages(decode_frame(data))[0]
+
+        self.assertEqual(message["mode"], "debug")
+        self.assertTrue(message["replay"])
+        self.assertTrue(message["utc"])
+        self.assertEqual(message["timestamp_us"], 1_760_000_000_000_000)
+        self.assertNotIn("channel_mask", message)
+
+    def test_malformed_frames(self):
+        good = fixed_frame(ENC_F32, [(0, [0.0] * 18)])
+        bad = [
+            good[:HEADER.size - 1],
+            good[:-1],
+            header(ENC_F32, 1, 0, version=2),
+            header(ENC_F32, 1, 0, frame_type=9),
+            header(7, 0, 0),
+        ]
+        for data in bad:
+            with self.subTest(length=len(data)):
+                with self.assertRaises(FrameError):
+                    decode_frame(data)
+
+
+class DeltaEncodingTest(unittest.TestCase):
+    def setUp(self):
+        self.state = DeltaState()
+        self.sent = [0] * 18
+
+    def test_chain_of_frames(self):
+        first = [[ch * 10 for ch in range(18)], [ch * 10 - 3 for ch in range(18)]]
+        second = [[-(1 << 20)] * 18]
+
+        frame = decode_frame(delta_frame([(0, first[0]), (250, first[1])], 100, self.sent,
+                                         keyframe=True), self.state)
+        self.assertEqual([s["timestamp_us"] for s in frame["samples"]], [1_000_000, 1_000_250])
+        self.assertEqual(frame["samples"][1]["readings"], [v * 0.5 for v in first[1]])
+
+        frame = decode_frame(delta_frame([(0, second[0])], 102, self.sent), self.state)
+        self.assertEqual(frame["samples"][0]["seq"], 102)
+        self.assertEqual(frame["samples"][0]["readings"], [v * 0.5 for v in second[0]])
+
+    def test_lost_predecessor_waits_for_keyframe(self):
+        decode_frame(delta_frame([(0, [5] * 18)], 0, self.sent, keyframe=True), self.state)
+        with self.assertRaises(FrameError):
+            decode_frame(delta_frame([(0, [6] * 18)], 2, self.sent), self.state)
+        # The chain stays broken until the next keyframe
+        with self.assertRaises(FrameError):
+            decode_frame(delta_frame([(0, [7] * 18)], 3, self.sent), self.state)
+
+        frame = decode_frame(delta_frame([(0, [8] * 18)], 4, [0] * 18, keyframe=True), self.state)
+        self.assertEqual(frame["samples"][0]["readings"], [4.0] * 18)
+
+    def test_truncated_frame_keeps_chain(self):
+        decode_frame(delta_frame([(0, [5] * 18)], 0, self.sent, keyframe=True), self.state)
+        data = delta_frame([(0, [9] * 18)], 1, list(self.sent))
+        with self.assertRaises(FrameError):
+            decode_frame(data[:-1], self.state)
+
+        frame = decode_frame(data, self.state)
+        self.assertEqual(frame["samples"][0]["readings"], [4.5] * 18)
+
+    def test_needs_state(self):
+        with self.assertRaises(FrameError):
+            decode_frame(delta_frame([(0, [1] * 18)], 0, self.sent, keyframe=True))
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,67 @@
+"""Tests for the relay's command forwarding
+
+Run from AS7265/ with: python -m unittest websocket_server.test_message_handler
+"""
+import json
+import unittest
+
+from .client_manager import ClientManager
+from .message_handler import MessageHandler
+
+
+class FakeSocket:
+    """Stands in for a websocket connection and keeps what is sent to it"""
+
+    def __init__(self, ip: str):
+        self.remote_address = (ip, 0)
+        self.sent = []
+
+    async def send(self, message):
+        self.sent.append(message)
+
+
+class CommandForwardingTest(unittest.IsolatedAsyncioTestCase):
+    async def asyncSetUp(self):
+        self.clients = ClientManager()
+        self.handler = MessageHandler(self.clients)
+        self.dashboard = FakeSocket("10.0.0.2")
+        self.device = FakeSocket("10.0.0.3")
+        self.clients.add_client(self.dashboard)
+        self.clients.add_client(self.device)
+
+    async def forward(self, command):
+        await self.handler.handle_message(json.dumps({"type": "command", **command}), self.dashboard)
+        self.assertEqual(len(self.device.sent), 1)
+        return json.loads(self.device.sent[0])
+
+    async def test_bool_parameter_is_forwarded(self):
+        sent = await self.forward({"action": "set_scan", "ambient": True})
+        self.assertIs(sent["ambient"], True)
+
+    async def test_bool_is_not_forwarded_as_number(self):
+        sent = await self.forward({"action": "set_scan", "ambient": False, "bulbs": True})
+        self.assertIs(sent["ambient"], False)
+        self.assertNotIn("bulbs", sent)
+
+    async def test_number_parameter_is_forwarded(self):
+        sent = await self.forward({"action": "set_scan", "bulbs": 5})
+        self.assertEqual(sent["bulbs"], 5)
+
+    async def test_bool_is_not_forwarded_for_int_or_float(self):
+        for action, name in (("set_interval", "interval_ms"), ("set_rate", "rate_hz"),
+                             ("set_oversample", "trim_pct"), ("set_oversample", "noise_target_pct")):
+            with self.subTest(action=action, name=name):
+                self.device.sent.clear()
+                sent = await self.forward({"action": action, name: True})
+                self.assertNotIn(name, sent)
+
+    async def test_int_or_float_parameter_is_forwarded(self):
+        sent = await self.forward({"action": "set_interval", "interval_ms": 250})
+        self.assertEqual(sent["interval_ms"], 250)
+        self.device.sent.clear()
+        sent = await self.forward({"action": "set_rate", "rate_hz": 2.5})
+        self.assertEqual(sent["rate_hz"], 2.5)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -13,8 +13,10 @@ const autoRefreshCheckbox = document.getElementById('auto-refresh');
 const measureButton = document.getElementById('uv-test-button');
 const countdownDisplay = document.getElementById('countdown-display');
 const debugBtn = document.getElementById('debug-toggle-btn');
+const batchSelect = document.getElementById('debug-batch-select');
 let debugEnabled = false;
 let uvChart = null;
+let healthChart = null;
 let ws = null;
 
 // --- UV Index Categories ---
@@ -136,31 +138,262 @@ function startMeasurementSequence() {
   }
 }
 
+// --- Binary spectrum frames (see AS7265/rgbesp/main/frame.h) ---
+const FRAME_VERSION = 1;
+const FRAME_TYPE_SPECTRUM = 1;
+const FRAME_HEADER_SIZE = 32;
+const FRAME_ENC_F32 = 0;
+const FRAME_ENC_I16 = 1;
+const FRAME_ENC_DELTA = 2;
+const FRAME_FLAG_STREAM = 0x01;
+const FRAME_FLAG_KEYFRAME = 0x02;
+const FRAME_FLAG_REPLAY = 0x04;
+const FRAME_FLAG_UTC = 0x20;
+const NUM_CHANNELS = 18;
+
+// Delta chains by device id: { nextSeq, step, prev[] }
+const deltaStates = new Map();
+
+function readVarint(view, pos) {
+  let value = 0;
+  for (let shift = 0; shift < 35; shift += 7) {
+    const byte = view.getUint8(pos.offset++);
+    value += (byte & 0x7f) * 2 ** shift;
+    if (!(byte & 0x80)) return value >>> 0;
+  }
+  throw new RangeError("varint too long");
+}
+
+// Samples of a delta frame, or null if its predecessor never arrived
+function decodeDeltaSamples(view, deviceId, count, channels, seq, flags, step) {
+  let state = deltaStates.get(deviceId);
+  if (flags & FRAME_FLAG_KEYFRAME) {
+    state = { nextSeq: seq, step, prev: Array(NUM_CHANNELS).fill(0) };
+  } else if (!state || state.nextSeq !== seq || state.step !== step) {
+    deltaStates.delete(deviceId);
+    return null;
+  }
+
+  const prev = state.prev.slice();
+  const pos = { offset: FRAME_HEADER_SIZE };
+  const samples = [];
+  let dtUs = 0;
+  for (let i = 0; i < count; i++) {
+    dtUs += readVarint(view, pos);
+    const readings = Array(NUM_CHANNELS).fill(null);
+    for (const ch of channels) {
+      const zz = readVarint(view, pos);
+      prev[ch] = (prev[ch] + ((zz >>> 1) ^ -(zz & 1))) | 0;
+      readings[ch] = prev[ch] * step;
+    }
+    samples.push({ dtUs, readings });
+  }
+
+  deltaStates.set(deviceId, { nextSeq: (seq + count) >>> 0, step, prev });
+  return samples;
+}
+
+// Returns the frame as legacy sensor messages, one per sample
+function decodeFrame(buffer) {
+  const view = new DataView(buffer);
+  if (buffer.byteLength < FRAME_HEADER_SIZE) return [];
+
+  const version = view.getUint8(0);
+  const type = view.getUint8(1);
+  const encoding = view.getUint8(2);
+  const flags = view.getUint8(3);
+  if (version !== FRAME_VERSION || type !== FRAME_TYPE_SPECTRUM) return [];
+  if (encoding !== FRAME_ENC_F32 && encoding !== FRAME_ENC_I16 && encoding !== FRAME_ENC_DELTA) return [];
+
+  const deviceId = view.getUint16(4, true);
+  const count = view.getUint16(6, true);
+  const seq = view.getUint32(8, true);
+  const mask = view.getUint32(12, true);
+  const timestampUs = Number(view.getBigUint64(16, true));
+  const scale = view.getFloat32(24, true);
+
+  const channels = [];
+  for (let ch = 0; ch < NUM_CHANNELS; ch++) if (mask & (1 << ch)) channels.push(ch);
+
+  let samples = [];
+  if (encoding === FRAME_ENC_DELTA) {
+    samples = decodeDeltaSamples(view, deviceId, count, channels, seq, flags, scale);
+    if (!samples) return [];
+  } else {
+    let offset = FRAME_HEADER_SIZE;
+    for (let i = 0; i < count; i++) {
+      const dtUs = view.getUint32(offset, true);
+      offset += 4;
+      const readings = Array(NUM_CHANNELS).fill(null);
+      for (const ch of channels) {
+        if (encoding === FRAME_ENC_I16) {
+          readings[ch] = view.getInt16(offset, true) * scale;
+          offset += 2;
+        } else {
+          readings[ch] = view.getFloat32(offset, true);
+          offset += 4;
+        }
+      }
+      samples.push({ dtUs, readings });
+    }
+  }
+
+  return samples.map(({ dtUs, readings }, i) => {
+    const message = { type: "sensor", readings, seq: seq + i, timestamp_us: timestampUs + dtUs, device_id: deviceId };
+    if (flags & FRAME_FLAG_STREAM) message.mode = "debug";
+    if (flags & FRAME_FLAG_REPLAY) message.replay = true;
+    if (flags & FRAME_FLAG_UTC) message.utc = true;
+    return message;
+  });
+}
+
 // --- WebSocket Setup ---
 function initWebSocket() {
     if (typeof WEBSOCKET_URL === 'undefined') return;
     ws = new WebSocket('ws://10.98.101.52:8765');
-    ws.onopen = () => console.log("WebSocket connected");
-    ws.onmessage = (event) => handleIncomingData(JSON.parse(event.data));
+    ws.binaryType = 'arraybuffer';
+    ws.onopen = () => {
+        console.log("WebSocket connected");
+        // Ask the relay to forward binary frames as-is
+        ws.send(JSON.stringify({ type: "hello", role: "dashboard", formats: ["json", "bin1", "bin1_i16", "bin1_delta"] }));
+    };
+    ws.onmessage = (event) => {
+        if (event.data instanceof ArrayBuffer) {
+            decodeFrame(event.data).forEach(handleIncomingData);
+        } else {
+            handleIncomingData(JSON.parse(event.data));
+        }
+    };
     ws.onclose = () => setTimeout(initWebSocket, 3000);
 }
 
 // --- UNIFIED DATA HANDLER (Fixed) ---
 function handleIncomingData(data) {
+  // UTC timestamps mark the end of the integration, so this is end-to-end
+  if (data.type === "sensor" && data.utc && !data.replay) {
+    lastLatencyMs = Date.now() - data.timestamp_us / 1000;
+  }
+  // Spectra logged while the sensor was offline are history, not a new scan
+  if (data.type === "sensor" && data.replay) return;
+  // Raw ADC counts the relay had no calibration for
+  if (data.type === "sensor" && data.raw) return;
+  // Bulb-off half of an ambient-corrected scan; the corrected spectrum follows
+  if (data.type === "sensor" && data.ambient) return;
   if(data.type === "sensor" && debugEnabled) {
-    const readings = data.readings.map((val, i) => `Ch${i+1}: ${val.toFixed(2)}`).join("\n");
+    // Channels outside the device's channel mask are null
+    const readings = data.readings.map((val, i) => `Ch${i+1}: ${val == null ? '-' : val.toFixed(2)}`).join("\n");
     document.getElementById("debug-log").textContent = readings;
   }
-  if (data.type === "sensor" && !debugEnabled) {
+  // Stream samples (another tab's debug session, the boot spectrum) are not a scan
+  if (data.type === "sensor" && !debugEnabled && data.mode !== "debug") {
       console.log("Sensor data received"); 
-      sendReadingsToBackend(data.readings);
+      // A calibrated sensor sends its colour along with the reflectance
+      sendReadingsToBackend(data.readings, data.xyz ? data : null);
       
   } else if (data.type === "status") {
       console.log("Status:", data.message);
+      if (data.boot) console.log("Sensor boot timeline (ms):", data.boot);
+  } else if (data.type === "telemetry") {
+      updateHealth(data);
   }
 }
 
-function sendReadingsToBackend(readings) {
+// --- Sensor Health (telemetry from the device) ---
+// Points kept on the health chart: 60 messages is 10 minutes at the default rate
+const HEALTH_HISTORY = 60;
+// Free heap below this is flagged
+const HEALTH_LOW_HEAP = 20000;
+// Acquisition-to-browser time of the last live spectrum with a UTC timestamp
+let lastLatencyMs = null;
+
+function formatUs(us) {
+  if (us == null) return "-";
+  return us >= 1000 ? `${(us / 1000).toFixed(1)} ms` : `${us} µs`;
+}
+
+function updateHealth(t) {
+  const us = t.us || {};
+  const readout = us.readout || {};
+  const send = us.send || {};
+
+  document.getElementById("health-card").style.display = "block";
+  const heapEl = document.getElementById("health-heap");
+  heapEl.innerText = `${(t.heap_free / 1024).toFixed(0)} KB (min ${(t.heap_min / 1024).toFixed(0)})`;
+  heapEl.parentElement.classList.toggle("health-warn", t.heap_min < HEALTH_LOW_HEAP);
+  document.getElementById("health-rssi").innerText = t.rssi == null ? "offline" : `${t.rssi} dBm`;
+  document.getElementById("health-reconnects").innerText =
+    t.wifi_connect_ms != null ? `${t.wifi_reconnects} (last ${t.wifi_connect_ms} ms)` : t.wifi_reconnects;
+  const queueEl = document.getElementById("health-queue");
+  queueEl.innerText = `${t.queue_depth} / ${t.queue_dropped + t.offline_dropped}`;
+  queueEl.parentElement.classList.toggle("health-warn", t.queue_dropped + t.offline_dropped > 0);
+  document.getElementById("health-readout").innerText = readout.n ? formatUs(readout.p99) : "-";
+  document.getElementById("health-send").innerText = send.n ? formatUs(send.p99) : "-";
+  document.getElementById("health-clock").innerText = t.clock_synced
+    ? `${(t.clock_offset_us / 1000).toFixed(1)} ms, ${(t.clock_drift_ppb / 1000).toFixed(1)} ppm`
+    : "not synced";
+  document.getElementById("health-latency").innerText =
+    lastLatencyMs == null ? "-" : `${lastLatencyMs.toFixed(0)} ms`;
+  document.getElementById("health-timestamp").innerText = new Date().toLocaleTimeString();
+
+  const label = new Date().toLocaleTimeString([], {hour: '2-digit', minute: '2-digit', second: '2-digit'});
+  const point = [
+    readout.n ? readout.p99 / 1000 : null,
+    send.n ? send.p99 / 1000 : null,
+    t.heap_free / 1024,
+  ];
+
+  if (!healthChart) {
+    const ctx = document.getElementById('health-chart').getContext('2d');
+    healthChart = new Chart(ctx, {
+      type: 'line',
+      data: {
+        labels: [],
+        datasets: [
+          { label: 'Readout p99 (ms)', data: [], borderColor: '#fd7e14', yAxisID: 'ms' },
+          { label: 'Send p99 (ms)', data: [], borderColor: '#007bff', yAxisID: 'ms' },
+          { label: 'Free heap (KB)', data: [], borderColor: '#28a745', yAxisID: 'kb' },
+        ].map(d => ({ ...d, pointRadius: 0, borderWidth: 2, tension: 0.3, spanGaps: true }))
+      },
+      options: {
+        responsive: true,
+        maintainAspectRatio: false,
+        animation: false,
+        scales: {
+          x: { ticks: { autoSkip: true, maxTicksLimit: 6 } },
+          ms: { position: 'left', beginAtZero: true },
+          kb: { position: 'right', beginAtZero: true, grid: { drawOnChartArea: false } }
+        },
+        plugins: { legend: { labels: { boxWidth: 12, font: { size: 11 } } } },
+        interaction: { intersect: false, mode: 'index' },
+      }
+    });
+  }
+
+  healthChart.data.labels.push(label);
+  healthChart.data.datasets.forEach((d, i) => d.data.push(point[i]));
+  if (healthChart.data.labels.length > HEALTH_HISTORY) {
+    healthChart.data.labels.shift();
+    healthChart.data.datasets.forEach(d => d.data.shift());
+  }
+  healthChart.update();
+}
+
+// CIE XYZ (D65, Y of white = 1) to 8-bit sRGB
+function xyzToRGB(xyz) {
+    const [x, y, z] = xyz;
+    const linear = [
+         3.2406 * x - 1.5372 * y - 0.4986 * z,
+        -0.9689 * x + 1.8758 * y + 0.0415 * z,
+         0.0557 * x - 0.2040 * y + 1.0570 * z,
+    ];
+    return linear.map(v => {
+        v = Math.min(Math.max(v, 0), 1);
+        v = v <= 0.0031308 ? 12.92 * v : 1.055 * Math.pow(v, 1 / 2.4) - 0.055;
+        return Math.round(255 * v);
+    });
+}
+
+function sendReadingsToBackend(readings, colour) {
     const resultBox = document.getElementById("skin-analysis-result");
     const display = document.getElementById("countdown-display");
     const alertBox = document.getElementById("extreme-alert"); 
@@ -171,7 +404,8 @@ function sendReadingsToBackend(readings) {
     fetch(SPF_ENDPOINT, {
         method: 'POST',
         headers: { 'Content-Type': 'application/json' },
-        body: JSON.stringify({ 'readings': readings })
+        body: JSON.stringify(colour ? { 'readings': readings, 'ita': colour.ita, 'lab': colour.lab }
+                                    : { 'readings': readings })
     })
     .then(response => response.json())
     .then(data => {
@@ -194,6 +428,13 @@ function sendReadingsToBackend(readings) {
             }
             console.log(readings)
 
+            if (colour) {
+                const [r, g, b] = xyzToRGB(colour.xyz);
+                document.getElementById("color-preview").style.backgroundColor = `rgb(${r},${g},${b})`;
+                resultBox.style.display = "block";
+                return;
+            }
+
             const red_uW   = readings[0];
             const green_uW = readings[17];
             const blue_uW  = readings[14];
@@ -230,10 +471,27 @@ function sendReadingsToBackend(readings) {
 }
 
 // --- Debug & Simulators ---
+// Debug stream batching: the sensor packs this many spectra into one frame,
+// but never holds one back for more than BATCH_MAX_MS
+const BATCH_MAX_MS = 250;
+
+function sendBatchSetting() {
+  if (!batchSelect || !ws || ws.readyState !== WebSocket.OPEN) return;
+  ws.send(JSON.stringify({
+    type: "command",
+    action: "set_batch",
+    size: parseInt(batchSelect.value, 10),
+    max_ms: BATCH_MAX_MS
+  }));
+}
+
+if (batchSelect) batchSelect.addEventListener('change', sendBatchSetting);
+
 debugBtn.addEventListener('click', () => {
   if (!debugEnabled) {
     // Only send the command if we are actually connected to a real sensor
     if(ws && ws.readyState === WebSocket.OPEN) {
+        sendBatchSetting();
         ws.send(JSON.stringify({ type: "command", action: "debug_on" }));
     }
     debugBtn.innerText = "Disable Debug Stream";
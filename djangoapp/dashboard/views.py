@@ -52,6 +52,15 @@ def determine_skin_type(readings):
     elif avg_reflection > 4.0: return "Type V (Dark Brown)"
     else: return "Type VI (Deeply Pigmented)"
 
+# Skin type from a measured individual typology angle (Chardon et al.)
+def skin_type_from_ita(ita):
+    if ita > 55: return "Type I (Pale White)"
+    elif ita > 41: return "Type II (White)"
+    elif ita > 28: return "Type III (Cream White)"
+    elif ita > 10: return "Type IV (Moderate Brown)"
+    elif ita > -30: return "Type V (Dark Brown)"
+    else: return "Type VI (Deeply Pigmented)"
+
 def get_detailed_recommendation(skin_type, uv_index):
     # Default values
     rec = {
@@ -119,13 +128,19 @@ def calculate_spf(request):
     if request.method == 'POST':
         try:
             data = json.loads(request.body)
-            readings = data.get('readings', [])
+            # Channels the sensor did not read come as null
+            readings = [r for r in data.get('readings', []) if r is not None]
             
             latest_uv = UVData.objects.order_by('-timestamp').first()
             current_uv_index = latest_uv.uv_value if latest_uv else 0
             
-            skin_type = determine_skin_type(readings)
-            ita_score = calculate_ita(readings)
+            # A calibrated sensor measures the ITA itself
+            if data.get('ita') is not None:
+                ita_score = round(float(data['ita']), 1)
+                skin_type = skin_type_from_ita(ita_score)
+            else:
+                skin_type = determine_skin_type(readings)
+                ita_score = calculate_ita(readings)
             advice = get_detailed_recommendation(skin_type, current_uv_index)
             
             return JsonResponse({